@@ -0,0 +1,12 @@
+/* Host build: ELF payloads only run on the console. */
+#include <errno.h>
+#include <stdint.h>
+
+#include "../shsrv/elfldr.h"
+
+pid_t elfldr_spawn(int stdin_fd, int stdout_fd, int stderr_fd,
+                   uint8_t *elf, char* argv[]) {
+  (void)stdin_fd; (void)stdout_fd; (void)stderr_fd; (void)elf; (void)argv;
+  errno = ENOSYS;
+  return -1;
+}
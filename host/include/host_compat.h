@@ -0,0 +1,7 @@
+#pragma once
+/* Force-included into every host translation unit (see HOST_SVR_CFLAGS). */
+#include <limits.h>
+
+#ifndef SYS_thr_set_name
+#define SYS_thr_set_name -1   /* syscall() fails with ENOSYS */
+#endif
@@ -0,0 +1,3 @@
+#pragma once
+/* Host build: shsrv/pt.h is included by builtins.c but unused on hosts. */
+struct reg { long r_rip; };
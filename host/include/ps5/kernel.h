@@ -0,0 +1,2 @@
+#pragma once
+/* Host build: nothing from the PS5 kernel API is used outside shsrv/. */
@@ -0,0 +1,6 @@
+#pragma once
+/* Host build: the kernel log goes to stderr. */
+#include <stdio.h>
+
+#define klog_printf(...) fprintf(stderr, __VA_ARGS__)
+#define klog_perror(s)   perror(s)
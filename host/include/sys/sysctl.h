@@ -0,0 +1,11 @@
+#pragma once
+/* Host build: just enough of FreeBSD's sysctl(3) for the process table,
+ * served from /proc by host/sysctl_proc.c. */
+#include <stddef.h>
+
+#define CTL_KERN        1
+#define KERN_PROC       14
+#define KERN_PROC_PROC  8
+
+int sysctl(const int* name, unsigned namelen, void* oldp, size_t* oldlenp,
+           const void* newp, size_t newlen);
@@ -0,0 +1,10 @@
+#pragma once
+/* Host build: the kinfo_proc fields the builtins read. */
+#include <sys/types.h>
+
+struct kinfo_proc {
+  pid_t ki_pid, ki_ppid, ki_pgid, ki_sid;
+  uid_t ki_uid;
+  char  ki_stat;
+  char  ki_comm[20];
+};
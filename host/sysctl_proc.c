@@ -0,0 +1,66 @@
+/* Host build: KERN_PROC_PROC answered from /proc so `ps` has real data. */
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <sys/user.h>
+
+static int proc_entry(const char* pid, struct kinfo_proc* kp) {
+  char path[64], buf[512];
+  snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+  FILE* f = fopen(path, "r");
+  if(!f) return -1;
+  size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = 0;
+  // pid (comm) state ppid pgrp session ...
+  char* lp = strchr(buf, '(');
+  char* rp = strrchr(buf, ')');
+  if(!lp || !rp) return -1;
+  memset(kp, 0, sizeof(*kp));
+  size_t clen = (size_t)(rp - lp - 1);
+  if(clen >= sizeof(kp->ki_comm)) clen = sizeof(kp->ki_comm) - 1;
+  memcpy(kp->ki_comm, lp + 1, clen);
+  char st;
+  int ppid, pgid, sid;
+  if(sscanf(rp + 2, "%c %d %d %d", &st, &ppid, &pgid, &sid) != 4) return -1;
+  kp->ki_pid = atoi(pid);
+  kp->ki_ppid = ppid;
+  kp->ki_pgid = pgid;
+  kp->ki_sid = sid;
+  // FreeBSD SIDL..SZOMB
+  kp->ki_stat = st == 'R' ? 2 : st == 'T' ? 4 : st == 'Z' ? 5 : 3;
+  struct stat sb;
+  snprintf(path, sizeof(path), "/proc/%s", pid);
+  if(stat(path, &sb) == 0) kp->ki_uid = sb.st_uid;
+  return 0;
+}
+
+int sysctl(const int* name, unsigned namelen, void* oldp, size_t* oldlenp,
+           const void* newp, size_t newlen) {
+  (void)newp; (void)newlen;
+  if(namelen < 3 || name[0] != CTL_KERN || name[1] != KERN_PROC ||
+     name[2] != KERN_PROC_PROC || !oldlenp) {
+    errno = ENOSYS;
+    return -1;
+  }
+  DIR* d = opendir("/proc");
+  if(!d) return -1;
+  size_t max = oldp ? *oldlenp / sizeof(struct kinfo_proc) : 0;
+  size_t count = 0;
+  struct dirent* de;
+  while((de = readdir(d))) {
+    if(!isdigit((unsigned char)de->d_name[0])) continue;
+    if(!oldp) { count++; continue; }
+    if(count == max) break;
+    if(proc_entry(de->d_name, (struct kinfo_proc*)oldp + count) == 0) count++;
+  }
+  closedir(d);
+  // leave headroom between the size probe and the fetch, like the kernel
+  *oldlenp = (oldp ? count : count + 16) * sizeof(struct kinfo_proc);
+  return 0;
+}
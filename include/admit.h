@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+
+/* Admission control for the accept path. A connection is checked before any
+ * session state exists for it; rejected ones are closed straight away and
+ * only show up in the counters. Zero disables a limit. */
+
+typedef struct admit_limits {
+  int backlog;        // listen() queue length
+  int max_sessions;   // concurrent client connections
+  int max_per_ip;     // concurrent client connections from one address
+  int rate;           // new connections per second (token bucket refill)
+  int burst;          // token bucket depth
+} admit_limits_t;
+
+typedef enum {
+  ADMIT_OK,
+  ADMIT_FULL,         // max_sessions reached
+  ADMIT_PER_IP,       // max_per_ip reached
+  ADMIT_RATE,         // bucket empty
+} admit_verdict_t;
+
+typedef struct admit_stats {
+  uint64_t admitted;
+  uint64_t rejected[ADMIT_RATE + 1];   // by verdict
+  uint64_t accept_errors;
+} admit_stats_t;
+
+extern admit_limits_t g_admit;
+
+/* `total` and `from_ip` are the connections currently open. */
+admit_verdict_t admit_check(int total, int from_ip);
+const admit_stats_t* admit_stats(void);
+const char* admit_reason(admit_verdict_t v);
+void admit_note_accept_error(void);
@@ -1,4 +1,40 @@
 #pragma once
 #include <stddef.h>
+
+/* Standard base64 (RFC 4648, '+' '/' and '=' padding). Bulk data goes
+ * through SSE4.1 or AVX2 kernels when the CPU has them, chosen at run time,
+ * with a table-driven scalar fallback. */
+
+/* Returns the encoded length, 4 * ceil(inlen / 3). */
 int b64_encode_block(const unsigned char* in, int inlen, char* out);
-int b64_decode_block(const char* in, int inlen, unsigned char* out);
\ No newline at end of file
+
+/* Strict: inlen must be a multiple of 4, only the alphabet is accepted and
+ * '=' only as one or two trailing padding characters. out needs room for
+ * inlen / 4 * 3 bytes. Returns the decoded length, or -1. */
+int b64_decode_block(const char* in, int inlen, unsigned char* out);
+
+/* Active kernel ("scalar", "sse4" or "avx2"). b64_set_kernel() selects one
+ * by name, e.g. for benchmarks; -1 if this CPU cannot run it. */
+const char* b64_kernel(void);
+int         b64_set_kernel(const char* name);
+
+/* Streaming decoder for uploads. Input may be split anywhere, CR and LF are
+ * ignored wherever they occur, padding may end any group (so separately
+ * encoded lines can follow each other), and a line holding only "." ends the
+ * stream. After an invalid character the rest is skipped up to the
+ * terminator, keeping the command stream in sync. */
+typedef struct b64_stream {
+  char quad[4];   // group carried over from the previous chunk
+  int  nq;
+  int  bol;       // at the beginning of a line
+  int  dot;       // in the terminator line
+  int  done;
+  int  err;
+} b64_stream_t;
+
+void   b64_stream_init(b64_stream_t* s);
+/* Decodes in[0..n) into out, which needs room for n / 4 * 3 + 3 bytes, and
+ * sets *outlen. Returns the bytes consumed: all of them, or up to and
+ * including the terminator line once s->done is set. */
+size_t b64_stream_decode(b64_stream_t* s, const char* in, size_t n,
+                         unsigned char* out, size_t* outlen);
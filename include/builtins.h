@@ -4,12 +4,19 @@
 
 typedef int (*builtin_fn)(int argc, char** argv);
 
+/* Builtin flags */
+#define BI_INLINE  0x1   /* cheap and non-blocking: run inside the listener */
+#define BI_BULK    0x2   /* emits listings/file data: buffer fully, cork */
+
 typedef struct builtin {
   const char* name;
   builtin_fn  fn;
   const char* help;
+  unsigned    flags;
+  const char* preset;   /* alias: argument inserted after argv[0] */
 } builtin_t;
 
 const builtin_t* builtin_table(size_t* count);
-int builtin_is_pipeline_safe(const char* name);
-int run_builtin_in_current(int argc, char** argv, pid_t listener_pid);
\ No newline at end of file
+/* Binary search over the name-sorted table; NULL if not a builtin. */
+const builtin_t* builtin_lookup(const char* name);
+int builtin_run(const builtin_t* b, int argc, char** argv);
@@ -0,0 +1,62 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Server-wide bandwidth scheduler for get, put, cp, getdir/putdir and sync.
+ * Its table lives in an anonymous MAP_SHARED mapping the listener creates
+ * before any job forks, so every job process sees every transfer. Each
+ * transfer paces itself to its share: a server-wide limit (when set) is
+ * split max-min fairly between sessions by weight, and within a session
+ * between its transfers by priority. A transfer that moves less than its
+ * share, held back by the disk or its client, leaves the rest to the others.
+ * Caps apply per transfer whether or not a limit is set. Everything is a
+ * no-op until bw_init() has run. */
+
+#define BW_MAX_XFERS    64
+#define BW_MAX_SESSIONS 64
+#define BW_PATH_MAX     96
+#define BW_DEF_WEIGHT   8      // session weight and transfer priority
+
+typedef struct bw_xfer {
+  int      id;          // 0: free slot
+  pid_t    pid;
+  int      session;
+  int      prio;
+  uint64_t cap;         // bytes/s, 0 for none
+  char     op[8];
+  char     path[BW_PATH_MAX];
+  uint64_t total;       // UINT64_MAX if not known up front
+  uint64_t bytes;
+  double   t0;
+  double   rate;        // recent bytes/s
+  double   share;       // last computed allowance, 0 for unlimited
+} bw_xfer_t;
+
+/* Listener, before sessions start. -1 if there is no shared memory. */
+int  bw_init(void);
+
+/* The job's current transfer: register it, count the bytes it moves (pacing
+ * it to its share; may sleep), and drop it. total is UINT64_MAX if unknown.
+ * One transfer at a time per thread; nested begins are ignored. */
+void bw_begin(const char* op, const char* path, uint64_t total);
+void bw_io(uint64_t n);
+void bw_end(void);
+/* Largest chunk worth moving in one call at the current share (for sendfile,
+ * which would otherwise hand the kernel megabytes at once). */
+size_t bw_chunk(size_t max);
+
+/* Listener: free the slots of a job that exited without bw_end(). */
+void bw_reap(pid_t pid);
+
+/* `transfers`: the server-wide limit, and settings for a session or one of
+ * its transfers. prio/cap given without a transfer become the session's
+ * defaults for the transfers it starts next. -1 for an unknown id. */
+uint64_t bw_limit(void);
+void     bw_set_limit(uint64_t rate);
+int      bw_set_weight(int session, int weight);
+int      bw_set_xfer(int id, int prio, uint64_t cap);   // prio 0 / cap UINT64_MAX: keep
+int      bw_set_default(int session, int prio, uint64_t cap);
+int      bw_session_weight(int session);
+/* Copy of the active transfers; returns how many. */
+int      bw_snapshot(bw_xfer_t* out, int max);
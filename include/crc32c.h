@@ -0,0 +1,12 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), as used by iSCSI and ext4. Start with crc = 0 and
+ * feed the data in any number of pieces. Uses the SSE4.2 crc32 instruction
+ * when the CPU has it, slicing-by-8 tables otherwise. */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+/* CRC of A followed by B, from crc(A), crc(B) and the length of B; lets
+ * ranges checked separately be joined into the CRC of the whole. */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
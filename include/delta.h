@@ -0,0 +1,46 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Block signatures and delta ops for `sync` (rsync's algorithm). The
+ * console sends one signature per block of its copy: a weak rolling checksum
+ * and a strong hash. The client slides a window over its file; where the
+ * weak sum and then the strong hash match a block, it sends a reference to
+ * the block instead of the data.
+ *
+ * Wire format (all integers in network byte order):
+ *   signature: u32 weak, DELTA_STRONG bytes of strong hash
+ *   ops:       'C' u32 block u32 count   copy blocks of the old file
+ *              'L' u32 len, len bytes    literal data
+ *              'E' u64 size u32 crc32c   end: size and CRC-32C of the result
+ */
+
+#define DELTA_STRONG    16      // leading bytes of the block's SHA-256
+#define DELTA_SIG_SIZE  (4 + DELTA_STRONG)
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (256 * 1024)
+#define DELTA_MAX_LIT   (1024 * 1024)   // largest literal op
+
+/* rsync's checksum: a = sum of bytes, b = sum of running a, each mod 2^16. */
+typedef struct delta_roll {
+  uint32_t a, b;
+  size_t   len;
+} delta_roll_t;
+
+void delta_roll_init(delta_roll_t* r, const unsigned char* p, size_t len);
+
+static inline uint32_t delta_roll_sum(const delta_roll_t* r) {
+  return (r->a & 0xffff) | (r->b << 16);
+}
+
+/* Slide the window one byte: out leaves at the front, in enters at the end. */
+static inline void delta_roll_step(delta_roll_t* r, unsigned char out, unsigned char in) {
+  r->a = (r->a - out + in) & 0xffff;
+  r->b = (r->b - (uint32_t)(r->len * out) + r->a) & 0xffff;
+}
+
+uint32_t delta_weak(const void* p, size_t len);
+void     delta_strong(const void* p, size_t len, unsigned char out[DELTA_STRONG]);
+
+/* About sqrt(size), clamped and rounded to a multiple of 1 KiB. */
+uint32_t delta_block_size(uint64_t size);
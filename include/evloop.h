@@ -0,0 +1,20 @@
+#pragma once
+
+/* Minimal readiness loop shared by the listener and its sessions.
+ * kqueue on the console, poll() on hosts without <sys/event.h>.
+ */
+
+#define EVL_READ     0x1
+#define EVL_WRITE    0x2
+#define EVL_MAX_FDS  256
+
+typedef struct evl_event {
+  int   fd;
+  int   mask;
+  void* udata;
+} evl_event_t;
+
+int  evl_init(void);
+void evl_fini(void);
+int  evl_set(int fd, int mask, void* udata);   /* mask 0 removes fd */
+int  evl_wait(evl_event_t* evs, int max, int timeout_ms);
@@ -0,0 +1,48 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Optional HTTP/1.1 file server, run by the listener's event loop on its own
+ * port next to the shell's. It answers GET and HEAD for paths under the
+ * configured roots, so browsers, curl and DirectPKGInstaller can fetch files
+ * by URL: single byte ranges, keep-alive and pipelined requests, and bodies
+ * sent with sendfile() a slice per wakeup so one download cannot stall the
+ * loop. Directories are listed as HTML from a small cache of their entries'
+ * stat results, revalidated against the directory's own mtime. */
+
+#define HTTP_MAX_ROOTS    8
+#define HTTP_MAX_CONNS    32
+#define HTTP_HEAD_MAX     8192                 // request line and headers
+#define HTTP_SLICE        (4 * 1024 * 1024)    // body bytes per wakeup and connection
+#define HTTP_IDLE_SECS    30                   // keep-alive and stalled-send timeout
+#define HTTP_INDEX_SLOTS  8                    // directories whose listing is cached
+#define HTTP_INDEX_TTL    5                    // s a listing is trusted as is
+
+typedef struct http_config {
+  uint16_t    port;                     // 0: off
+  int         nroots;
+  const char* roots[HTTP_MAX_ROOTS];    // none: /data and /mnt
+} http_config_t;
+
+extern http_config_t g_http;
+
+/* Command line: another root to serve. -1 if there are too many. */
+int  http_add_root(const char* path);
+
+/* Listener: start serving on listen_fd (non-blocking, bound to g_http.port). */
+int  http_init(int listen_fd);
+/* Whether an event belongs to the HTTP server, and handling it. */
+int  http_owns(const void* udata);
+void http_event(void* udata, int mask);
+/* Milliseconds until the next connection times out, -1 for none; and
+ * closing the connections that have. */
+int  http_timeout_ms(void);
+void http_sweep(void);
+void http_close_all(void);
+
+/* Job side: close the listener's HTTP sockets inherited across fork(). */
+void http_child(void);
+
+/* The loopback URL of a file the server would serve, for install. -1 if the
+ * server is off or path is outside its roots. */
+int  http_url(const char* path, char* url, size_t len);
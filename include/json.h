@@ -0,0 +1,11 @@
+#pragma once
+
+/* NDJSON records for machine mode. A record is json_begin(type), any number
+ * of fields, then json_end(); it is written to stdout as one line, e.g.
+ *   {"type":"file","name":"a.pkg","size":1024}
+ */
+void json_begin(const char* type);
+void json_str(const char* key, const char* val);
+void json_int(const char* key, long long val);
+void json_bool(const char* key, int val);
+void json_end(void);
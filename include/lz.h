@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Small LZ77 block codec in the LZ4 block format: sequences of a token
+ * (literal count and match length nibbles), literals, a 16-bit little-endian
+ * match offset and length extension bytes; the last sequence carries only
+ * literals. Fast and greedy, meant for the transfer path, not for ratio. */
+
+#define LZ_MIN_MATCH 4
+
+/* Worst case output size for n input bytes. */
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+/* Compress n bytes; returns the compressed size, or 0 if it would exceed
+ * cap (store the block instead). */
+size_t lz_compress(const void* src, size_t n, void* dst, size_t cap);
+
+/* Returns the decompressed size, or -1 on malformed input or if the output
+ * would exceed cap. Never reads or writes out of bounds. */
+long   lz_decompress(const void* src, size_t n, void* dst, size_t cap);
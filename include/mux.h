@@ -0,0 +1,33 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "outbuf.h"
+#include "reader.h"
+
+/* Framed channel multiplexing, entered with the `mux` command. Every frame is
+ *   u8 type | u8 flags (0) | u16 channel | u32 length | payload
+ * with integers in network byte order. OPEN and CLOSE start and end a
+ * channel (the server echoes both), DATA carries channel bytes, and CREDIT
+ * carries a u32 count of DATA bytes the receiver has consumed. A sender may
+ * have at most MUX_WINDOW uncredited bytes in flight per channel.
+ */
+
+#define MUX_HDR       8
+#define MUX_MAX_DATA  8192
+#define MUX_WINDOW    65536
+#define MUX_MAX_CHANS 16
+
+enum { MUX_DATA, MUX_OPEN, MUX_CLOSE, MUX_CREDIT };
+
+typedef struct mux_frame {
+  int         type;
+  unsigned    chan;
+  uint32_t    len;
+  const char* data;   // points into the reader, valid until the next fill
+} mux_frame_t;
+
+/* 1: a frame was consumed from r, 0: incomplete, -1: malformed stream. */
+int  mux_next(reader_t* r, mux_frame_t* f);
+void mux_send(outbuf_t* o, int type, unsigned chan, const void* data, size_t len);
+void mux_send_credit(outbuf_t* o, unsigned chan, uint32_t n);
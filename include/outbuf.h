@@ -0,0 +1,43 @@
+#pragma once
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Coalescing output buffer. Formatted output is never truncated; data is
+ * pushed with writev() once OUT_FLUSH_AT bytes are pending, on an explicit
+ * flush (the session prompt) or, in line mode, at the end of each line.
+ * Non-blocking fds keep whatever the socket did not take. With fd -1 the
+ * buffer only accumulates in memory.
+ */
+
+#define OUT_FLUSH_AT 16384
+
+typedef struct outbuf {
+  int      fd;
+  int      linebuf;   // flush after every write ending in '\n'
+  char*    buf;
+  size_t   len, cap;
+  uint64_t total;     // bytes handed to the kernel
+} outbuf_t;
+
+void    out_init(outbuf_t* o, int fd);
+void    out_free(outbuf_t* o);
+ssize_t out_write(outbuf_t* o, const void* data, size_t len);
+int     out_printf(outbuf_t* o, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+int     out_vprintf(outbuf_t* o, const char* fmt, va_list ap);
+int     out_flush(outbuf_t* o);
+void    out_discard(outbuf_t* o);
+
+/* TCP tuning: interactive (NODELAY) vs bulk (corked until uncorked). */
+void    out_set_bulk(int fd, int bulk);
+
+/* Job stdout. Each thread has its own current stdout buffer, which
+ * dprintf(1/2) and stdout_write() go to; with none they write fd 1 as is.
+ * Pipeline stages run as threads, each with a buffer on its own pipe. */
+extern outbuf_t g_stdout;
+
+outbuf_t* stdout_buf(void);
+void      stdout_set(outbuf_t* o);
+ssize_t   stdout_write(const void* data, size_t len);
+void      stdout_flush(void);
@@ -0,0 +1,30 @@
+#pragma once
+
+/* Command line parser. Tokens are sliced out of the caller's line buffer in
+ * place (quotes and backslash escapes are resolved by compacting the token
+ * where it lies) and argv arrays live inside cmdline_t, so parsing a line
+ * performs no heap allocation. Everything stays valid as long as the line.
+ */
+
+#define PARSE_MAX_TOKS 256
+#define PARSE_MAX_PIPE 16
+
+struct builtin;
+
+typedef struct command {
+  char** argv;
+  int    argc;
+  const struct builtin* bi;   // resolved once per command, NULL for externals
+} command_t;
+
+typedef struct cmdline {
+  command_t cmds[PARSE_MAX_PIPE];
+  int       ncmds;
+  char*     redir_file;
+  int       append_mode;
+  int       stage_rc[PARSE_MAX_PIPE];   // per-stage exit codes, set on execution
+  char*     args[PARSE_MAX_TOKS + PARSE_MAX_PIPE];   // NULL-separated argvs
+} cmdline_t;
+
+/* Returns 0 (ncmds may be 0 for a blank line) or -1 on a syntax error. */
+int parse_line(char* line, cmdline_t* cl);
@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Buffered input reader. Each fill pulls whatever the socket has (a whole
+ * segment or several pipelined lines) and lines are split in place, so one
+ * read() can feed many commands. Line pointers stay valid until the next fill.
+ */
+
+#define READER_SIZE 16384
+
+typedef struct reader {
+  int    fd;
+  size_t off;   // first unconsumed byte
+  size_t end;   // one past the last buffered byte
+  size_t scan;  // newline search resumes here
+  uint64_t total;   // bytes pulled from fd so far
+  char   buf[READER_SIZE];
+} reader_t;
+
+void    reader_init(reader_t* r, int fd);
+ssize_t reader_fill(reader_t* r);
+ssize_t reader_fill_from(reader_t* r, int fd);
+char*   reader_line(reader_t* r, size_t* len);
+int     reader_full(const reader_t* r);
+int     reader_has_line(const reader_t* r);
+void    reader_drop(reader_t* r);
+void    reader_consume(reader_t* r, size_t n);
+void    reader_take(reader_t* dst, const reader_t* src);
+
+/* Blocking helpers: buffered bytes first, then the fd. */
+ssize_t reader_read(reader_t* r, void* buf, size_t len);
+ssize_t reader_getline(reader_t* r, char* buf, size_t max);
+
+static inline size_t reader_pending(const reader_t* r) { return r->end - r->off; }
+static inline const char* reader_data(const reader_t* r) { return r->buf + r->off; }
@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "outbuf.h"
+
+/* Bounded byte ring: once full, new data overwrites the oldest. Used as the
+ * scrollback of detached sessions. */
+typedef struct ring {
+  char*    buf;
+  size_t   cap;
+  size_t   head;      // oldest byte
+  size_t   len;
+  uint64_t dropped;   // bytes overwritten since the last drain
+} ring_t;
+
+int  ring_init(ring_t* r, size_t cap);
+void ring_free(ring_t* r);
+void ring_write(ring_t* r, const void* data, size_t len);
+/* Append the contents to o, oldest first, and empty the ring. */
+void ring_drain(ring_t* r, outbuf_t* o);
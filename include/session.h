@@ -1,4 +1,54 @@
 #pragma once
 #include <stdint.h>
 #include <sys/types.h>
-void session_handle(int fd, const char* remote_ip, pid_t listener_pid);
\ No newline at end of file
+
+typedef struct session session_t;
+
+/* Listener side: sessions are driven by the event loop in sshsvr_run(). */
+void session_init(int listen_fd, pid_t listener_pid);
+session_t* session_open(int fd, const char* remote_ip);
+void session_event(session_t* s, int fd, int mask);
+void session_sweep(void);
+void session_close_all(void);
+
+/* Registry view for the `sessions` builtin (listener only). */
+void session_list(void);
+int session_kill(int id);
+
+/* Sessions counted by admission control (admit.h), and how many of them
+ * come from `ip`. */
+int session_count(const char* ip, int* from_ip);
+
+/* `mux`: switch the current connection to framed channels (mux.h) once the
+ * command line completes. Listener only. */
+int session_mux(void);
+
+/* Persistent sessions survive disconnects: `persist` moves the shell behind a
+ * relay, `detach` also lets the client go. Jobs keep running and output is
+ * kept in a bounded scrollback until `attach <id>` hands a connection back
+ * to the shell. Listener only, applied once the command line completes. */
+int session_persist(void);
+int session_detach(void);
+int session_attach(int id);
+
+/* Machine mode of the session being served: builtins emit NDJSON records
+ * (json.h) and every command ends in a {"type":"end",...} record. */
+int session_machine(void);
+int session_set_machine(int on);
+
+/* Id of the session being served, 0 outside one. */
+int session_id(void);
+
+/* Job side: stdin of a forked command, starting with any bytes the listener
+ * had already buffered for the session. Builtins later in a pipeline read the
+ * pipe from the previous stage instead. Outside a job this is plain fd 0. */
+ssize_t session_stdin_read(void* buf, size_t len);
+ssize_t session_stdin_line(char* buf, size_t max);
+/* Zero-copy view of up to max buffered stdin bytes (reading more only when
+ * none are buffered); 0 at end of input. Only what is passed to
+ * session_stdin_consume() is used up, the rest stays for the next command. */
+ssize_t session_stdin_peek(const char** data, size_t max);
+void    session_stdin_consume(size_t n);
+/* The fd under stdin (the session, or the pipe a pipeline stage reads), for
+ * handing to a spawned process. */
+int     session_stdin_fd(void);
@@ -0,0 +1,18 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* SHA-256 (FIPS 180-4), fed in any number of pieces. */
+
+#define SHA256_LEN 32
+
+typedef struct sha256 {
+  uint32_t h[8];
+  uint64_t len;        // bytes hashed so far
+  unsigned char buf[64];
+  size_t   nbuf;
+} sha256_t;
+
+void sha256_init(sha256_t* s);
+void sha256_update(sha256_t* s, const void* data, size_t len);
+void sha256_final(sha256_t* s, unsigned char out[SHA256_LEN]);
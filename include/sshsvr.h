@@ -5,5 +5,8 @@
 #ifndef SSHSVR_DEFAULT_PORT
 #define SSHSVR_DEFAULT_PORT 2222
 #endif
+#ifndef SSHSVR_HTTP_PORT
+#define SSHSVR_HTTP_PORT 0      // HTTP file server (http.h), 0 for off
+#endif
 
 void sshsvr_run(uint16_t port, int daemonize, int force_replace);
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+
+#include "xfer.h"
+
+/* Directory trees as tar (ustar) streams over the session, for getdir and
+ * putdir. Nothing is staged on disk: entries are generated from, or written
+ * to, the tree as the stream passes. Names are relative to the directory.
+ * Names and link targets over 100 bytes use GNU long-name entries, and sizes
+ * of 8 GiB and more the GNU base-256 encoding; on input, pax path, linkpath
+ * and size records are understood as well. As tar does by default, the
+ * archive ends with two zero blocks and is padded to a whole 10 KiB record,
+ * so readers that take whole records never wait for more. */
+
+#define TAR_BLOCK     512
+#define TAR_RECORD    (20 * TAR_BLOCK)
+#define TAR_MAX_DEPTH 48    // directories open at once during a walk
+
+typedef struct tar_stats {
+  uint64_t     files, dirs, links;
+  uint64_t     skipped;     // unreadable, unsupported or unsafe entries
+  xfer_stats_t xs;          // xs.bytes: archive size
+} tar_stats_t;
+
+/* Archive the tree under the directory open as fd (closed when done) to
+ * stdout. The walk is iterative over directory fds; file data is read
+ * straight into the output buffers while a writer thread sends earlier ones.
+ * Returns -1 if stdout failed and the archive was cut short. */
+int tar_send(int fd, tar_stats_t* ts);
+
+/* Extract an archive from stdin into dir, creating it if needed. size is the
+ * stream length, whatever follows the end of the archive is skipped, or
+ * UINT64_MAX to stop at the end of the record holding the end-of-archive
+ * blocks. Entries that cannot be written, names that are absolute or contain
+ * "..", and names leading through a symlink are skipped and counted; a file
+ * entry replaces a symlink of its name instead of writing through it.
+ * Returns -1 with *err if the stream is unreadable, -2 if on top of that it
+ * has no size and where it ends is unknown: the rest of the input is then
+ * archive data, not commands. */
+int tar_recv(const char* dir, uint64_t size, tar_stats_t* ts, const char** err);
@@ -0,0 +1,156 @@
+#pragma once
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "sha256.h"
+
+/* Raw (binary) file transfers over the session's stdin/stdout. Data moves in
+ * large page-aligned buffers; on receive a write-behind thread puts them on
+ * disk while the next ones arrive from the network. */
+
+#define XFER_BUF_SIZE (1024 * 1024)
+#define XFER_NBUFS    4
+#define XFER_ALIGN    4096
+
+typedef struct xfer_stats {
+  uint64_t        bytes;
+  uint64_t        wire;       // compressed streams: bytes on the wire
+  uint64_t        blocks, packed;   // ... of which sent compressed
+  double          codec_secs; // spent compressing or decompressing
+  struct timespec t0;
+  struct rusage   ru0;
+  double          secs;
+  double          cpu_secs;   // user + system, all threads
+} xfer_stats_t;
+
+void xfer_begin(xfer_stats_t* st);
+void xfer_end(xfer_stats_t* st);
+/* "put: N bytes in T s, X MB/s, cpu Y%" (plus wire size, ratio and codec
+ * time for compressed streams) or an {"type":"xfer",...} record. */
+void xfer_report(const char* op, const char* path, const xfer_stats_t* st);
+
+/* Resume checkpoint for uploads: while a put is incomplete, the sidecar
+ * "<dest>.part" holds the absolute offset up to which dest is known to be on
+ * disk (synced every XFER_CKPT_EVERY bytes and when the transfer stops). It
+ * is removed once the upload completes. */
+#define XFER_CKPT_EVERY (8 * 1024 * 1024)
+
+typedef struct xfer_ckpt {
+  int      fd;        // sidecar, -1 if it could not be created
+  int      data_fd;
+  uint64_t base;      // offset the transfer started at
+  uint64_t done;      // bytes written since base
+  uint64_t saved;     // done as of the last checkpoint
+  char     path[PATH_MAX];
+} xfer_ckpt_t;
+
+void xfer_ckpt_open(xfer_ckpt_t* c, const char* dest, int data_fd, uint64_t base);
+void xfer_ckpt_advance(xfer_ckpt_t* c, uint64_t n);
+/* Completed: drop the sidecar. Otherwise record the final offset. */
+void xfer_ckpt_close(xfer_ckpt_t* c, int complete);
+/* Offset recorded for dest; -1 if there is no checkpoint. */
+int  xfer_ckpt_read(const char* dest, uint64_t* off);
+
+/* Inline integrity check: CRC-32C, optionally SHA-256, of the bytes a
+ * transfer moves, computed while they pass through so verifying costs no
+ * second read of the file. */
+typedef struct xfer_digest {
+  int         sha;       // also SHA-256
+  uint32_t    crc;
+  sha256_t    sha256;
+  uint64_t    bytes;
+  const char* expect;    // hex CRC-32C (8 digits) or SHA-256 (64), or NULL
+} xfer_digest_t;
+
+/* -1 if expect is neither form; a 64-digit expect turns on SHA-256. */
+int  xfer_digest_init(xfer_digest_t* d, int sha, const char* expect);
+void xfer_digest_update(xfer_digest_t* d, const void* data, size_t len);
+/* "crc32c X [sha256 Y] N path [ok|MISMATCH]" or a {"type":"digest",...}
+ * record. Returns -1 if the expected value does not match. */
+int  xfer_digest_report(xfer_digest_t* d, const char* path);
+
+/* Compressed streams (-z) are blocks of up to XFER_Z_BLOCK bytes, each an
+ * 8-byte header (raw length, stored length; u32 network byte order) followed
+ * by the stored bytes, LZ-compressed when the two lengths differ. A zero raw
+ * length ends the stream. The sender compresses a sample of each block first
+ * and stores blocks as they are when compression would not pay. */
+#define XFER_Z_BLOCK  (256 * 1024)
+#define XFER_Z_SAMPLE 4096
+
+enum { XFER_PLAIN, XFER_CHUNKED, XFER_LZ };   // xfer_recv input modes
+
+/* Receive `size` raw bytes, or with XFER_CHUNKED a sequence of chunks (u32
+ * length in network byte order, then the data) ending with an empty one, or
+ * with XFER_LZ a compressed stream, and write them to fd from offset off on
+ * (pwrite, so several transfers can fill segments of one file). size is the
+ * expected total for self-delimiting input, or UINT64_MAX if unknown. The
+ * input is consumed to its end even after a write error, so the command
+ * stream stays in sync. The writer thread feeds dg (if set) on its way to
+ * disk. Returns 0, or -1 with *err describing it; -2 if the input could not
+ * be followed to its end (a compressed block header whose length fits no
+ * block), so the rest of the session input is stream data. */
+int xfer_recv(int fd, uint64_t off, uint64_t size, int mode, xfer_ckpt_t* ck,
+              xfer_digest_t* dg, xfer_stats_t* st, const char** err);
+
+/* Copy the file open as in to out (both from offset 0) for cp and mv. out
+ * is preallocated to size, the expected length, and trimmed to what was
+ * copied. Without a digest the kernel copies (copy_file_range) where it can.
+ * Otherwise the data goes through XFER_BUF_SIZE aligned buffers: this thread
+ * reads the next ones while a writer thread puts earlier ones on disk and
+ * feeds dg. Files under one buffer take a single read and write. Returns 0,
+ * or -1 with *err describing it. */
+int xfer_copy(int in, int out, uint64_t size, xfer_digest_t* dg, xfer_stats_t* st,
+              const char** err);
+
+/* Read exactly len bytes of session input; -1 if it ended first. */
+int xfer_read_exact(void* buf, size_t len);
+
+/* Send len bytes of fd starting at off to stdout. When stdout is the session
+ * socket the data bypasses the output buffer: sendfile() on the console, big
+ * pread()/write() blocks on hosts. Otherwise (a pipe, a redirect) it
+ * goes through stdout_write(). With a digest the data has to pass through
+ * the payload, so sendfile() is skipped. st->bytes counts what was sent; it
+ * falls short of len if the file ended early. Returns -1 if stdout failed. */
+int xfer_send(int fd, uint64_t off, uint64_t len, xfer_digest_t* dg, xfer_stats_t* st);
+
+/* Same range as a compressed stream, ended with an empty block; st->wire
+ * counts the encoded bytes. */
+int xfer_send_lz(int fd, uint64_t off, uint64_t len, xfer_digest_t* dg, xfer_stats_t* st);
+
+/* Output generated on the fly (getdir's archive): the producer fills
+ * XFER_BUF_SIZE buffers, in place or by copying, while a writer thread sends
+ * the filled ones to stdout, so reading the next file overlaps sending the
+ * last one. xfer_out_failed() turns true once stdout fails; the rest is
+ * dropped. */
+typedef struct xfer_out xfer_out_t;
+
+xfer_out_t* xfer_out_open(void);
+/* Free space in the current buffer, at least one byte. */
+char* xfer_out_room(xfer_out_t* o, size_t* room);
+void  xfer_out_advance(xfer_out_t* o, size_t n);
+void  xfer_out_write(xfer_out_t* o, const void* data, size_t n);
+int   xfer_out_failed(xfer_out_t* o);
+/* Send what is left and stop the writer; -1 if stdout failed. */
+int   xfer_out_close(xfer_out_t* o);
+
+/* Delta transfers for sync (block signatures and ops: see delta.h). Send the
+ * signature of every `block` bytes of fd's first size bytes to stdout. */
+int xfer_send_sigs(int fd, uint64_t size, uint32_t block);
+
+typedef struct xfer_delta {
+  uint64_t matched;   // old blocks copied
+  uint64_t literal;   // bytes sent as literals
+  uint64_t wire;      // op stream size
+} xfer_delta_t;
+
+/* Build a file in fd from the op stream on stdin: literals as they arrive,
+ * copies from old (size old_size, signed with `block`). The result has to
+ * match the end op's size and CRC-32C, which dg (required) computes on its
+ * way to disk. Like xfer_recv, the ops are read to their end whenever the
+ * framing allows. Returns 0, or -1 with *err describing it; -2 after an
+ * unknown op, past which the end of the ops cannot be found. */
+int xfer_recv_delta(int old, uint64_t old_size, uint32_t block, int fd,
+                    xfer_delta_t* d, xfer_digest_t* dg, xfer_stats_t* st,
+                    const char** err);
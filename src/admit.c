@@ -0,0 +1,60 @@
+#include <time.h>
+
+#include "admit.h"
+
+admit_limits_t g_admit = {
+  .backlog      = 64,
+  .max_sessions = 64,
+  .max_per_ip   = 32,
+  .rate         = 20,
+  .burst        = 64,
+};
+
+static admit_stats_t g_stats;
+static double g_tokens = -1;   // -1: bucket not primed yet
+static struct timespec g_last;
+
+/* Refill by elapsed time, then take one token if there is one. */
+static int bucket_take(void) {
+  double depth = g_admit.burst > 0 ? g_admit.burst : g_admit.rate;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if(g_tokens < 0) {
+    g_tokens = depth;
+  } else {
+    double dt = (now.tv_sec - g_last.tv_sec) + (now.tv_nsec - g_last.tv_nsec) / 1e9;
+    g_tokens += dt * g_admit.rate;
+    if(g_tokens > depth) g_tokens = depth;
+  }
+  g_last = now;
+  if(g_tokens < 1) return 0;
+  g_tokens -= 1;
+  return 1;
+}
+
+admit_verdict_t admit_check(int total, int from_ip) {
+  admit_verdict_t v = ADMIT_OK;
+  if(g_admit.max_sessions > 0 && total >= g_admit.max_sessions) v = ADMIT_FULL;
+  else if(g_admit.max_per_ip > 0 && from_ip >= g_admit.max_per_ip) v = ADMIT_PER_IP;
+  else if(g_admit.rate > 0 && !bucket_take()) v = ADMIT_RATE;
+  if(v == ADMIT_OK) g_stats.admitted++;
+  else g_stats.rejected[v]++;
+  return v;
+}
+
+const admit_stats_t* admit_stats(void) {
+  return &g_stats;
+}
+
+const char* admit_reason(admit_verdict_t v) {
+  switch(v) {
+  case ADMIT_FULL:   return "server full";
+  case ADMIT_PER_IP: return "too many connections from this address";
+  case ADMIT_RATE:   return "connecting too fast";
+  default:           return "ok";
+  }
+}
+
+void admit_note_accept_error(void) {
+  g_stats.accept_errors++;
+}
@@ -1,43 +1,360 @@
+#include <stdint.h>
 #include <string.h>
+
 #include "base64.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define B64_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 static const char b64_tab[] =
   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-int b64_encode_block(const unsigned char* in, int inlen, char* out) {
-  int olen = 0;
-  for(int i=0;i<inlen;i+=3) {
-    unsigned v = in[i] << 16;
-    if(i+1<inlen) v |= in[i+1] << 8;
-    if(i+2<inlen) v |= in[i+2];
-    out[olen++] = b64_tab[(v >> 18) & 0x3F];
-    out[olen++] = b64_tab[(v >> 12) & 0x3F];
-    out[olen++] = (i+1<inlen) ? b64_tab[(v >> 6) & 0x3F] : '=';
-    out[olen++] = (i+2<inlen) ? b64_tab[v & 0x3F] : '=';
+/* Bulk kernels handle a prefix of the input and return how much of it they
+ * consumed (whole groups), or -1 from decode on a character outside the
+ * alphabet; the scalar code does the rest, including padding. */
+typedef struct b64_kernel {
+  const char* name;
+  size_t (*enc)(const unsigned char* in, size_t n, char* out);
+  long   (*dec)(const char* in, size_t n, unsigned char* out);
+} b64_kernel_t;
+
+/* ---- scalar ---- */
+
+#define BAD 0xff
+
+static uint8_t g_rev[256];   // BAD outside the alphabet
+static uint16_t g_enc2[4096];   // 12 bits -> two output characters
+static int g_ready;
+
+static size_t enc_scalar(const unsigned char* in, size_t n, char* out) {
+  size_t i = 0;
+  for(; i + 3 <= n; i += 3) {
+    unsigned v = (unsigned)in[i] << 16 | (unsigned)in[i+1] << 8 | in[i+2];
+    memcpy(out, &g_enc2[v >> 12], 2);
+    memcpy(out + 2, &g_enc2[v & 0xfff], 2);
+    out += 4;
   }
-  return olen;
+  return i;
 }
 
-static int b64_rev(char c) {
-  if(c>='A'&&c<='Z') return c-'A';
-  if(c>='a'&&c<='z') return c-'a'+26;
-  if(c>='0'&&c<='9') return c-'0'+52;
-  if(c=='+') return 62;
-  if(c=='/') return 63;
-  if(c=='=') return -2;
-  return -1;
+static long dec_scalar(const char* in, size_t n, unsigned char* out) {
+  const unsigned char* p = (const unsigned char*)in;
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4) {
+    unsigned a = g_rev[p[i]], b = g_rev[p[i+1]], c = g_rev[p[i+2]], d = g_rev[p[i+3]];
+    if((a | b | c | d) == BAD) return -1;
+    unsigned v = a << 18 | b << 12 | c << 6 | d;
+    out[0] = (unsigned char)(v >> 16);
+    out[1] = (unsigned char)(v >> 8);
+    out[2] = (unsigned char)v;
+    out += 3;
+  }
+  return (long)i;
+}
+
+static const b64_kernel_t k_scalar = { "scalar", enc_scalar, dec_scalar };
+
+/* ---- x86 ---- */
+
+#ifdef B64_X86
+/* Kernels after Muła and Lemire, "Faster Base64 Encoding and Decoding using
+ * AVX2 Instructions": shuffle 3-byte groups into 32-bit lanes, split them
+ * into 6-bit indices with multiplies, and map indices to characters (and
+ * back, validating) with nibble-indexed pshufb lookups. */
+
+#define TGT_SSE4 __attribute__((target("sse4.1")))
+#define TGT_AVX2 __attribute__((target("avx2")))
+
+TGT_SSE4 static __m128i enc_map_sse(__m128i in) {
+  in = _mm_shuffle_epi8(in, _mm_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10));
+  __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                               _mm_set1_epi32(0x04000040));
+  __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                               _mm_set1_epi32(0x01000010));
+  __m128i idx = _mm_or_si128(t0, t1);
+  // 0..25 -> 13, 26..51 -> 0, 52..63 -> 1..12: selects the offset to add
+  __m128i sel = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  sel = _mm_or_si128(sel, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+                                        _mm_set1_epi8(13)));
+  __m128i shift = _mm_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                                '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62,
+                                '/'-63, 'A', 0, 0);
+  return _mm_add_epi8(idx, _mm_shuffle_epi8(shift, sel));
+}
+
+/* 12 bytes in, 16 characters out; reads 16 bytes. */
+TGT_SSE4 static size_t enc_sse4(const unsigned char* in, size_t n, char* out) {
+  size_t i = 0;
+  for(; i + 16 <= n; i += 12) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+    _mm_storeu_si128((__m128i*)out, enc_map_sse(v));
+    out += 16;
+  }
+  return i;
+}
+
+/* Characters to 6-bit values; invalid gets a nonzero *bad. */
+TGT_SSE4 static __m128i dec_map_sse(__m128i in, int* bad) {
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                         0, 0, 0, 0, 0, 0, 0, 0);
+  __m128i hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+  __m128i lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+  *bad = !_mm_testz_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi));
+  __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+  return _mm_add_epi8(in, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(slash, hi)));
+}
+
+/* Pack 4 x 6 bits per 32-bit lane into 3 bytes: 12 bytes in the low 96 bits. */
+TGT_SSE4 static __m128i dec_pack_sse(__m128i v) {
+  v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+  v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(v, _mm_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1));
+}
+
+/* 16 characters in, 12 bytes out; each store writes 4 bytes past its
+ * output, so at least two more groups must follow (they produce >= 4). */
+TGT_SSE4 static long dec_sse4(const char* in, size_t n, unsigned char* out) {
+  size_t i = 0;
+  for(; i + 16 + 8 <= n; i += 16) {
+    int bad;
+    __m128i v = dec_map_sse(_mm_loadu_si128((const __m128i*)(in + i)), &bad);
+    if(bad) return -1;
+    _mm_storeu_si128((__m128i*)out, dec_pack_sse(v));
+    out += 12;
+  }
+  return (long)i;
+}
+
+/* 24 bytes in (as two 12-byte lanes), 32 characters out; reads 28 bytes. */
+TGT_AVX2 static size_t enc_avx2(const unsigned char* in, size_t n, char* out) {
+  const __m256i shuf = _mm256_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10,
+                                        1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10);
+  const __m256i shift = _mm256_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                                         '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62,
+                                         '/'-63, 'A', 0, 0,
+                                         'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                                         '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62,
+                                         '/'-63, 'A', 0, 0);
+  size_t i = 0;
+  for(; i + 28 <= n; i += 24) {
+    __m256i v = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + i))),
+      _mm_loadu_si128((const __m128i*)(in + i + 12)), 1);
+    v = _mm256_shuffle_epi8(v, shuf);
+    __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+                                    _mm256_set1_epi32(0x04000040));
+    __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+                                    _mm256_set1_epi32(0x01000010));
+    __m256i idx = _mm256_or_si256(t0, t1);
+    __m256i sel = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    sel = _mm256_or_si256(sel, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx),
+                                                _mm256_set1_epi8(13)));
+    _mm256_storeu_si256((__m256i*)out, _mm256_add_epi8(idx, _mm256_shuffle_epi8(shift, sel)));
+    out += 32;
+  }
+  return i;
+}
+
+/* 32 characters in, 24 bytes out; stores write 8 bytes past the output, so
+ * at least four more groups must follow. */
+TGT_AVX2 static long dec_avx2(const char* in, size_t n, unsigned char* out) {
+  const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                          0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                          0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                          0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                          0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                          0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                          0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                            0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 16, 19, 4, -65, -65, -71, -71,
+                                            0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i pack = _mm256_setr_epi8(2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1,
+                                        2,1,0, 6,5,4, 10,9,8, 14,13,12, -1,-1,-1,-1);
+  size_t i = 0;
+  for(; i + 32 + 16 <= n; i += 32) {
+    __m256i in_v = _mm256_loadu_si256((const __m256i*)(in + i));
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi32(in_v, 4), _mm256_set1_epi8(0x0f));
+    __m256i lo = _mm256_and_si256(in_v, _mm256_set1_epi8(0x0f));
+    if(!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, lo), _mm256_shuffle_epi8(lut_hi, hi)))
+      return -1;
+    __m256i slash = _mm256_cmpeq_epi8(in_v, _mm256_set1_epi8('/'));
+    __m256i v = _mm256_add_epi8(in_v, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(slash, hi)));
+    v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, pack);
+    v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm256_storeu_si256((__m256i*)out, v);
+    out += 24;
+  }
+  return (long)i;
+}
+
+static const b64_kernel_t k_sse4 = { "sse4", enc_sse4, dec_sse4 };
+static const b64_kernel_t k_avx2 = { "avx2", enc_avx2, dec_avx2 };
+
+static int cpu_has_sse4(void) {
+  unsigned a, b, c, d;
+  return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3) && (c & bit_SSE4_1);
+}
+
+static int cpu_has_avx2(void) {
+  unsigned a, b, c, d;
+  if(!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE) || !(c & bit_AVX)) return 0;
+  unsigned lo, hi;
+  __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  if((lo & 6) != 6) return 0;   // the OS does not save YMM state
+  return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_AVX2);
+}
+#endif
+
+static const b64_kernel_t* g_kernel = &k_scalar;
+
+static void b64_init(void) {
+  memset(g_rev, BAD, sizeof(g_rev));
+  for(int i=0;i<64;i++) g_rev[(unsigned char)b64_tab[i]] = (uint8_t)i;
+  for(int i=0;i<4096;i++) {
+    char pair[2] = { b64_tab[i >> 6], b64_tab[i & 63] };
+    memcpy(&g_enc2[i], pair, 2);
+  }
+#ifdef B64_X86
+  if(cpu_has_avx2()) g_kernel = &k_avx2;
+  else if(cpu_has_sse4()) g_kernel = &k_sse4;
+#endif
+  g_ready = 1;
+}
+
+const char* b64_kernel(void) {
+  if(!g_ready) b64_init();
+  return g_kernel->name;
+}
+
+int b64_set_kernel(const char* name) {
+  if(!g_ready) b64_init();
+  const b64_kernel_t* k = NULL;
+  if(!strcmp(name, "scalar")) k = &k_scalar;
+#ifdef B64_X86
+  else if(!strcmp(name, "sse4") && cpu_has_sse4()) k = &k_sse4;
+  else if(!strcmp(name, "avx2") && cpu_has_avx2()) k = &k_avx2;
+#endif
+  if(!k) return -1;
+  g_kernel = k;
+  return 0;
+}
+
+/* ---- block API ---- */
+
+int b64_encode_block(const unsigned char* in, int inlen, char* out) {
+  if(!g_ready) b64_init();
+  size_t n = (size_t)inlen;
+  size_t i = g_kernel->enc(in, n, out);
+  i += enc_scalar(in + i, n - i, out + i / 3 * 4);
+  char* o = out + i / 3 * 4;
+  if(i < n) {
+    unsigned v = (unsigned)in[i] << 16 | (i+1 < n ? (unsigned)in[i+1] << 8 : 0);
+    *o++ = b64_tab[v >> 18];
+    *o++ = b64_tab[(v >> 12) & 0x3f];
+    *o++ = i+1 < n ? b64_tab[(v >> 6) & 0x3f] : '=';
+    *o++ = '=';
+  }
+  return (int)(o - out);
 }
 
 int b64_decode_block(const char* in, int inlen, unsigned char* out) {
   if(inlen % 4) return -1;
-  int olen=0;
-  for(int i=0;i<inlen;i+=4) {
-    int a=b64_rev(in[i]), b=b64_rev(in[i+1]), c=b64_rev(in[i+2]), d=b64_rev(in[i+3]);
-    if(a<0||b<0||c<-2||d<-2) return -1;
-    unsigned v=(a<<18)|(b<<12)|((c<0?0:c)<<6)|(d<0?0:d);
-    out[olen++] = (v>>16)&0xFF;
-    if(c!=-2) out[olen++] = (v>>8)&0xFF;
-    if(d!=-2) out[olen++] = v&0xFF;
-  }
-  return olen;
-}
\ No newline at end of file
+  if(!inlen) return 0;
+  if(!g_ready) b64_init();
+  // every group but the last is padding-free
+  size_t body = (size_t)inlen - 4;
+  long i = g_kernel->dec(in, body, out);
+  if(i < 0) return -1;
+  long j = dec_scalar(in + i, body - (size_t)i, out + i / 4 * 3);
+  if(j < 0) return -1;
+  unsigned char* o = out + (i + j) / 4 * 3;
+  const unsigned char* p = (const unsigned char*)in + body;
+  unsigned a = g_rev[p[0]], b = g_rev[p[1]], c = g_rev[p[2]], d = g_rev[p[3]];
+  int pad = p[3] == '=' ? (p[2] == '=' ? 2 : 1) : 0;
+  if(pad >= 1) d = 0;
+  if(pad == 2) c = 0;
+  if((a | b | c | d) == BAD) return -1;
+  unsigned v = a << 18 | b << 12 | c << 6 | d;
+  *o++ = (unsigned char)(v >> 16);
+  if(pad < 2) *o++ = (unsigned char)(v >> 8);
+  if(pad < 1) *o++ = (unsigned char)v;
+  return (int)(o - out);
+}
+
+/* ---- streaming ---- */
+
+void b64_stream_init(b64_stream_t* s) {
+  memset(s, 0, sizeof(*s));
+  s->bol = 1;
+}
+
+static void stream_push(b64_stream_t* s, char c, unsigned char** o) {
+  if(c == '\r' || s->err) return;
+  s->bol = 0;
+  s->quad[s->nq++] = c;
+  if(s->nq < 4) return;
+  s->nq = 0;
+  int d = b64_decode_block(s->quad, 4, *o);
+  if(d < 0) s->err = 1;
+  else *o += d;
+}
+
+size_t b64_stream_decode(b64_stream_t* s, const char* in, size_t n,
+                         unsigned char* out, size_t* outlen) {
+  const char* p = in;
+  const char* end = in + n;
+  unsigned char* o = out;
+  while(p < end && !s->done) {
+    if(s->dot) {
+      char c = *p++;
+      if(c == '\n') s->done = 1;
+      else if(c != '\r') s->err = 1;
+      continue;
+    }
+    const char* nl = memchr(p, '\n', (size_t)(end - p));
+    const char* seg = nl ? nl : end;
+    if(s->bol && p < seg && *p == '.') {
+      if(s->nq) s->err = 1;   // truncated group
+      s->dot = 1;
+      p++;
+      continue;
+    }
+    if(s->err) {
+      // skip to the next line start, where the terminator may be
+      if(p < seg) s->bol = 0;
+      p = seg;
+    }
+    while(s->nq && p < seg) stream_push(s, *p++, &o);
+    // whole groups straight from the input; a stray CR or a bad character
+    // sends the segment through stream_push(), which sorts it out
+    size_t len = (size_t)(seg - p);
+    if(len && p[len-1] == '\r') len--;
+    len &= ~(size_t)3;
+    if(!s->nq && !s->err && len) {
+      int d = b64_decode_block(p, (int)len, o);
+      if(d >= 0) {
+        o += d;
+        p += len;
+        s->bol = 0;
+      }
+    }
+    while(p < seg) stream_push(s, *p++, &o);
+    if(nl) {
+      p = nl + 1;
+      s->bol = 1;
+    }
+  }
+  *outlen = (size_t)(o - out);
+  return (size_t)(p - in);
+}
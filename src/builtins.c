@@ -26,12 +26,57 @@
 #include "../shsrv/pt.h"
 #include "util.h"   // added for dprintf
 #include "sshsvr.h"   // add for sshsvr_run prototype / PIDFILE
+#include "session.h"
+#include "outbuf.h"
+#include "json.h"
+#include "xfer.h"
+#include "bw.h"
+#include "crc32c.h"
+#include "delta.h"
+#include "reader.h"
+#include "tar.h"
+#include "http.h"
 #include <ps5/klog.h>  // for klog_printf
 
 /* Prototype for cmd_install so the table can reference it */
 static int cmd_install(int argc, char **argv);
 
-static void print_error(const char* msg) { dprintf(1, "error: %s: %s\n", msg, strerror(errno)); }
+static void print_error(const char* msg) {
+  if(session_machine()) {
+    int err = errno;
+    json_begin("error");
+    json_str("path", msg);
+    json_str("msg", strerror(err));
+    json_int("errno", err);
+    json_end();
+    return;
+  }
+  dprintf(1, "error: %s: %s\n", msg, strerror(errno));
+}
+
+/* A usage line, or in machine mode an error record carrying it. */
+static void print_usage(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+static void print_usage(const char* fmt, ...) {
+  char msg[512] = "usage: ";
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg + 7, sizeof(msg) - 7, fmt, ap);
+  va_end(ap);
+  if(session_machine()) {
+    json_begin("error");
+    json_str("msg", msg);
+    json_end();
+    return;
+  }
+  dprintf(1, "%s\n", msg);
+}
+
+static const char* file_kind(mode_t m) {
+  if(S_ISDIR(m)) return "dir";
+  if(S_ISREG(m)) return "file";
+  if(S_ISLNK(m)) return "link";
+  return "other";
+}
 
 static void fmt_mode(mode_t m, char* out) {
   out[0] = S_ISDIR(m)?'d':(S_ISLNK(m)?'l':'-');
@@ -41,6 +86,25 @@ static void fmt_mode(mode_t m, char* out) {
 }
 
 static int do_ls_entry(const char* path, const char* name, int longf) {
+  if(session_machine()) {
+    // records always carry the full stat, -l only affects text output
+    char full[1024];
+    snprintf(full, sizeof(full), "%s/%s", path, name);
+    struct stat st;
+    if(lstat(full, &st) < 0) return -1;
+    json_begin("file");
+    json_str("dir", path);
+    json_str("name", name);
+    json_str("kind", file_kind(st.st_mode));
+    json_int("mode", st.st_mode & 07777);
+    json_int("nlink", (long long)st.st_nlink);
+    json_int("uid", (long long)st.st_uid);
+    json_int("gid", (long long)st.st_gid);
+    json_int("size", (long long)st.st_size);
+    json_int("mtime", (long long)st.st_mtime);
+    json_end();
+    return 0;
+  }
   if(!longf) {
     dprintf(1, "%s\n", name);
     return 0;
@@ -62,14 +126,15 @@ static int do_ls_entry(const char* path, const char* name, int longf) {
 static int ls_recursive(const char* path, int longf, int showall) {
   DIR* d = opendir(path);
   if(!d) { print_error(path); return -1; }
-  dprintf(1, "%s:\n", path);
+  int machine = session_machine();
+  if(!machine) dprintf(1, "%s:\n", path);
   struct dirent* de;
   while((de=readdir(d))) {
     if(!showall && de->d_name[0]=='.') continue;
     do_ls_entry(path, de->d_name, longf);
   }
   closedir(d);
-  dprintf(1, "\n");
+  if(!machine) dprintf(1, "\n");
   return 0;
 }
 
@@ -141,7 +206,7 @@ static int recurse_rm(const char* path) {
 
 static int cmd_rm(int argc, char** argv) {
   int rec=0, start=1;
-  if(argc<2) { dprintf(1,"usage: rm [-r] path...\n"); return -1; }
+  if(argc<2) { print_usage("rm [-r] path..."); return -1; }
   if(strcmp(argv[1],"-r")==0) { rec=1; start=2; }
   for(int i=start;i<argc;i++) {
     if(rec) {
@@ -162,7 +227,7 @@ static int ensure_dir(const char* path) {
 }
 
 static int cmd_mkdir(int argc, char** argv) {
-  if(argc<2) { dprintf(1,"usage: mkdir [-p] dir...\n"); return -1; }
+  if(argc<2) { print_usage("mkdir [-p] dir..."); return -1; }
   int pflag=0; int idx=1;
   if(strcmp(argv[1],"-p")==0) { pflag=1; idx=2; }
   for(int i=idx;i<argc;i++) {
@@ -185,21 +250,50 @@ static int cmd_mkdir(int argc, char** argv) {
   return 0;
 }
 
-static int copy_file(const char* src, const char* dst) {
+/* cp -c/-S/-e: the digest of each copied file, reported after it */
+typedef struct cp_opts {
+  const char* op;             // "cp" or "mv", for reports
+  int         rec, digest, sha;
+  const char* expect;
+  int         mismatch;
+  int         failed;         // a copy broke off (reported)
+} cp_opts_t;
+
+/* -1 with errno if src or dst cannot be opened. Once the copy started,
+ * errors are reported here and set co->failed. */
+static int copy_file(const char* src, const char* dst, cp_opts_t* co) {
   int in=open(src,O_RDONLY);
   if(in<0) return -1;
   int out=open(dst,O_WRONLY|O_CREAT|O_TRUNC,0644);
   if(out<0) { close(in); return -1; }
-  char buf[8192];
-  ssize_t r;
-  while((r=read(in,buf,sizeof(buf)))>0) {
-    if(write(out,buf,r)!=r) { close(in); close(out); return -1; }
+  xfer_digest_t dgs;
+  xfer_digest_t* dg = NULL;
+  if(co->digest) xfer_digest_init(dg = &dgs, co->sha, co->expect);
+  struct stat sb;
+  uint64_t size = fstat(in,&sb)==0 ? (uint64_t)sb.st_size : 0;
+  xfer_stats_t st;
+  const char* err = NULL;
+  xfer_begin(&st);
+  bw_begin(co->op, src, size);
+  int rc = xfer_copy(in, out, size, dg, &st, &err);
+  bw_end();
+  close(in);
+  if(close(out) < 0 && !rc) {
+    err = strerror(errno);
+    rc = -1;
   }
-  close(in); close(out);
-  return r<0?-1:0;
+  xfer_end(&st);
+  if(rc < 0) {
+    dprintf(1,"%s: %s: %s\n", co->op, src, err);
+    co->failed = 1;
+    return 0;
+  }
+  xfer_report(co->op, dst, &st);
+  if(dg && xfer_digest_report(dg, dst) < 0) co->mismatch = 1;
+  return 0;
 }
 
-static int recurse_cp(const char* src, const char* dst) {
+static int recurse_cp(const char* src, const char* dst, cp_opts_t* co) {
   struct stat st;
   if(lstat(src,&st)<0) return -1;
   if(S_ISDIR(st.st_mode)) {
@@ -212,40 +306,76 @@ static int recurse_cp(const char* src, const char* dst) {
       char s[1024], t[1024];
       snprintf(s,sizeof(s),"%s/%s",src,de->d_name);
       snprintf(t,sizeof(t),"%s/%s",dst,de->d_name);
-      if(recurse_cp(s,t)<0) { closedir(d); return -1; }
+      if(recurse_cp(s,t,co)<0) { closedir(d); return -1; }
     }
     closedir(d);
     return 0;
   }
-  return copy_file(src,dst);
+  return copy_file(src,dst,co);
 }
 
 static int cmd_cp(int argc, char** argv) {
-  if(argc<3) { dprintf(1,"usage: cp [-r] src dst\n"); return -1; }
-  int rec=0; int idx=1;
-  if(strcmp(argv[1],"-r")==0) { rec=1; idx=2; }
-  if(argc - idx != 2) { dprintf(1,"usage: cp [-r] src dst\n"); return -1; }
+  cp_opts_t co;
+  memset(&co, 0, sizeof(co));
+  co.op = "cp";
+  int idx=1;
+  for(; idx<argc && argv[idx][0]=='-' && argv[idx][1] && !argv[idx][2]; idx++) {
+    char f=argv[idx][1];
+    if(f=='r') co.rec=1;
+    else if(f=='c') co.digest=1;
+    else if(f=='S') co.digest=co.sha=1;
+    else if(f=='e' && idx+1<argc) { co.digest=1; co.expect=argv[++idx]; }
+    else break;
+  }
+  xfer_digest_t probe;
+  if(argc - idx != 2 || (co.expect && (co.rec || xfer_digest_init(&probe, 0, co.expect) < 0))) {
+    print_usage("cp [-r] [-c|-S] src dst | cp [-c|-S] -e hex src dst");
+    return -1;
+  }
   const char* src=argv[idx];
   const char* dst=argv[idx+1];
-  if(rec) {
-    if(recurse_cp(src,dst)<0) print_error(src);
+  if(co.rec) {
+    if(recurse_cp(src,dst,&co)<0) print_error(src);
   } else {
-    if(copy_file(src,dst)<0) print_error(src);
+    if(copy_file(src,dst,&co)<0) print_error(src);
   }
-  return 0;
+  return co.mismatch || co.failed ? 1 : 0;
 }
 
+/* mv src dst: a rename, or between filesystems (USB to internal storage) a
+ * copy of the file followed by removing src. */
 static int cmd_mv(int argc, char** argv) {
-  if(argc!=3) { dprintf(1,"usage: mv src dst\n"); return -1; }
-  if(rename(argv[1],argv[2])<0) print_error(argv[1]);
+  if(argc!=3) { print_usage("mv src dst"); return -1; }
+  if(rename(argv[1],argv[2])==0) return 0;
+  struct stat sb;
+  if(errno!=EXDEV || stat(argv[1],&sb)<0 || !S_ISREG(sb.st_mode)) {
+    print_error(argv[1]);
+    return 0;
+  }
+  cp_opts_t co;
+  memset(&co, 0, sizeof(co));
+  co.op = "mv";
+  if(copy_file(argv[1],argv[2],&co)<0) {
+    print_error(argv[1]);
+    return 1;
+  }
+  if(co.failed) {
+    unlink(argv[2]);
+    return 1;
+  }
+  if(unlink(argv[1])<0) print_error(argv[1]);
   return 0;
 }
 
 static int cmd_pwd(int argc, char** argv) {
   (void)argc;(void)argv;
   char buf[PATH_MAX];
-  if(getcwd(buf,sizeof(buf))) dprintf(1,"%s\n",buf);
-  else print_error("pwd");
+  if(!getcwd(buf,sizeof(buf))) print_error("pwd");
+  else if(session_machine()) {
+    json_begin("cwd");
+    json_str("path", buf);
+    json_end();
+  } else dprintf(1,"%s\n",buf);
   return 0;
 }
 
@@ -256,12 +386,28 @@ static int cmd_cd(int argc, char** argv) {
 }
 
 static int cmd_cat(int argc, char** argv) {
-  if(argc<2) { dprintf(1,"usage: cat file...\n"); return -1; }
+  if(argc<2) {
+    // no files: copy stdin, e.g. the previous pipeline stage
+    char buf[8192]; ssize_t r;
+    while((r=session_stdin_read(buf,sizeof(buf)))>0)
+      if(stdout_write(buf,r) < 0) return 1;   // the reader went away
+    return 0;
+  }
   for(int i=1;i<argc;i++) {
     int fd=open(argv[i],O_RDONLY);
     if(fd<0) { print_error(argv[i]); continue; }
+    struct stat st;
+    if(fstat(fd,&st)==0 && S_ISREG(st.st_mode)) {
+      // regular files take the zero-copy path when stdout is the socket
+      xfer_stats_t xs;
+      xfer_begin(&xs);
+      xfer_send(fd, 0, (uint64_t)st.st_size, NULL, &xs);
+      close(fd);
+      continue;
+    }
     char buf[8192]; ssize_t r;
-    while((r=read(fd,buf,sizeof(buf)))>0) write(1,buf,r);
+    while((r=read(fd,buf,sizeof(buf)))>0)
+      if(stdout_write(buf,r) < 0) break;
     close(fd);
   }
   return 0;
@@ -277,7 +423,8 @@ static int cmd_ps(int argc, char** argv) {
   if(sysctl(mib,4,buf,&len,NULL,0)<0) { print_error("sysctl data"); free(buf); return -1; }
   struct kinfo_proc* p = (struct kinfo_proc*)buf;
   int count = len / sizeof(struct kinfo_proc);
-  dprintf(1,"  PID  PPID  PGID   SID   UID State    COMMAND\n");
+  int machine = session_machine();
+  if(!machine) dprintf(1,"  PID  PPID  PGID   SID   UID State    COMMAND\n");
   for(int i=0;i<count;i++) {
     if(!p[i].ki_comm[0]) continue; // skip processes without command name
     const char* state_str;
@@ -289,6 +436,18 @@ static int cmd_ps(int argc, char** argv) {
       case 5: state_str = "ZOMB"; break;
       default: state_str = "?"; break;
     }
+    if(machine) {
+      json_begin("proc");
+      json_int("pid", p[i].ki_pid);
+      json_int("ppid", p[i].ki_ppid);
+      json_int("pgid", p[i].ki_pgid);
+      json_int("sid", p[i].ki_sid);
+      json_int("uid", p[i].ki_uid);
+      json_str("state", state_str);
+      json_str("comm", p[i].ki_comm);
+      json_end();
+      continue;
+    }
     dprintf(1,"%5d %5d %5d %5d %5d %6s %s\n",
             p[i].ki_pid, p[i].ki_ppid, p[i].ki_pgid, p[i].ki_sid, p[i].ki_uid,
             state_str, p[i].ki_comm);
@@ -297,45 +456,514 @@ static int cmd_ps(int argc, char** argv) {
   return 0;
 }
 
+/* Options shared by get, put and sum:
+ *   -b raw bytes instead of base64 lines, -f (put -b) chunk framing,
+ *   -z (with -b) adaptively compressed blocks,
+ *   -o <off> start offset, -n <len> byte count (get, sum),
+ *   -s resume state (put), -t <total> (put -b) one segment of a file of
+ *   that size, written in place next to other segments,
+ *   -c report the CRC-32C of the data moved, -S with SHA-256,
+ *   -e <hex> check it against this CRC-32C or SHA-256 */
+typedef struct xfer_opts {
+  int         raw, framed, compress, status, segment, digest, sha;
+  const char* expect;
+  uint64_t    off, len;       // len UINT64_MAX: to the end of the file
+  uint64_t    total;
+  uint64_t    block;          // sync -B
+  const char* path;
+  const char* size;           // put -b: byte count or "-"
+} xfer_opts_t;
+
+static int parse_u64(const char* s, uint64_t* v) {
+  char* end;
+  if(!*s || *s=='-') return -1;
+  *v = strtoull(s, &end, 10);
+  return *end ? -1 : 0;
+}
+
+static int parse_xfer_opts(int argc, char** argv, const char* allowed, xfer_opts_t* o) {
+  memset(o, 0, sizeof(*o));
+  o->len = UINT64_MAX;
+  int i = 1;
+  for(; i<argc && argv[i][0]=='-' && argv[i][1] && !argv[i][2]; i++) {
+    char f = argv[i][1];
+    if(!strchr(allowed, f)) return -1;
+    if(f=='b') o->raw = 1;
+    else if(f=='f') o->framed = 1;
+    else if(f=='z') o->compress = 1;
+    else if(f=='c') o->digest = 1;
+    else if(f=='S') o->digest = o->sha = 1;
+    else if(f=='s') o->status = 1;
+    else if(i+1>=argc) return -1;
+    else if(f=='e') o->digest = 1, o->expect = argv[++i];
+    else if(parse_u64(argv[++i], f=='o' ? &o->off : f=='n' ? &o->len :
+                                 f=='B' ? &o->block : &o->total) < 0)
+      return -1;
+    if(f=='t') o->segment = 1;
+  }
+  if(i<argc) o->path = argv[i++];
+  if(i<argc) o->size = argv[i++];
+  if(!o->path || i<argc || ((o->framed || o->compress) && !o->raw)) return -1;
+  if(o->framed && o->compress) return -1;
+  xfer_digest_t d;
+  if(o->expect && xfer_digest_init(&d, 0, o->expect) < 0) return -1;
+  return 0;
+}
+
+/* The digest a transfer asked for, NULL without -c/-S/-e. */
+static xfer_digest_t* xfer_opts_digest(const xfer_opts_t* o, xfer_digest_t* d) {
+  if(!o->digest) return NULL;
+  xfer_digest_init(d, o->sha, o->expect);
+  return d;
+}
+
+/* put -s <dest>: where an interrupted upload can pick up */
+static int put_status(const char* dest) {
+  uint64_t off = 0;
+  struct stat sb;
+  const char* state = "absent";
+  if(xfer_ckpt_read(dest, &off) == 0) state = "partial";
+  else if(stat(dest, &sb) == 0) { state = "complete"; off = (uint64_t)sb.st_size; }
+  if(session_machine()) {
+    json_begin("put_state");
+    json_str("path", dest);
+    json_str("state", state);
+    json_int("offset", (long long)off);
+    json_end();
+  } else {
+    dprintf(1,"%s %llu\n", state, (unsigned long long)off);
+  }
+  return 0;
+}
+
+/* The destination is truncated for a fresh upload and kept when resuming.
+ * A segment sizes the file to its total and leaves the rest alone. */
+static int put_open(const xfer_opts_t* o) {
+  int fd = open(o->path, O_WRONLY|O_CREAT|(o->off || o->segment ? 0 : O_TRUNC), 0644);
+  if(fd<0) { print_error(o->path); return -1; }
+  struct stat sb;
+  if(o->segment && fstat(fd,&sb)==0 && (uint64_t)sb.st_size != o->total &&
+     ftruncate(fd, (off_t)o->total) < 0) {
+    print_error(o->path);
+    close(fd);
+    return -1;
+  }
+  if(o->off && lseek(fd, (off_t)o->off, SEEK_SET) < 0) {
+    print_error(o->path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* A completed upload ends at off + n, whatever was there before. */
+static int put_finish(int fd, xfer_ckpt_t* ck, int complete, uint64_t end) {
+  int rc = 0;
+  if(complete && ftruncate(fd, (off_t)end) < 0) rc = -1;
+  xfer_ckpt_close(ck, complete && !rc);
+  if(close(fd) < 0) rc = -1;
+  return rc;
+}
+
+/* put -b [-f|-z] [-o off] [-t total] <dest> <size|->: exactly size raw bytes
+ * follow the "." reply, with -f length-prefixed chunks ending in an empty
+ * one, or with -z a compressed block stream (see xfer.h). Segments (-t) skip
+ * the checkpoint; the client tracks them. */
+static int put_raw(const xfer_opts_t* o) {
+  uint64_t size = UINT64_MAX;
+  if(!o->size) {
+    print_usage("put -b [-f|-z] [-c|-S] [-e hex] [-o off] [-t total] <dest> <size|->");
+    return -1;
+  }
+  if(strcmp(o->size,"-")!=0) {
+    if(parse_u64(o->size, &size) < 0) { dprintf(1,"put: bad size '%s'\n", o->size); return -1; }
+  } else if(!(o->framed || o->compress) || o->segment) {
+    dprintf(1,"put: this mode needs a size\n");
+    return -1;
+  }
+  if(o->segment && (o->off > o->total || size > o->total - o->off)) {
+    dprintf(1,"put: segment exceeds total size\n");
+    return -1;
+  }
+  int fd = put_open(o);
+  if(fd<0) return -1;
+  xfer_ckpt_t ck;
+  if(!o->segment) xfer_ckpt_open(&ck, o->path, fd, o->off);
+  dprintf(1,".\n");
+  stdout_flush();
+  xfer_stats_t st;
+  xfer_digest_t dgs;
+  xfer_digest_t* dg = xfer_opts_digest(o, &dgs);
+  const char* err = NULL;
+  xfer_begin(&st);
+  bw_begin("put", o->path, size);
+  int mode = o->compress ? XFER_LZ : o->framed ? XFER_CHUNKED : XFER_PLAIN;
+  int rc = xfer_recv(fd, o->off, size, mode, o->segment ? NULL : &ck, dg, &st, &err);
+  bw_end();
+  int frc = o->segment ? close(fd) : put_finish(fd, &ck, rc == 0, o->off + st.bytes);
+  if(frc < 0 && !rc) {
+    err = strerror(errno);
+    rc = -1;
+  }
+  xfer_end(&st);
+  if(rc < 0) {
+    dprintf(1,"put: %s: %s\n", o->path, err);
+    return rc == -2 ? 255 : 1;   // the session input is out of step for good
+  }
+  xfer_report("put", o->path, &st);
+  return dg && xfer_digest_report(dg, o->path) < 0 ? 1 : 0;
+}
+
 static int cmd_put(int argc, char** argv) {
-  if(argc!=2) { dprintf(1,"usage: put <dest>\n"); return -1; }
-  int fd = open(argv[1], O_WRONLY|O_CREAT|O_TRUNC, 0644);
-  if(fd<0) { print_error(argv[1]); return -1; }
-  char line[4096];
-  unsigned char bin[3072];
+  xfer_opts_t o;
+  if(parse_xfer_opts(argc, argv, "bfostzcSe", &o) < 0) {
+    print_usage("put [-c|-S] [-e hex] [-o off] <dest>"
+                " | put -b [-f|-z] [-c|-S] [-e hex] [-o off] [-t total] <dest> <size|->"
+                " | put -s <dest>");
+    return -1;
+  }
+  if(o.status) return put_status(o.path);
+  if(o.raw) return put_raw(&o);
+  if(o.segment) { dprintf(1,"put: -t is only used with -b\n"); return -1; }
+  if(o.size) { dprintf(1,"put: size is only used with -b\n"); return -1; }
+  int fd = put_open(&o);
+  if(fd<0) return -1;
+  xfer_ckpt_t ck;
+  xfer_ckpt_open(&ck, o.path, fd, o.off);
+  // input is decoded as it arrives, whatever the line length or TCP splits
+  b64_stream_t bs;
+  b64_stream_init(&bs);
+  unsigned char bin[READER_SIZE / 4 * 3 + 3];
+  int werr = 0;
+  xfer_digest_t dgs;
+  xfer_digest_t* dg = xfer_opts_digest(&o, &dgs);
   dprintf(1,".\n");
-  while(1) {
-    ssize_t n = read(0,line,sizeof(line)-1);
-    if(n<=0) break;
-    line[n]=0;
-    char* nl=strchr(line,'\n'); if(nl) *nl=0;
-    if(strcmp(line,".")==0) break;
-    int linelen=strlen(line);
-    int dec = b64_decode_block(line, linelen, bin);
-    if(dec<0) { dprintf(1,"decode error\n"); break; }
-    if(write(fd,bin,dec)!=dec) { dprintf(1,"write error\n"); break; }
+  bw_begin("put", o.path, UINT64_MAX);
+  while(!bs.done) {
+    const char* data;
+    ssize_t n = session_stdin_peek(&data, READER_SIZE);
+    if(n <= 0) break;
+    size_t dec;
+    size_t used = b64_stream_decode(&bs, data, (size_t)n, bin, &dec);
+    session_stdin_consume(used);
+    bw_io(used);
+    if(werr || !dec) continue;
+    if(write(fd,bin,dec)!=(ssize_t)dec) { werr = 1; continue; }
+    if(dg) xfer_digest_update(dg, bin, dec);
+    xfer_ckpt_advance(&ck, (uint64_t)dec);
   }
+  bw_end();
+  if(bs.err) dprintf(1,"decode error\n");
+  else if(werr) dprintf(1,"write error\n");
+  int complete = bs.done && !bs.err && !werr;
+  if(put_finish(fd, &ck, complete, o.off + ck.done) < 0 && complete) {
+    print_error(o.path);
+    return 1;
+  }
+  if(!complete) return bs.err || werr ? 1 : 0;
+  return dg && xfer_digest_report(dg, o.path) < 0 ? 1 : 0;
+}
+
+/* Clip [off, off+len) to the file; returns the byte count. */
+static uint64_t get_range(const struct stat* sb, const xfer_opts_t* o) {
+  uint64_t size = (uint64_t)sb->st_size;
+  if(o->off >= size) return 0;
+  return o->len < size - o->off ? o->len : size - o->off;
+}
+
+/* get -b [-z] [-o off] [-n len] <src>: a "size N" line, then exactly N raw
+ * bytes, or with -z a compressed block stream followed by its statistics.
+ * A requested digest comes last. */
+static int get_raw(const xfer_opts_t* o) {
+  const char* src = o->path;
+  int fd=open(src, O_RDONLY);
+  if(fd<0) { print_error(src); return -1; }
+  struct stat sb;
+  if(fstat(fd,&sb)<0 || !S_ISREG(sb.st_mode)) {
+    dprintf(1,"get: %s: not a regular file\n", src);
+    close(fd);
+    return -1;
+  }
+  uint64_t size = get_range(&sb, o);
+  if(session_machine()) {
+    json_begin("get");
+    json_str("path", src);
+    json_int("offset", (long long)o->off);
+    json_int("size", (long long)size);
+    json_int("total", (long long)sb.st_size);
+    json_end();
+  } else {
+    dprintf(1,"size %llu\n", (unsigned long long)size);
+  }
+  xfer_stats_t st;
+  xfer_digest_t dgs;
+  xfer_digest_t* dg = xfer_opts_digest(o, &dgs);
+  xfer_begin(&st);
+  bw_begin("get", src, size);
+  int rc = o->compress ? xfer_send_lz(fd, o->off, size, dg, &st)
+                       : xfer_send(fd, o->off, size, dg, &st);
+  bw_end();
   close(fd);
-  return 0;
+  if(rc < 0) return 1;   // the peer is gone
+  if(o->compress) {
+    // self-delimiting: a short stream needs no padding
+    xfer_end(&st);
+    xfer_report("get", src, &st);
+  } else if(st.bytes < size) {
+    // the file shrank: pad to the announced size so the stream stays framed
+    static const char zero[4096];
+    for(uint64_t left = size - st.bytes; left; ) {
+      size_t n = left < sizeof(zero) ? (size_t)left : sizeof(zero);
+      stdout_write(zero, n);
+      left -= n;
+    }
+  }
+  if(st.bytes < size) {
+    dprintf(1,"get: %s: file shrank during transfer\n", src);
+    return 1;
+  }
+  return dg && xfer_digest_report(dg, src) < 0 ? 1 : 0;
 }
 
 static int cmd_get(int argc, char** argv) {
-  if(argc!=2) { dprintf(1,"usage: get <src>\n"); return -1; }
-  int fd=open(argv[1], O_RDONLY);
-  if(fd<0) { print_error(argv[1]); return -1; }
+  xfer_opts_t o;
+  if(parse_xfer_opts(argc, argv, "bonzcSe", &o) < 0 || o.size) {
+    print_usage("get [-b [-z]] [-c|-S] [-e hex] [-o off] [-n len] <src>");
+    return -1;
+  }
+  if(o.raw) return get_raw(&o);
+  int fd=open(o.path, O_RDONLY);
+  if(fd<0) { print_error(o.path); return -1; }
+  struct stat sb;
+  uint64_t left = fstat(fd,&sb)==0 && S_ISREG(sb.st_mode) ? get_range(&sb, &o) : o.len;
+  if(o.off && lseek(fd, (off_t)o.off, SEEK_SET) < 0) {
+    print_error(o.path);
+    close(fd);
+    return -1;
+  }
   unsigned char buf[3072];
-  char out[4096];
+  char out[4096+1];   // encoded block plus newline
   ssize_t r;
-  while((r=read(fd,buf,sizeof(buf)))>0) {
+  xfer_digest_t dgs;
+  xfer_digest_t* dg = xfer_opts_digest(&o, &dgs);
+  bw_begin("get", o.path, left);
+  while(left && (r=read(fd,buf,left < sizeof(buf) ? left : sizeof(buf)))>0) {
+    if(dg) xfer_digest_update(dg, buf, (size_t)r);
     int enc = b64_encode_block(buf, r, out);
-    write(1,out,enc);
-    write(1,"\n",1);
+    out[enc++]='\n';
+    if(stdout_write(out,enc) < 0) break;   // the peer is gone
+    left -= (uint64_t)r;
+    bw_io((uint64_t)enc);
   }
-  write(1,".\n",2);
+  bw_end();
+  stdout_write(".\n",2);
   close(fd);
+  return dg && xfer_digest_report(dg, o.path) < 0 ? 1 : 0;
+}
+
+/* sum [-o off] [-n len] <file>: CRC-32C and length of a file or range */
+static int cmd_sum(int argc, char** argv) {
+  xfer_opts_t o;
+  if(parse_xfer_opts(argc, argv, "on", &o) < 0 || o.size) {
+    print_usage("sum [-o off] [-n len] <file>");
+    return -1;
+  }
+  int fd=open(o.path, O_RDONLY);
+  if(fd<0) { print_error(o.path); return -1; }
+  char* buf = malloc(XFER_BUF_SIZE);
+  if(!buf) { close(fd); dprintf(1,"sum: out of memory\n"); return -1; }
+  uint32_t crc = 0;
+  uint64_t n = 0;
+  ssize_t r = 0;
+  while(n < o.len) {
+    uint64_t left = o.len - n;
+    r = pread(fd, buf, left < XFER_BUF_SIZE ? (size_t)left : XFER_BUF_SIZE, (off_t)(o.off + n));
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0) break;
+    crc = crc32c(crc, buf, (size_t)r);
+    n += (uint64_t)r;
+  }
+  free(buf);
+  close(fd);
+  if(r < 0) { print_error(o.path); return 1; }
+  if(session_machine()) {
+    char hex[9];
+    snprintf(hex, sizeof(hex), "%08x", crc);
+    json_begin("sum");
+    json_str("path", o.path);
+    json_int("size", (long long)n);
+    json_str("crc32c", hex);
+    json_end();
+  } else {
+    dprintf(1,"%08x %llu %s\n", crc, (unsigned long long)n, o.path);
+  }
   return 0;
 }
 
+static void tree_report(const char* op, const char* path, const tar_stats_t* ts) {
+  if(session_machine()) {
+    json_begin("tree");
+    json_str("op", op);
+    json_str("path", path);
+    json_int("files", (long long)ts->files);
+    json_int("dirs", (long long)ts->dirs);
+    json_int("links", (long long)ts->links);
+    json_int("skipped", (long long)ts->skipped);
+    json_end();
+  } else {
+    dprintf(1,"%s: %llu files, %llu dirs, %llu links, %llu skipped\n", op,
+            (unsigned long long)ts->files, (unsigned long long)ts->dirs,
+            (unsigned long long)ts->links, (unsigned long long)ts->skipped);
+  }
+  xfer_report(op, path, &ts->xs);
+}
+
+/* getdir <dir>: a "tar" line, the tree under dir as a tar stream (see tar.h)
+ * padded to whole records, then the statistics. Entries that could
+ * not be read are left out and make the exit code 1. */
+static int cmd_getdir(int argc, char** argv) {
+  if(argc != 2) {
+    print_usage("getdir <dir>");
+    return -1;
+  }
+  int fd = open(argv[1], O_RDONLY|O_DIRECTORY);
+  if(fd<0) { print_error(argv[1]); return -1; }
+  if(session_machine()) {
+    json_begin("getdir");
+    json_str("path", argv[1]);
+    json_end();
+  } else {
+    dprintf(1,"tar\n");
+  }
+  tar_stats_t ts;
+  bw_begin("getdir", argv[1], UINT64_MAX);
+  int rc = tar_send(fd, &ts);
+  bw_end();
+  if(rc < 0) return 1;   // the peer is gone
+  tree_report("getdir", argv[1], &ts);
+  return ts.skipped ? 1 : 0;
+}
+
+/* putdir <dir> [size]: after the "." reply, a tar stream to extract into dir.
+ * With a size exactly that many bytes are read; without one the stream ends
+ * with the 10 KiB record holding the end of the archive, which is what tar
+ * writes by default. An unsized stream that turns out to be broken cannot be
+ * skipped, so after the error the session is closed rather than running the
+ * rest of the archive as command lines. */
+static int cmd_putdir(int argc, char** argv) {
+  uint64_t size = UINT64_MAX;
+  if(argc < 2 || argc > 3 || (argc == 3 && parse_u64(argv[2], &size) < 0)) {
+    print_usage("putdir <dir> [size]");
+    return -1;
+  }
+  dprintf(1,".\n");
+  stdout_flush();
+  tar_stats_t ts;
+  const char* err = NULL;
+  bw_begin("putdir", argv[1], size);
+  int rc = tar_recv(argv[1], size, &ts, &err);
+  bw_end();
+  if(rc < 0) {
+    dprintf(1,"putdir: %s: %s\n", argv[1], err);
+    return rc == -2 ? 255 : 1;
+  }
+  tree_report("putdir", argv[1], &ts);
+  return ts.skipped ? 1 : 0;
+}
+
+/* sync [-B block] [-c|-S] [-e hex] <dest>: rsync-style update. The reply is
+ * a header (block size, block count, current size) and the signature of each
+ * block of dest; the client answers with ops that copy those blocks or carry
+ * literal data (see delta.h). The new file is built in "<dest>.sync" from
+ * both and renamed over dest once its size and CRC-32C check out, so the old
+ * copy stays intact until then. */
+static int cmd_sync(int argc, char** argv) {
+  xfer_opts_t o;
+  if(parse_xfer_opts(argc, argv, "BcSe", &o) < 0 || o.size) {
+    print_usage("sync [-B block] [-c|-S] [-e hex] <dest>");
+    return -1;
+  }
+  if(o.block && (o.block < DELTA_MIN_BLOCK || o.block > DELTA_MAX_BLOCK)) {
+    dprintf(1,"sync: block size must be %d..%d\n", DELTA_MIN_BLOCK, DELTA_MAX_BLOCK);
+    return -1;
+  }
+  struct stat sb;
+  int old = open(o.path, O_RDONLY);
+  if(old<0 && errno!=ENOENT) { print_error(o.path); return -1; }
+  if(old>=0 && (fstat(old,&sb)<0 || !S_ISREG(sb.st_mode))) {
+    dprintf(1,"sync: %s: not a regular file\n", o.path);
+    close(old);
+    return -1;
+  }
+  uint64_t size = old>=0 ? (uint64_t)sb.st_size : 0;
+  uint32_t block = o.block ? (uint32_t)o.block : delta_block_size(size);
+  uint64_t nblocks = (size + block - 1) / block;
+  char tmp[PATH_MAX];
+  int fd = -1;
+  if(snprintf(tmp, sizeof(tmp), "%s.sync", o.path) < (int)sizeof(tmp))
+    fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, old>=0 ? sb.st_mode & 07777 : 0644);
+  if(fd<0) {
+    print_error(o.path);
+    if(old>=0) close(old);
+    return -1;
+  }
+  if(session_machine()) {
+    json_begin("sync");
+    json_str("path", o.path);
+    json_int("size", (long long)size);
+    json_int("block", block);
+    json_int("blocks", (long long)nblocks);
+    json_end();
+  } else {
+    dprintf(1,"sync %u %llu %llu\n", block, (unsigned long long)nblocks,
+            (unsigned long long)size);
+  }
+  xfer_stats_t st;
+  xfer_digest_t dg;
+  xfer_delta_t d;
+  const char* err = NULL;
+  xfer_digest_init(&dg, o.sha, o.expect);
+  xfer_begin(&st);
+  int rc = xfer_send_sigs(old, size, block);
+  stdout_flush();
+  if(rc < 0) err = "signatures not sent";
+  else {
+    bw_begin("sync", o.path, UINT64_MAX);
+    rc = xfer_recv_delta(old, size, block, fd, &d, &dg, &st, &err);
+    bw_end();
+  }
+  if(close(fd) < 0 && !rc) {
+    err = strerror(errno);
+    rc = -1;
+  }
+  if(!rc && rename(tmp, o.path) < 0) {
+    err = strerror(errno);
+    rc = -1;
+  }
+  if(rc) unlink(tmp);
+  if(old>=0) close(old);
+  xfer_end(&st);
+  if(rc) {
+    dprintf(1,"sync: %s: %s\n", o.path, err);
+    return rc == -2 ? 255 : 1;   // the session input is out of step for good
+  }
+  if(session_machine()) {
+    json_begin("delta");
+    json_str("path", o.path);
+    json_int("matched", (long long)d.matched);
+    json_int("blocks", (long long)nblocks);
+    json_int("literal", (long long)d.literal);
+    json_int("wire", (long long)d.wire);
+    json_end();
+  } else {
+    dprintf(1,"delta: %llu blocks copied of %llu, %llu literal bytes, %llu on the wire\n",
+            (unsigned long long)d.matched, (unsigned long long)nblocks,
+            (unsigned long long)d.literal, (unsigned long long)d.wire);
+  }
+  xfer_report("sync", o.path, &st);
+  return o.digest && xfer_digest_report(&dg, o.path) < 0 ? 1 : 0;
+}
+
 static int cmd_klogtail(int argc, char** argv) {
   (void)argc;(void)argv;
   dprintf(1,"klogtail (stub) Ctrl-C to exit\n");
@@ -348,6 +976,7 @@ static size_t parse_size(const char* s) {
   unsigned long long v = strtoull(s,&end,10);
   if(*end=='K'||*end=='k') v*=1024ULL;
   else if(*end=='M'||*end=='m') v*=1024ULL*1024ULL;
+  else if(*end=='G'||*end=='g') v*=1024ULL*1024ULL*1024ULL;
   return (size_t)v;
 }
 
@@ -366,8 +995,8 @@ static int load_file(const char* path, unsigned char** out, size_t* outlen) {
 
 static int do_exec_common(int argc, char** argv, int debug_mode) {
   if(argc<2) {
-    dprintf(1,"usage: %s [--heap SIZE] [--env KEY=VAL]... <elf> [args...]\n",
-            debug_mode?"debugelf":"execelf");
+    print_usage("%s [--heap SIZE] [--env KEY=VAL]... <elf> [args...]",
+              debug_mode?"debugelf":"execelf");
     return -1;
   }
   size_t heap=0;
@@ -398,7 +1027,11 @@ static int do_exec_common(int argc, char** argv, int debug_mode) {
   (void)heap;
   for(int i=0;i<envc;i++) putenv(envs[i]);
 
-  pid_t pid = elfldr_spawn(0,1,2,data,(char**)prog_argv);
+  stdout_flush();   // the payload writes to fd 1 directly
+  // in a pipeline a stage's stdin and stdout are pipes rather than fds 0/1
+  outbuf_t* out = stdout_buf();
+  int ofd = out && out->fd >= 0 ? out->fd : 1;
+  pid_t pid = elfldr_spawn(session_stdin_fd(),ofd,2,data,(char**)prog_argv);
   if(pid<0) { dprintf(1,"elf spawn failed\n"); free(data); return -1; }
 
   if(debug_mode) {
@@ -427,7 +1060,7 @@ static int cmd_exit(int argc, char** argv) {
 /* kill <pid> [sig] */
 static int cmd_kill(int argc, char** argv) {
   if(argc < 2) {
-    dprintf(1,"usage: kill <pid> [sig]\n");
+    print_usage("kill <pid> [sig]");
     return -1;
   }
   int pid = atoi(argv[1]);
@@ -439,6 +1072,195 @@ static int cmd_kill(int argc, char** argv) {
   return 0;
 }
 
+/* sessions [-k id]: list the listener's session registry or drop a session */
+static int cmd_sessions(int argc, char** argv) {
+  if(argc == 3 && strcmp(argv[1],"-k")==0) {
+    int id = atoi(argv[2]);
+    if(session_kill(id) < 0) {
+      dprintf(1,"sessions: no session %d\n", id);
+      return -1;
+    }
+    dprintf(1,"sessions: killed %d\n", id);
+    return 0;
+  }
+  if(argc != 1) {
+    print_usage("sessions [-k id]");
+    return -1;
+  }
+  session_list();
+  return 0;
+}
+
+/* Rate in bytes/s with an optional K/M/G suffix; "0" or "off" for none. */
+static int parse_rate(const char* s, uint64_t* v) {
+  if(!strcmp(s,"off")) { *v = 0; return 0; }
+  char* end;
+  if(!*s || *s=='-') return -1;
+  *v = strtoull(s, &end, 10);
+  if(*end=='K'||*end=='k') *v <<= 10, end++;
+  else if(*end=='M'||*end=='m') *v <<= 20, end++;
+  else if(*end=='G'||*end=='g') *v <<= 30, end++;
+  return *end ? -1 : 0;
+}
+
+static const char* fmt_bytes(char* out, size_t len, double v) {
+  static const char units[] = "BKMGT";
+  int u = 0;
+  while(v >= 1024 && u < 4) v /= 1024, u++;
+  if(u) snprintf(out, len, "%.1f%c", v, units[u]);
+  else snprintf(out, len, "%.0f", v);
+  return out;
+}
+
+static void transfers_list(void) {
+  bw_xfer_t xs[BW_MAX_XFERS];
+  int n = bw_snapshot(xs, BW_MAX_XFERS);
+  uint64_t limit = bw_limit();
+  int machine = session_machine();
+  if(!machine)
+    dprintf(1,"%4s %4s %3s %-6s %4s %7s %7s %7s %7s %5s %s\n", "ID", "SESS", "WT",
+            "OP", "PRIO", "CAP", "DONE", "TOTAL", "RATE", "ETA", "PATH");
+  for(int i=0;i<n;i++) {
+    bw_xfer_t* x = &xs[i];
+    int known = x->total != UINT64_MAX;
+    long long eta = known && x->rate > 0 && x->bytes < x->total ?
+                    (long long)((x->total - x->bytes) / x->rate) : -1;
+    int weight = bw_session_weight(x->session);
+    if(machine) {
+      json_begin("transfer");
+      json_int("id", x->id);
+      json_int("session", x->session);
+      json_int("weight", weight);
+      json_str("op", x->op);
+      json_int("prio", x->prio);
+      json_int("cap", (long long)x->cap);
+      json_int("bytes", (long long)x->bytes);
+      json_int("total", known ? (long long)x->total : -1);
+      json_int("rate", (long long)x->rate);
+      json_int("eta", eta);
+      json_str("path", x->path);
+      json_end();
+      continue;
+    }
+    char cap[16], done[16], total[16], rate[16], etas[24];
+    if(eta < 0) snprintf(etas, sizeof(etas), "-");
+    else snprintf(etas, sizeof(etas), "%lld:%02lld", eta / 60, eta % 60);
+    dprintf(1,"%4d %4d %3d %-6s %4d %7s %7s %7s %7s %5s %s\n", x->id, x->session,
+            weight, x->op, x->prio,
+            x->cap ? fmt_bytes(cap, sizeof(cap), (double)x->cap) : "-",
+            fmt_bytes(done, sizeof(done), (double)x->bytes),
+            known ? fmt_bytes(total, sizeof(total), (double)x->total) : "-",
+            fmt_bytes(rate, sizeof(rate), x->rate), etas, x->path);
+  }
+  if(machine) {
+    json_begin("bwlimit");
+    json_int("limit", (long long)limit);
+    json_end();
+  } else {
+    char l[16];
+    if(limit) dprintf(1,"limit: %s/s\n", fmt_bytes(l, sizeof(l), (double)limit));
+    else dprintf(1,"limit: none\n");
+  }
+}
+
+/* transfers [-l rate] [-w weight [session]] [-p prio [id]] [-c rate [id]]:
+ * list the running transfers, or set the server-wide limit, a session's
+ * weight, or a transfer's priority or cap. -p and -c without an id apply to
+ * the transfers this session starts next. */
+static int cmd_transfers(int argc, char** argv) {
+  int i = 1;
+  while(i < argc) {
+    const char* f = argv[i];
+    uint64_t v, id = 0;
+    int has_id = 0;
+    if(f[0]!='-' || !f[1] || f[2] || !strchr("lwpc", f[1]) || i+1 >= argc) goto usage;
+    if(f[1]=='l' || f[1]=='c' ? parse_rate(argv[i+1], &v) < 0
+                              : parse_u64(argv[i+1], &v) < 0 || v < 1 || v > 1000) goto usage;
+    i += 2;
+    if(f[1]!='l' && i < argc && argv[i][0]!='-') {
+      if(parse_u64(argv[i], &id) < 0) goto usage;
+      has_id = 1;
+      i++;
+    }
+    int rc = 0;
+    if(f[1]=='l') bw_set_limit(v);
+    else if(f[1]=='w') rc = bw_set_weight(has_id ? (int)id : session_id(), (int)v);
+    else if(has_id) rc = f[1]=='p' ? bw_set_xfer((int)id, (int)v, UINT64_MAX)
+                                   : bw_set_xfer((int)id, 0, v);
+    else rc = f[1]=='p' ? bw_set_default(session_id(), (int)v, UINT64_MAX)
+                        : bw_set_default(session_id(), 0, v);
+    if(rc < 0) {
+      dprintf(1,"transfers: %s\n", has_id && f[1]!='w' ? "no such transfer" : "table full");
+      return -1;
+    }
+  }
+  if(argc == 1) transfers_list();
+  return 0;
+usage:
+  print_usage("transfers [-l rate] [-w weight [session]] [-p prio [id]] [-c rate [id]]");
+  return -1;
+}
+
+/* mode [text|json]: switch the session between human and NDJSON output */
+static int cmd_mode(int argc, char** argv) {
+  if(argc == 1) {
+    dprintf(1,"%s\n", session_machine() ? "json" : "text");
+    return 0;
+  }
+  int on;
+  if(argc == 2 && strcmp(argv[1],"json")==0) on = 1;
+  else if(argc == 2 && strcmp(argv[1],"text")==0) on = 0;
+  else {
+    print_usage("mode [text|json]");
+    return -1;
+  }
+  return session_set_machine(on);
+}
+
+/* mux: carry several channels over this connection from now on */
+static int cmd_mux(int argc, char** argv) {
+  (void)argc;(void)argv;
+  if(session_mux() < 0) {
+    dprintf(1,"mux: only available as a plain command on a top-level session\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* persist: keep this session (and its jobs) alive across disconnects */
+static int cmd_persist(int argc, char** argv) {
+  (void)argc;(void)argv;
+  if(session_persist() < 0) {
+    dprintf(1,"persist: only available on a top-level session\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* detach: leave the session running and drop the connection */
+static int cmd_detach(int argc, char** argv) {
+  (void)argc;(void)argv;
+  if(session_detach() < 0) {
+    dprintf(1,"detach: only available on a top-level session\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* attach <id>: take over a persistent session, replaying its scrollback */
+static int cmd_attach(int argc, char** argv) {
+  if(argc != 2) {
+    print_usage("attach <id>");
+    return -1;
+  }
+  int id = atoi(argv[1]);
+  if(session_attach(id) < 0) {
+    dprintf(1,"attach: no persistent session %d to attach from here\n", id);
+    return -1;
+  }
+  return 0;
+}
+
 /* ---- serverctl helpers ---- */
 static int read_pidfile_builtin(pid_t* pid_out) {
   FILE* f = fopen(SSHSVR_PIDFILE, "r");
@@ -483,9 +1305,16 @@ static int serverctl_start(int argc, char** argv, int offset, int do_force) {
   int port = SSHSVR_DEFAULT_PORT;
   const char* envp = getenv("SSHSVR_PORT");
   if(envp) port = atoi(envp);
+  // the new server keeps this one's HTTP settings unless given new ones
+  int roots = 0;
   for(int i=offset;i<argc;i++) {
     if(strcmp(argv[i],"-p")==0 && i+1<argc) {
       port = atoi(argv[++i]);
+    } else if(strcmp(argv[i],"-H")==0 && i+1<argc) {
+      g_http.port = (uint16_t)atoi(argv[++i]);
+    } else if(strcmp(argv[i],"-R")==0 && i+1<argc) {
+      if(!roots++) g_http.nroots = 0;
+      http_add_root(argv[++i]);
     }
   }
   pid_t pid;
@@ -493,6 +1322,7 @@ static int serverctl_start(int argc, char** argv, int offset, int do_force) {
     dprintf(1,"serverctl: already running (pid=%d). Use restart or start --force.\n", pid);
     return 1;
   }
+  stdout_flush();
   pid_t child = fork();
   if(child < 0) {
     dprintf(1,"serverctl: fork failed\n");
@@ -528,11 +1358,11 @@ static int serverctl_status(void) {
 
 static int cmd_serverctl(int argc, char** argv) {
   if(argc < 2) {
-    dprintf(1,"usage: serverctl <start|stop|restart|status> [options]\n"
-              " start   [-p port] [--force]\n"
-              " stop\n"
-              " restart [-p port] [--force]\n"
-              " status\n");
+    print_usage("serverctl <start|stop|restart|status> [options]\n"
+                " start   [-p port] [-H http_port [-R dir]...] [--force]\n"
+                " stop\n"
+                " restart [-p port] [-H http_port [-R dir]...] [--force]\n"
+                " status");
     return -1;
   }
   int do_force = 0;
@@ -577,6 +1407,38 @@ static void enc_spaces(const char* in, char* out, size_t outsz) {
   if(oi < outsz) out[oi] = 0; else out[outsz-1] = 0;
 }
 
+/* Install progress: "[install] ..." text, or an install record whose event
+ * names the step in machine mode. */
+static void install_event(const char* event, const char* fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+static void install_event(const char* event, const char* fmt, ...) {
+  char msg[512];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  if(session_machine()) {
+    json_begin("install");
+    json_str("event", event);
+    json_str("msg", msg);
+    json_end();
+    return;
+  }
+  dprintf(1, "[install] %s\n", msg);
+}
+
+static void install_dpi_response(const char* dpi, const char* resp) {
+  if(session_machine()) {
+    json_begin("install");
+    json_str("event", "dpi_response");
+    json_str("dpi", dpi);
+    json_str("body", resp);
+    json_end();
+    return;
+  }
+  dprintf(1, "DPI %s response: %s\n", dpi, resp);
+}
+
 static int dpi_send_json_9090(const char* url_or_path) {
   int fd = socket(AF_INET, SOCK_STREAM, 0);
   if(fd < 0) return -1;
@@ -614,7 +1476,7 @@ static int dpi_send_json_9090(const char* url_or_path) {
   if(p) res = atoi(p + (int)strlen(key));
 
   if(res == 0) return 0;
-  dprintf(1, "DPI v1 response: %s\n", resp);
+  install_dpi_response("v1", resp);
   return -1;
 }
 
@@ -661,7 +1523,7 @@ static int dpi_v2_post_url_12800(const char* url_or_path) {
 
   // Look for SUCCESS in body
   if(strstr(resp, "SUCCESS")) return 0;
-  dprintf(1, "DPI v2 response:\n%s\n", resp);
+  install_dpi_response("v2", resp);
   return -1;
 }
 
@@ -678,11 +1540,11 @@ static int klog_wait_install(int timeout_sec) {
 
     if (connect(fd, (struct sockaddr*)&a, sizeof(a)) < 0) {
         close(fd);
-        dprintf(1, "[install] KLOG monitoring not available, install may still succeed\n");
+        install_event("no_klog", "KLOG monitoring not available, install may still succeed");
         return 0;
     }
 
-    dprintf(1, "[install] watching KLOG for completion (up to %d s)...\n", timeout_sec);
+    install_event("watching", "watching KLOG for completion (up to %d s)...", timeout_sec);
 
     char buffer[4096];          // larger buffer
     char line[1024] = {0};      // for line accumulation
@@ -707,7 +1569,7 @@ static int klog_wait_install(int timeout_sec) {
 
         if (rc == 0) {  // timeout tick
             if (++elapsed >= timeout_sec) {
-                dprintf(1, "[install] timeout waiting for completion\n");
+                install_event("timeout", "timeout waiting for completion");
                 break;
             }
             continue;
@@ -752,23 +1614,30 @@ static int klog_wait_install(int timeout_sec) {
                 // ────────────────────────────────────────────────
 
                 if (strstr(s, "Staring Pre-allocation transfer")) {
-                    dprintf(1, "[install] pre-allocation transfer started.\n");
+                    install_event("prealloc", "pre-allocation transfer started.");
                 }
 
                 if (strstr(s, "[PlayGoCore][RequestInstall] begin")) {
-                    dprintf(1, "[install] Installation requested\n");
+                    install_event("requested", "Installation requested");
                 }
 
                 if (strstr(s, "application data size (")) {
                     int bytes = 0;
                     if (sscanf(strstr(s, "application data size (") + 23, "%d", &bytes) == 1) {
                         double mb = bytes / 1048576.0;
-                        dprintf(1, "[install] Game Size: %.2f MB\n", mb);
+                        if (session_machine()) {
+                            json_begin("install");
+                            json_str("event", "size");
+                            json_int("bytes", bytes);
+                            json_end();
+                        } else {
+                            dprintf(1, "[install] Game Size: %.2f MB\n", mb);
+                        }
                     }
                 }
 
                 if (strstr(s, "transfer started")) {
-                    dprintf(1, "[install] transfer started\n");
+                    install_event("transfer", "transfer started");
                 }
 
                 // Detect completion from progress line like "started (1572864/1572864)"
@@ -776,7 +1645,7 @@ static int klog_wait_install(int timeout_sec) {
                 if (prog) {
                     int cur = 0, tot = 0;
                     if (sscanf(prog + 9, "%d/%d", &cur, &tot) == 2 && cur == tot && tot > 0) {
-                        dprintf(1, "[install] Transfer completed\n");
+                        install_event("transfer_done", "Transfer completed");
                     }
                 }
 
@@ -785,7 +1654,7 @@ static int klog_wait_install(int timeout_sec) {
                     // remove trailing newline/spaces if needed
                     char *end = time_str + strlen(time_str) - 1;
                     while (end >= time_str && (*end == '\n' || *end == ' ')) *end-- = '\0';
-                    dprintf(1, "[install] Completed in: %s\n", time_str);
+                    install_event("elapsed", "Completed in: %s", time_str);
                 }
 
                 // ────────────────────────────────────────────────
@@ -837,16 +1706,26 @@ static int klog_wait_install(int timeout_sec) {
 finished:
     close(fd);
 
+    if (session_machine()) {
+        json_begin("install");
+        json_str("event", "result");
+        json_bool("ok", result == 0);
+        json_int("state", final_state);
+        json_int("error", (long long)final_err);
+        json_end();
+    }
     if (result == 0) {
-        dprintf(1, "[install] Installation completed successfully\n");
+        if (!session_machine())
+            dprintf(1, "[install] Installation completed successfully\n");
         klog_printf("[install] Installation completed successfully\n");
     } else if (result == -1) {
-        dprintf(1, "[install] Installation failed (state=%d, error=0x%x)\n",
-                final_state, final_err);
+        if (!session_machine())
+            dprintf(1, "[install] Installation failed (state=%d, error=0x%x)\n",
+                    final_state, final_err);
         klog_printf("[install] Installation failed (state=%d, error=0x%x)\n",
                 final_state, final_err);
     } else {
-        dprintf(1, "[install] Did not detect completion status — check manually\n");
+        install_event("unknown", "Did not detect completion status — check manually");
     }
 
     return result;
@@ -854,16 +1733,21 @@ finished:
 
 static int cmd_install(int argc, char **argv) {
     int wait_flag = 0;
+    int local_flag = 0;
     int i = 1;
     for (; i < argc; i++) {
         if (strcmp(argv[i], "-w") == 0) {
             wait_flag = 1;
             continue;
         }
+        if (strcmp(argv[i], "-l") == 0) {
+            local_flag = 1;
+            continue;
+        }
         break;
     }
     if (i >= argc) {
-        dprintf(1, "usage: install [-w] <pkgfile or http(s) URL>\n");
+        print_usage("install [-w] [-l] <pkgfile or http(s) URL>");
         return -1;
     }
 
@@ -883,13 +1767,32 @@ static int cmd_install(int argc, char **argv) {
             print_error(target);
             return -1;
         }
+        // a file the HTTP server serves goes to DPI as a range-capable URL
+        char url[PATH_MAX];
+        if (!local_flag && http_url(target, url, sizeof(url)) == 0)
+            strcpy(target, url);
     }
 
-    dprintf(1, "Installing: %s\n", target);
-    dprintf(1, "Starting installation sequence for %s\n", target);
+    int machine = session_machine();
+    if (machine) {
+        json_begin("install");
+        json_str("event", "begin");
+        json_str("target", target);
+        json_end();
+    } else {
+        dprintf(1, "Installing: %s\n", target);
+        dprintf(1, "Starting installation sequence for %s\n", target);
+    }
 
     if (dpi_send_json_9090(target) == 0 || dpi_v2_post_url_12800(target) == 0) {
-        dprintf(1, "Install started. See on-screen notifications.\n");
+        if (machine) {
+            json_begin("install");
+            json_str("event", "started");
+            json_bool("wait", wait_flag);
+            json_end();
+        } else {
+            dprintf(1, "Install started. See on-screen notifications.\n");
+        }
         if (wait_flag) {
             int rc = klog_wait_install(600);  // up to 10 min
             return rc;
@@ -897,63 +1800,82 @@ static int cmd_install(int argc, char **argv) {
         return 0;
     }
 
-    dprintf(1, "DirectPKGInstaller not reachable (9090/12800). Enable it and retry.\n");
+    if (machine) {
+        json_begin("install");
+        json_str("event", "unreachable");
+        json_str("msg", "DirectPKGInstaller not reachable (9090/12800)");
+        json_end();
+    } else {
+        dprintf(1, "DirectPKGInstaller not reachable (9090/12800). Enable it and retry.\n");
+    }
     return -1;
 }
 /* --- end install block --- */
 
-/* Builtin command dispatch table — must be BEFORE builtin_table() */
+/* Builtin command dispatch table — must be BEFORE builtin_table().
+ * Kept sorted by name: builtin_lookup() binary-searches it. Aliases are
+ * ordinary entries whose preset argument is spliced in after argv[0]. */
 static const builtin_t g_builtins[] = {
-  {"help",      cmd_help,      "Show help"},
-  {"exit",      cmd_exit,      "Exit session"},
-  {"ls",        cmd_ls,        "List directory"},
-  {"ll",        cmd_ls,        "Alias for ls -l"},
-  {"rm",        cmd_rm,        "Remove files (-r)"},
-  {"cp",        cmd_cp,        "Copy files (-r)"},
-  {"mv",        cmd_mv,        "Move/rename"},
-  {"mkdir",     cmd_mkdir,     "Create directories (-p)"},
-  {"pwd",       cmd_pwd,       "Print working directory"},
-  {"cd",        cmd_cd,        "Change directory"},
-  {"cat",       cmd_cat,       "Show file contents"},
-  {"ps",        cmd_ps,        "List processes"},
-  {"put",       cmd_put,       "Receive base64 file"},
-  {"get",       cmd_get,       "Send base64 file"},
-  {"install",   cmd_install,   "Install PKG via etaHEN DPI (9090/12800)"},
-  {"klogtail",  cmd_klogtail,  "Tail kernel log (stub)"},
-  {"execelf",   cmd_execelf,   "Execute ELF payload"},
+  {"attach",    cmd_attach,    "Attach to a persistent session (attach <id>)", BI_INLINE},
+  {"cat",       cmd_cat,       "Show file contents", BI_BULK},
+  {"cd",        cmd_cd,        "Change directory", BI_INLINE},
+  {"cp",        cmd_cp,        "Copy files (-r, -c/-S digest)"},
   {"debugelf",  cmd_debugelf,  "Execute ELF (debug mode)"},
-  {"kill",      cmd_kill,      "Send signal (kill <pid> [sig])"},
-  {"serverctl", cmd_serverctl, "Control server (start/stop/restart/status)"}
+  {"detach",    cmd_detach,    "Detach, leaving the session running", BI_INLINE},
+  {"execelf",   cmd_execelf,   "Execute ELF payload"},
+  {"exit",      cmd_exit,      "Exit session", BI_INLINE},
+  {"get",       cmd_get,       "Send file (base64, -b raw, -z compressed, -c/-S digest)", BI_BULK},
+  {"getdir",    cmd_getdir,    "Send directory tree as a tar stream", BI_BULK},
+  {"help",      cmd_help,      "Show help", BI_INLINE},
+  {"install",   cmd_install,   "Install PKG via etaHEN DPI (9090/12800, -l local path)"},
+  {"kill",      cmd_kill,      "Send signal (kill <pid> [sig])", BI_INLINE},
+  {"klogtail",  cmd_klogtail,  "Tail kernel log (stub)"},
+  {"ll",        cmd_ls,        "Alias for ls -l", BI_BULK, "-l"},
+  {"ls",        cmd_ls,        "List directory", BI_BULK},
+  {"mkdir",     cmd_mkdir,     "Create directories (-p)", BI_INLINE},
+  {"mode",      cmd_mode,      "Output mode (text/json)", BI_INLINE},
+  {"mux",       cmd_mux,       "Switch to framed channel multiplexing", BI_INLINE},
+  {"mv",        cmd_mv,        "Move/rename (copies across filesystems)"},
+  {"persist",   cmd_persist,   "Keep session alive across disconnects", BI_INLINE},
+  {"ps",        cmd_ps,        "List processes", BI_BULK},
+  {"put",       cmd_put,       "Receive file (base64, -b raw, -z compressed, -c/-S digest)"},
+  {"putdir",    cmd_putdir,    "Receive directory tree as a tar stream ([size])"},
+  {"pwd",       cmd_pwd,       "Print working directory", BI_INLINE},
+  {"rm",        cmd_rm,        "Remove files (-r)"},
+  {"serverctl", cmd_serverctl, "Control server (start/stop/restart/status)"},
+  {"sessions",  cmd_sessions,  "List sessions (-k id to kill one)", BI_INLINE},
+  {"sum",       cmd_sum,       "CRC-32C and size of a file (-o off -n len)"},
+  {"sync",      cmd_sync,      "Update file from a delta (-B block, -c/-S digest)"},
+  {"transfers", cmd_transfers, "List transfers, set bandwidth (-l limit, -w, -p, -c)", BI_INLINE}
 };
 
+#define NBUILTINS (sizeof(g_builtins)/sizeof(g_builtins[0]))
+
 // Ensure builtin_table() is located AFTER the g_builtins[] definition.
 const builtin_t* builtin_table(size_t* count) {
-  if(count) *count = sizeof(g_builtins)/sizeof(g_builtins[0]);
+  if(count) *count = NBUILTINS;
   return g_builtins;
 }
 
-int builtin_is_pipeline_safe(const char* name) {
-  (void)name;
-  return 1;
+const builtin_t* builtin_lookup(const char* name) {
+  size_t lo = 0, hi = NBUILTINS;
+  while(lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    int c = strcmp(name, g_builtins[mid].name);
+    if(c == 0) return &g_builtins[mid];
+    if(c < 0) hi = mid;
+    else lo = mid + 1;
+  }
+  return NULL;
 }
 
-int run_builtin_in_current(int argc, char** argv, pid_t listener_pid) {
-  (void)listener_pid;
-  size_t n;
-  const builtin_t* tbl = builtin_table(&n);
-  for(size_t i=0;i<n;i++) {
-    if(strcmp(argv[0], tbl[i].name)==0) {
-      if(strcmp(argv[0],"ll")==0) {
-        char* nargs[argc+2];
-        nargs[0]="ls";
-        nargs[1]="-l";
-        for(int j=1;j<argc;j++) nargs[j+1]=argv[j];
-        nargs[argc+1]=NULL;
-        return tbl[i].fn(argc+1,nargs);
-      }
-      return tbl[i].fn(argc, argv);
-    }
-  }
-  return -2;
+int builtin_run(const builtin_t* b, int argc, char** argv) {
+  if(!b->preset) return b->fn(argc, argv);
+  char* nargs[argc+2];
+  nargs[0] = argv[0];
+  nargs[1] = (char*)b->preset;
+  for(int j=1;j<argc;j++) nargs[j+1] = argv[j];
+  nargs[argc+1] = NULL;
+  return b->fn(argc+1, nargs);
 }
 /* ---- end additions ---- */
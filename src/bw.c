@@ -0,0 +1,359 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bw.h"
+#include "session.h"
+
+#define BW_WINDOW   0.25          // rate measurement interval, s
+#define BW_RESHARE  0.05          // share recomputed at most this often, s
+#define BW_BURST    0.05          // credit a transfer may bank while idle, s
+#define BW_SLICE    0.1           // longest single sleep, s
+#define BW_MIN_RATE (16 * 1024)   // floor for any share, bytes/s
+
+typedef struct bw_sess {
+  int      id;       // 0: free
+  int      weight;
+  int      prio;     // for the session's next transfers
+  uint64_t cap;
+} bw_sess_t;
+
+typedef struct bw_shared {
+  volatile int   lock;
+  volatile pid_t owner;
+  uint64_t       limit;
+  int            next_id;
+  bw_sess_t      sess[BW_MAX_SESSIONS];
+  bw_xfer_t      xfer[BW_MAX_XFERS];
+} bw_shared_t;
+
+/* A thread's own transfer: pipeline stages run as threads of one job. */
+typedef struct bw_local {
+  bw_xfer_t* self;
+  double     next;       // pacing clock: when the bytes so far are due
+  double     win_t;      // rate window start
+  uint64_t   win_b;
+  double     share_t;
+} bw_local_t;
+
+static bw_shared_t*   g_bw;
+static pthread_key_t  g_local_key;
+static pthread_once_t g_local_once = PTHREAD_ONCE_INIT;
+
+static double now_secs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The table is shared between processes, so a spinlock on the mapping; a
+ * holder that died (killed mid-update) is detected and the lock taken over. */
+static void bw_lock(void) {
+  for(unsigned spins = 1; __sync_lock_test_and_set(&g_bw->lock, 1); spins++) {
+    if(spins % 1024 == 0) {
+      pid_t o = g_bw->owner;
+      if(o > 0 && kill(o, 0) < 0 && errno == ESRCH) {
+        g_bw->owner = 0;
+        __sync_lock_release(&g_bw->lock);
+      }
+    }
+    sched_yield();
+  }
+  g_bw->owner = getpid();
+}
+
+static void bw_unlock(void) {
+  g_bw->owner = 0;
+  __sync_lock_release(&g_bw->lock);
+}
+
+int bw_init(void) {
+  void* p = mmap(NULL, sizeof(bw_shared_t), PROT_READ|PROT_WRITE,
+                 MAP_ANON|MAP_SHARED, -1, 0);
+  if(p == MAP_FAILED) return -1;
+  memset(p, 0, sizeof(bw_shared_t));
+  g_bw = p;
+  return 0;
+}
+
+/* ---- table (locked) ---- */
+
+static int sess_busy(int id) {
+  for(int i=0;i<BW_MAX_XFERS;i++)
+    if(g_bw->xfer[i].id && g_bw->xfer[i].session == id) return 1;
+  return 0;
+}
+
+/* Settings of session id; a new entry takes a free slot or one whose session
+ * has no transfers. */
+static bw_sess_t* sess_get(int id, int create) {
+  bw_sess_t* slot = NULL;
+  for(int i=0;i<BW_MAX_SESSIONS;i++) {
+    bw_sess_t* s = &g_bw->sess[i];
+    if(s->id == id) return s;
+    if(!s->id && !slot) slot = s;
+  }
+  if(!create) return NULL;
+  for(int i=0; !slot && i<BW_MAX_SESSIONS; i++)
+    if(!sess_busy(g_bw->sess[i].id)) slot = &g_bw->sess[i];
+  if(slot) *slot = (bw_sess_t){ id, BW_DEF_WEIGHT, BW_DEF_WEIGHT, 0 };
+  return slot;
+}
+
+static bw_xfer_t* xfer_get(int id) {
+  for(int i=0;i<BW_MAX_XFERS;i++)
+    if(g_bw->xfer[i].id == id) return &g_bw->xfer[i];
+  return NULL;
+}
+
+/* ---- shares ---- */
+
+/* Weighted max-min fair allocation of the limit. A transfer's weight is its
+ * session's weight split by priority among the session's transfers. Others
+ * running well below their last share are held back elsewhere: their demand
+ * is what they move plus headroom, and the rest goes to the others. Returns
+ * self's allowance in bytes/s, 0 for unlimited. */
+static double compute_share(bw_xfer_t* self) {
+  double w[BW_MAX_XFERS], d[BW_MAX_XFERS], alloc[BW_MAX_XFERS];
+  int fixed[BW_MAX_XFERS];
+  int n = 0, me = -1;
+  double now = now_secs();
+  bw_lock();
+  double limit = (double)g_bw->limit;
+  double cap = (double)self->cap;
+  if(!limit) {
+    bw_unlock();
+    return cap;
+  }
+  for(int i=0;i<BW_MAX_XFERS;i++) {
+    bw_xfer_t* x = &g_bw->xfer[i];
+    if(!x->id) continue;
+    double psum = 0;
+    for(int j=0;j<BW_MAX_XFERS;j++)
+      if(g_bw->xfer[j].id && g_bw->xfer[j].session == x->session) psum += g_bw->xfer[j].prio;
+    bw_sess_t* s = sess_get(x->session, 0);
+    w[n] = (s ? s->weight : BW_DEF_WEIGHT) * x->prio / psum;
+    d[n] = x->cap ? (double)x->cap : limit;
+    if(x != self && x->share > 0 && x->rate < x->share / 2 && now - x->t0 > 1) {
+      double want = x->rate * 1.5 > BW_MIN_RATE ? x->rate * 1.5 : BW_MIN_RATE;
+      if(want < d[n]) d[n] = want;
+    }
+    if(x == self) me = n;
+    fixed[n] = 0;
+    n++;
+  }
+  bw_unlock();
+  if(me < 0) return cap;
+  // water-filling: satisfy every demand below its fair part, split the rest
+  double left = limit;
+  for(;;) {
+    double wsum = 0, used = 0;
+    int more = 0;
+    for(int i=0;i<n;i++) if(!fixed[i]) wsum += w[i];
+    if(wsum <= 0) break;
+    for(int i=0;i<n;i++) {
+      if(fixed[i]) continue;
+      double fair = left * w[i] / wsum;
+      if(d[i] < fair) {
+        alloc[i] = d[i];
+        used += d[i];
+        fixed[i] = 1;
+        more = 1;
+      }
+    }
+    left -= used;
+    if(!more) {
+      for(int i=0;i<n;i++) if(!fixed[i]) alloc[i] = left * w[i] / wsum;
+      break;
+    }
+  }
+  return alloc[me] > BW_MIN_RATE ? alloc[me] : BW_MIN_RATE;
+}
+
+/* ---- transfers ---- */
+
+/* A thread that ends mid-transfer leaves no slot behind. */
+static void local_free(void* p) {
+  bw_local_t* l = p;
+  if(l->self && g_bw) {
+    bw_lock();
+    memset(l->self, 0, sizeof(*l->self));
+    bw_unlock();
+  }
+  free(l);
+}
+
+static void local_key_init(void) {
+  pthread_key_create(&g_local_key, local_free);
+}
+
+static bw_local_t* local_get(int create) {
+  pthread_once(&g_local_once, local_key_init);
+  bw_local_t* l = pthread_getspecific(g_local_key);
+  if(!l && create && (l = calloc(1, sizeof(*l))) && pthread_setspecific(g_local_key, l) != 0) {
+    free(l);
+    l = NULL;
+  }
+  return l;
+}
+
+void bw_begin(const char* op, const char* path, uint64_t total) {
+  if(!g_bw) return;
+  bw_local_t* l = local_get(1);
+  if(!l || l->self) return;
+  double now = now_secs();
+  bw_lock();
+  int sid = session_id();
+  bw_sess_t* s = sess_get(sid, 1);
+  for(int i=0;i<BW_MAX_XFERS;i++) {
+    bw_xfer_t* x = &g_bw->xfer[i];
+    if(x->id) continue;
+    memset(x, 0, sizeof(*x));
+    x->id = ++g_bw->next_id;
+    x->pid = getpid();
+    x->session = sid;
+    x->prio = s ? s->prio : BW_DEF_WEIGHT;
+    x->cap = s ? s->cap : 0;
+    snprintf(x->op, sizeof(x->op), "%s", op);
+    snprintf(x->path, sizeof(x->path), "%s", path);
+    x->total = total;
+    x->t0 = now;
+    l->self = x;
+    break;
+  }
+  bw_unlock();
+  l->next = l->win_t = now;
+  l->win_b = 0;
+  l->share_t = 0;
+}
+
+static void sleep_secs(double s) {
+  struct timespec ts = { (time_t)s, (long)((s - (time_t)s) * 1e9) };
+  while(nanosleep(&ts, &ts) < 0 && errno == EINTR) ;
+}
+
+void bw_io(uint64_t n) {
+  bw_local_t* l = g_bw ? local_get(0) : NULL;
+  bw_xfer_t* x = l ? l->self : NULL;
+  if(!x) return;
+  x->bytes += n;
+  double now = now_secs();
+  if(now - l->win_t >= BW_WINDOW) {
+    double r = (x->bytes - l->win_b) / (now - l->win_t);
+    x->rate = x->rate > 0 ? (x->rate + r) / 2 : r;
+    l->win_t = now;
+    l->win_b = x->bytes;
+  }
+  if(now - l->share_t >= BW_RESHARE) {
+    x->share = compute_share(x);
+    l->share_t = now;
+  }
+  if(x->share <= 0) return;
+  if(l->next < now - BW_BURST) l->next = now - BW_BURST;
+  l->next += n / x->share;
+  // sleep in slices so a new limit or cap takes effect within one
+  while(l->next > now) {
+    double wait = l->next - now;
+    sleep_secs(wait < BW_SLICE ? wait : BW_SLICE);
+    now = now_secs();
+    double old = x->share;
+    x->share = compute_share(x);
+    l->share_t = now;
+    if(x->share <= 0) break;
+    if(l->next > now && x->share != old) l->next = now + (l->next - now) * old / x->share;
+  }
+}
+
+void bw_end(void) {
+  bw_local_t* l = g_bw ? local_get(0) : NULL;
+  if(!l || !l->self) return;
+  bw_lock();
+  memset(l->self, 0, sizeof(*l->self));
+  bw_unlock();
+  l->self = NULL;
+}
+
+size_t bw_chunk(size_t max) {
+  bw_local_t* l = g_bw ? local_get(0) : NULL;
+  bw_xfer_t* x = l ? l->self : NULL;
+  if(!x || x->share <= 0) return max;
+  size_t c = (size_t)(x->share * BW_SLICE);
+  if(c < 65536) c = 65536;
+  return c < max ? c : max;
+}
+
+void bw_reap(pid_t pid) {
+  if(!g_bw) return;
+  bw_lock();
+  for(int i=0;i<BW_MAX_XFERS;i++)
+    if(g_bw->xfer[i].id && g_bw->xfer[i].pid == pid) memset(&g_bw->xfer[i], 0, sizeof(bw_xfer_t));
+  bw_unlock();
+}
+
+/* ---- settings ---- */
+
+uint64_t bw_limit(void) {
+  return g_bw ? g_bw->limit : 0;
+}
+
+void bw_set_limit(uint64_t rate) {
+  if(!g_bw) return;
+  bw_lock();
+  g_bw->limit = rate;
+  bw_unlock();
+}
+
+int bw_set_weight(int session, int weight) {
+  if(!g_bw) return -1;
+  bw_lock();
+  bw_sess_t* s = sess_get(session, 1);
+  if(s) s->weight = weight;
+  bw_unlock();
+  return s ? 0 : -1;
+}
+
+int bw_set_xfer(int id, int prio, uint64_t cap) {
+  if(!g_bw) return -1;
+  bw_lock();
+  bw_xfer_t* x = xfer_get(id);
+  if(x && prio) x->prio = prio;
+  if(x && cap != UINT64_MAX) x->cap = cap;
+  bw_unlock();
+  return x ? 0 : -1;
+}
+
+int bw_set_default(int session, int prio, uint64_t cap) {
+  if(!g_bw) return -1;
+  bw_lock();
+  bw_sess_t* s = sess_get(session, 1);
+  if(s && prio) s->prio = prio;
+  if(s && cap != UINT64_MAX) s->cap = cap;
+  bw_unlock();
+  return s ? 0 : -1;
+}
+
+int bw_session_weight(int session) {
+  if(!g_bw) return BW_DEF_WEIGHT;
+  bw_lock();
+  bw_sess_t* s = sess_get(session, 0);
+  int w = s ? s->weight : BW_DEF_WEIGHT;
+  bw_unlock();
+  return w;
+}
+
+int bw_snapshot(bw_xfer_t* out, int max) {
+  if(!g_bw) return 0;
+  int n = 0;
+  bw_lock();
+  for(int i=0;i<BW_MAX_XFERS && n<max;i++)
+    if(g_bw->xfer[i].id) out[n++] = g_bw->xfer[i];
+  bw_unlock();
+  return n;
+}
@@ -0,0 +1,109 @@
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#define CRC32C_X86 1
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u   // reflected
+
+/* Slicing-by-8: eight table lookups per 8 input bytes. */
+static uint32_t g_tab[8][256];
+static int g_tab_ready;
+static int g_hw;   // SSE4.2 crc32 instruction available
+
+static void crc32c_init(void) {
+  for(unsigned i=0;i<256;i++) {
+    uint32_t c = i;
+    for(int k=0;k<8;k++) c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    g_tab[0][i] = c;
+  }
+  for(unsigned i=0;i<256;i++)
+    for(int t=1;t<8;t++)
+      g_tab[t][i] = (g_tab[t-1][i] >> 8) ^ g_tab[0][g_tab[t-1][i] & 0xff];
+#ifdef CRC32C_X86
+  unsigned a, b, c, d;
+  g_hw = __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_2);
+#endif
+  g_tab_ready = 1;
+}
+
+#ifdef CRC32C_X86
+/* The crc32 instruction computes CRC-32C directly, 8 bytes at a time. */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len) {
+  uint64_t c = ~crc;
+  while(len && ((uintptr_t)p & 7)) {
+    c = _mm_crc32_u8((uint32_t)c, *p++);
+    len--;
+  }
+  for(; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  while(len--) c = _mm_crc32_u8((uint32_t)c, *p++);
+  return ~(uint32_t)c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+  const unsigned char* p = data;
+  if(!g_tab_ready) crc32c_init();
+#ifdef CRC32C_X86
+  if(g_hw) return crc32c_hw(crc, p, len);
+#endif
+  crc = ~crc;
+  while(len && ((uintptr_t)p & 7)) {
+    crc = (crc >> 8) ^ g_tab[0][(crc ^ *p++) & 0xff];
+    len--;
+  }
+  while(len >= 8) {
+    uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                         (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    crc = g_tab[7][lo & 0xff] ^ g_tab[6][(lo >> 8) & 0xff] ^
+          g_tab[5][(lo >> 16) & 0xff] ^ g_tab[4][lo >> 24] ^
+          g_tab[3][p[4]] ^ g_tab[2][p[5]] ^ g_tab[1][p[6]] ^ g_tab[0][p[7]];
+    p += 8;
+    len -= 8;
+  }
+  while(len--) crc = (crc >> 8) ^ g_tab[0][(crc ^ *p++) & 0xff];
+  return ~crc;
+}
+
+/* ---- combine ---- */
+
+/* zlib's crc32_combine() method: appending len2 zero bytes to the first
+ * message is a linear operator on its CRC, applied by repeated squaring of
+ * the one-zero-bit operator in GF(2). */
+static uint32_t gf2_times(const uint32_t* mat, uint32_t vec) {
+  uint32_t sum = 0;
+  for(; vec; vec >>= 1, mat++)
+    if(vec & 1) sum ^= *mat;
+  return sum;
+}
+
+static void gf2_square(uint32_t* sq, const uint32_t* mat) {
+  for(int n=0;n<32;n++) sq[n] = gf2_times(mat, mat[n]);
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+  if(!len2) return crc1;
+  uint32_t even[32], odd[32];
+  odd[0] = CRC32C_POLY;
+  for(int n=1;n<32;n++) odd[n] = 1u << (n - 1);
+  gf2_square(even, odd);   // two zero bits
+  gf2_square(odd, even);   // four
+  for(;;) {
+    gf2_square(even, odd);
+    if(len2 & 1) crc1 = gf2_times(even, crc1);
+    if(!(len2 >>= 1)) break;
+    gf2_square(odd, even);
+    if(len2 & 1) crc1 = gf2_times(odd, crc1);
+    if(!(len2 >>= 1)) break;
+  }
+  return crc1 ^ crc2;
+}
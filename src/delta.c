@@ -0,0 +1,41 @@
+#include <string.h>
+
+#include "delta.h"
+#include "sha256.h"
+
+void delta_roll_init(delta_roll_t* r, const unsigned char* p, size_t len) {
+  uint32_t a = 0, b = 0;
+  for(size_t i=0;i<len;i++) {
+    a += p[i];
+    b += a;
+  }
+  r->a = a & 0xffff;
+  r->b = b & 0xffff;
+  r->len = len;
+}
+
+uint32_t delta_weak(const void* p, size_t len) {
+  delta_roll_t r;
+  delta_roll_init(&r, p, len);
+  return delta_roll_sum(&r);
+}
+
+void delta_strong(const void* p, size_t len, unsigned char out[DELTA_STRONG]) {
+  sha256_t s;
+  unsigned char h[SHA256_LEN];
+  sha256_init(&s);
+  sha256_update(&s, p, len);
+  sha256_final(&s, h);
+  memcpy(out, h, DELTA_STRONG);
+}
+
+uint32_t delta_block_size(uint64_t size) {
+  uint64_t b = 1;
+  while(b * b < size) b <<= 1;                 // power of two >= sqrt(size)
+  for(uint64_t s = b >> 1; s; s >>= 1)         // then bisect down to it
+    if((b - s) * (b - s) >= size) b -= s;
+  b &= ~(uint64_t)1023;
+  if(b < DELTA_MIN_BLOCK) b = DELTA_MIN_BLOCK;
+  if(b > DELTA_MAX_BLOCK) b = DELTA_MAX_BLOCK;
+  return (uint32_t)b;
+}
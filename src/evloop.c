@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if __has_include(<sys/event.h>)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#define HAVE_KQUEUE 1
+#else
+#include <poll.h>
+#endif
+
+#include "evloop.h"
+
+/* Interest and owner per fd; the backend only ever reports fds found here. */
+static struct {
+  int   mask;
+  void* udata;
+} g_fds[EVL_MAX_FDS];
+
+static int g_maxfd = -1;
+
+static int evl_track(int fd, int mask, void* udata) {
+  if(fd < 0 || fd >= EVL_MAX_FDS) { errno = EMFILE; return -1; }
+  g_fds[fd].mask = mask;
+  g_fds[fd].udata = mask ? udata : NULL;
+  if(mask && fd > g_maxfd) g_maxfd = fd;
+  while(g_maxfd >= 0 && !g_fds[g_maxfd].mask) g_maxfd--;
+  return 0;
+}
+
+#ifdef HAVE_KQUEUE
+static int g_kq = -1;
+
+int evl_init(void) {
+  memset(g_fds, 0, sizeof(g_fds));
+  g_maxfd = -1;
+  g_kq = kqueue();
+  return g_kq < 0 ? -1 : 0;
+}
+
+void evl_fini(void) {
+  if(g_kq >= 0) close(g_kq);
+  g_kq = -1;
+}
+
+int evl_set(int fd, int mask, void* udata) {
+  if(fd < 0 || fd >= EVL_MAX_FDS) { errno = EMFILE; return -1; }
+  int old = g_fds[fd].mask;
+  struct kevent ch[2];
+  int n = 0;
+  if((mask ^ old) & EVL_READ)
+    EV_SET(&ch[n++], fd, EVFILT_READ, (mask & EVL_READ) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+  if((mask ^ old) & EVL_WRITE)
+    EV_SET(&ch[n++], fd, EVFILT_WRITE, (mask & EVL_WRITE) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+  // deleting filters of an already-closed fd fails harmlessly
+  if(n && kevent(g_kq, ch, n, NULL, 0, NULL) < 0 && mask) return -1;
+  return evl_track(fd, mask, udata);
+}
+
+int evl_wait(evl_event_t* evs, int max, int timeout_ms) {
+  struct kevent kev[64];
+  if(max > 64) max = 64;
+  struct timespec ts, *tp = NULL;
+  if(timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+    tp = &ts;
+  }
+  int n = kevent(g_kq, NULL, 0, kev, max, tp);
+  if(n < 0) return -1;
+  int out = 0;
+  for(int i=0;i<n;i++) {
+    int fd = (int)kev[i].ident;
+    if(fd < 0 || fd >= EVL_MAX_FDS || !g_fds[fd].mask) continue;
+    evs[out].fd = fd;
+    evs[out].mask = (kev[i].filter == EVFILT_WRITE) ? EVL_WRITE : EVL_READ;
+    evs[out].udata = g_fds[fd].udata;
+    out++;
+  }
+  return out;
+}
+
+#else /* poll backend for host builds */
+
+int evl_init(void) {
+  memset(g_fds, 0, sizeof(g_fds));
+  g_maxfd = -1;
+  return 0;
+}
+
+void evl_fini(void) {
+}
+
+int evl_set(int fd, int mask, void* udata) {
+  return evl_track(fd, mask, udata);
+}
+
+int evl_wait(evl_event_t* evs, int max, int timeout_ms) {
+  struct pollfd pfd[EVL_MAX_FDS];
+  int np = 0;
+  for(int fd=0; fd<=g_maxfd; fd++) {
+    if(!g_fds[fd].mask) continue;
+    pfd[np].fd = fd;
+    pfd[np].events = ((g_fds[fd].mask & EVL_READ) ? POLLIN : 0) |
+                     ((g_fds[fd].mask & EVL_WRITE) ? POLLOUT : 0);
+    pfd[np].revents = 0;
+    np++;
+  }
+  int n = poll(pfd, np, timeout_ms);
+  if(n < 0) return -1;
+  int out = 0;
+  for(int i=0; i<np && out<max; i++) {
+    int re = pfd[i].revents;
+    if(!re) continue;
+    int fd = pfd[i].fd;
+    int m = 0;
+    if(re & (POLLIN|POLLHUP|POLLERR|POLLNVAL)) m |= g_fds[fd].mask & EVL_READ;
+    if(re & (POLLOUT|POLLHUP|POLLERR)) m |= g_fds[fd].mask & EVL_WRITE;
+    if(!m) continue;
+    evs[out].fd = fd;
+    evs[out].mask = m;
+    evs[out].udata = g_fds[fd].udata;
+    out++;
+  }
+  return out;
+}
+#endif
@@ -0,0 +1,795 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <ps5/klog.h>
+
+#include "http.h"
+#include "evloop.h"
+#include "util.h"
+
+http_config_t g_http;
+
+typedef struct http_conn {
+  int      fd;            // -1: free slot
+  time_t   last;          // last progress, for the idle timeout
+  char     in[HTTP_HEAD_MAX];
+  size_t   in_len;
+  char*    out;           // response head, and generated bodies
+  size_t   out_len, out_off, out_cap;
+  int      file;          // body from a file, -1 for none
+  uint64_t off, left;
+  int      busy;          // a response is being sent
+  int      close_after;
+} http_conn_t;
+
+typedef struct http_entry {
+  const char* name;
+  uint64_t    size;
+  time_t      mtime;
+  int         dir;
+} http_entry_t;
+
+/* Stat results for one directory's entries. */
+typedef struct http_index {
+  char          path[PATH_MAX];   // "" for a free slot
+  struct timespec mtime;          // the directory's, when built
+  time_t        built;
+  unsigned      used;             // LRU stamp
+  int           n;
+  http_entry_t* ents;
+  char*         names;
+} http_index_t;
+
+static int          g_listen = -1;
+static char         g_listen_tag;   // event udata of the listener
+static http_conn_t  g_conns[HTTP_MAX_CONNS];   // valid only while g_listen is open
+static char         g_real[HTTP_MAX_ROOTS][PATH_MAX];   // resolved roots
+static http_index_t g_index[HTTP_INDEX_SLOTS];
+static unsigned     g_index_clock;
+
+int http_add_root(const char* path) {
+  if(g_http.nroots >= HTTP_MAX_ROOTS) return -1;
+  g_http.roots[g_http.nroots++] = path;
+  return 0;
+}
+
+/* ---- paths ---- */
+
+/* path is root or below it (both without a trailing slash, except "/"). */
+static int under(const char* path, const char* root) {
+  size_t n = strlen(root);
+  if(n == 1) return 1;
+  return !strncmp(path, root, n) && (path[n] == 0 || path[n] == '/');
+}
+
+/* Which root a path is under, -1 for none. Symlinks must not lead out of it,
+ * so the resolved path is checked against the resolved root as well. */
+static int served(const char* path) {
+  for(int i=0;i<g_http.nroots;i++) {
+    if(!under(path, g_http.roots[i]) || !g_real[i][0]) continue;
+    char real[PATH_MAX];
+    if(!realpath(path, real)) return -1;
+    return under(real, g_real[i]) ? i : -1;
+  }
+  return -1;
+}
+
+static int hexval(int c) {
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/* Percent-decode the path of a request target into out; -1 if it is not an
+ * absolute path, decodes to a NUL, or has a ".." component. */
+static int decode_path(const char* t, size_t n, char* out, size_t len) {
+  size_t o = 0;
+  if(!n || t[0] != '/') return -1;
+  for(size_t i=0;i<n;i++) {
+    int c = (unsigned char)t[i];
+    if(c == '?' || c == '#') break;
+    if(c == '%') {
+      int h = i+2 < n ? hexval(t[i+1]) : -1, l = h >= 0 ? hexval(t[i+2]) : -1;
+      if(l < 0) return -1;
+      c = h << 4 | l;
+      i += 2;
+    }
+    if(!c || o+1 >= len) return -1;
+    out[o++] = (char)c;
+  }
+  out[o] = 0;
+  for(char* p = out; (p = strstr(p, "..")); p += 2)
+    if(p[-1] == '/' && (p[2] == '/' || !p[2])) return -1;
+  return 0;
+}
+
+/* Percent-encode everything but unreserved characters and '/'. */
+static int encode_path(const char* in, char* out, size_t len) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t o = 0;
+  for(const unsigned char* p = (const unsigned char*)in; *p; p++) {
+    int plain = (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                (*p >= '0' && *p <= '9') || strchr("/-._~", *p);
+    if(o + (plain ? 1 : 3) >= len) return -1;
+    if(plain) {
+      out[o++] = (char)*p;
+    } else {
+      out[o++] = '%';
+      out[o++] = hex[*p >> 4];
+      out[o++] = hex[*p & 15];
+    }
+  }
+  out[o] = 0;
+  return 0;
+}
+
+int http_url(const char* path, char* url, size_t len) {
+  char enc[PATH_MAX * 3];
+  if(!g_http.port || served(path) < 0 || encode_path(path, enc, sizeof(enc)) < 0)
+    return -1;
+  int n = snprintf(url, len, "http://127.0.0.1:%u%s", g_http.port, enc);
+  return n < 0 || (size_t)n >= len ? -1 : 0;
+}
+
+/* ---- output ---- */
+
+static int out_reserve(http_conn_t* c, size_t n) {
+  if(c->out_len + n <= c->out_cap) return 0;
+  size_t cap = c->out_cap ? c->out_cap : 4096;
+  while(cap < c->out_len + n) cap *= 2;
+  char* p = realloc(c->out, cap);
+  if(!p) return -1;
+  c->out = p;
+  c->out_cap = cap;
+  return 0;
+}
+
+static void out_add(http_conn_t* c, const char* s, size_t n) {
+  if(out_reserve(c, n) < 0) return;
+  memcpy(c->out + c->out_len, s, n);
+  c->out_len += n;
+}
+
+#define out_lit(c, s) out_add(c, s, sizeof(s) - 1)
+
+static void out_fmt(http_conn_t* c, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void out_fmt(http_conn_t* c, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if(n < 0 || out_reserve(c, (size_t)n + 1) < 0) return;
+  va_start(ap, fmt);
+  vsnprintf(c->out + c->out_len, (size_t)n + 1, fmt, ap);
+  va_end(ap);
+  c->out_len += (size_t)n;
+}
+
+/* Text with &, <, > and " escaped. */
+static void out_html(http_conn_t* c, const char* s) {
+  for(; *s; s++) {
+    switch(*s) {
+    case '&': out_lit(c, "&amp;"); break;
+    case '<': out_lit(c, "&lt;"); break;
+    case '>': out_lit(c, "&gt;"); break;
+    case '"': out_lit(c, "&quot;"); break;
+    default:  out_add(c, s, 1);
+    }
+  }
+}
+
+static void http_date(char* buf, size_t len, time_t t) {
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+static const char* reason(int status) {
+  switch(status) {
+  case 200: return "OK";
+  case 206: return "Partial Content";
+  case 301: return "Moved Permanently";
+  case 400: return "Bad Request";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 416: return "Range Not Satisfiable";
+  case 500: return "Internal Server Error";
+  case 503: return "Service Unavailable";
+  default:  return "Error";
+  }
+}
+
+static const char* mime_type(const char* path) {
+  static const char* types[][2] = {
+    {"html", "text/html"}, {"htm", "text/html"}, {"txt", "text/plain"},
+    {"log", "text/plain"}, {"json", "application/json"}, {"xml", "application/xml"},
+    {"css", "text/css"}, {"js", "text/javascript"}, {"png", "image/png"},
+    {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"}, {"gif", "image/gif"},
+    {"mp4", "video/mp4"},
+  };
+  const char* dot = strrchr(path, '.');
+  if(dot && !strchr(dot, '/'))
+    for(size_t i=0;i<sizeof(types)/sizeof(types[0]);i++)
+      if(!strcasecmp(dot + 1, types[i][0])) return types[i][1];
+  return "application/octet-stream";
+}
+
+/* Status line and the headers every response carries. */
+static void out_head(http_conn_t* c, int status, const char* type, uint64_t length) {
+  char date[64];
+  http_date(date, sizeof(date), time(NULL));
+  out_fmt(c, "HTTP/1.1 %d %s\r\nServer: sshsvr\r\nDate: %s\r\n"
+             "Content-Type: %s\r\nContent-Length: %llu\r\nConnection: %s\r\n",
+          status, reason(status), date, type, (unsigned long long)length,
+          c->close_after ? "close" : "keep-alive");
+}
+
+/* A short text response; extra is more header lines, or NULL. */
+static void respond_error(http_conn_t* c, int status, int head_only, const char* extra) {
+  char body[64];
+  int n = snprintf(body, sizeof(body), "%d %s\n", status, reason(status));
+  out_head(c, status, "text/plain", (uint64_t)n);
+  if(extra) out_add(c, extra, strlen(extra));
+  out_lit(c, "\r\n");
+  if(!head_only) out_add(c, body, (size_t)n);
+}
+
+/* ---- directory listings ---- */
+
+static int entry_cmp(const void* a, const void* b) {
+  const http_entry_t *x = a, *y = b;
+  if(x->dir != y->dir) return y->dir - x->dir;
+  return strcmp(x->name, y->name);
+}
+
+static void index_free(http_index_t* ix) {
+  free(ix->ents);
+  free(ix->names);
+  memset(ix, 0, sizeof(*ix));
+}
+
+static int index_build(http_index_t* ix, const char* path, const struct stat* sb) {
+  int fd = open(path, O_RDONLY|O_DIRECTORY);
+  if(fd < 0) return -1;
+  DIR* d = fdopendir(fd);
+  if(!d) { close(fd); return -1; }
+  size_t cap = 64, pool_cap = 4096, pool_len = 0;
+  http_entry_t* ents = malloc(cap * sizeof(*ents));
+  char* names = malloc(pool_cap);
+  size_t* offs = malloc(cap * sizeof(*offs));   // names move while the pool grows
+  int n = 0, rc = ents && names && offs ? 0 : -1;
+  struct dirent* de;
+  while(!rc && (de = readdir(d))) {
+    if(de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])))
+      continue;
+    // a symlink is listed as itself: its target may lie outside the roots
+    struct stat st;
+    if(fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+      continue;
+    size_t len = strlen(de->d_name) + 1;
+    if((size_t)n == cap) {
+      cap *= 2;
+      http_entry_t* e = realloc(ents, cap * sizeof(*ents));
+      size_t* o = e ? realloc(offs, cap * sizeof(*offs)) : NULL;
+      if(e) ents = e;
+      if(o) offs = o;
+      if(!e || !o) { rc = -1; break; }
+    }
+    if(pool_len + len > pool_cap) {
+      while(pool_len + len > pool_cap) pool_cap *= 2;
+      char* p = realloc(names, pool_cap);
+      if(!p) { rc = -1; break; }
+      names = p;
+    }
+    memcpy(names + pool_len, de->d_name, len);
+    offs[n] = pool_len;
+    pool_len += len;
+    ents[n].size = (uint64_t)st.st_size;
+    ents[n].mtime = st.st_mtime;
+    ents[n].dir = S_ISDIR(st.st_mode);
+    n++;
+  }
+  closedir(d);
+  if(rc) {
+    free(ents);
+    free(names);
+    free(offs);
+    return -1;
+  }
+  for(int i=0;i<n;i++) ents[i].name = names + offs[i];
+  free(offs);
+  qsort(ents, (size_t)n, sizeof(*ents), entry_cmp);
+  index_free(ix);
+  snprintf(ix->path, sizeof(ix->path), "%s", path);
+  ix->mtime = sb->st_mtim;
+  ix->built = time(NULL);
+  ix->n = n;
+  ix->ents = ents;
+  ix->names = names;
+  return 0;
+}
+
+/* The cached listing of a directory. Adding, removing or renaming entries
+ * changes the directory's mtime, which rebuilds it; files changing size do
+ * not, so a listing is also rebuilt once it is HTTP_INDEX_TTL old. */
+static http_index_t* index_get(const char* path, const struct stat* sb) {
+  http_index_t* slot = &g_index[0];
+  time_t now = time(NULL);
+  for(int i=0;i<HTTP_INDEX_SLOTS;i++) {
+    http_index_t* ix = &g_index[i];
+    if(ix->path[0] && !strcmp(ix->path, path)) {
+      slot = ix;
+      if(ix->mtime.tv_sec == sb->st_mtim.tv_sec && ix->mtime.tv_nsec == sb->st_mtim.tv_nsec &&
+         now - ix->built < HTTP_INDEX_TTL) {
+        ix->used = ++g_index_clock;
+        return ix;
+      }
+      break;
+    }
+    if(ix->used < slot->used) slot = ix;
+  }
+  if(index_build(slot, path, sb) < 0) return NULL;
+  slot->used = ++g_index_clock;
+  return slot;
+}
+
+static void list_row(http_conn_t* c, const char* href, const char* name,
+                     int dir, uint64_t size, time_t mtime) {
+  char enc[PATH_MAX * 3], when[32];
+  struct tm tm;
+  if(encode_path(href, enc, sizeof(enc)) < 0) return;
+  gmtime_r(&mtime, &tm);
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+  out_fmt(c, "<tr><td><a href=\"%s%s\">", enc, dir ? "/" : "");
+  out_html(c, name);
+  out_fmt(c, "%s</a></td><td>%s</td><td>", dir ? "/" : "", when);
+  if(dir) out_lit(c, "-");
+  else out_fmt(c, "%llu", (unsigned long long)size);
+  out_lit(c, "</td></tr>\n");
+}
+
+/* An HTML page for the directory path (ending in '/'), or for "/" when it
+ * is not itself a root, the list of roots. Returns 0, or an error status. */
+static int render_listing(http_conn_t* c, const char* path, const struct stat* sb, int head_only) {
+  http_index_t* ix = NULL;
+  int top = served(path) < 0;
+  if(!top && !(ix = index_get(path, sb))) return errno == EACCES ? 403 : 500;
+  size_t head = c->out_len;
+  out_lit(c, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>");
+  out_html(c, path);
+  out_lit(c, "</title></head><body>\n<h1>");
+  out_html(c, path);
+  out_lit(c, "</h1>\n<table>\n<tr><th>Name</th><th>Modified (UTC)</th><th>Size</th></tr>\n");
+  if(top) {
+    for(int i=0;i<g_http.nroots;i++) {
+      struct stat st;
+      if(stat(g_http.roots[i], &st) == 0)
+        list_row(c, g_http.roots[i], g_http.roots[i], 1, 0, st.st_mtime);
+    }
+  } else {
+    if(strcmp(path, "/")) out_lit(c, "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n");
+    for(int i=0;i<ix->n;i++) {
+      http_entry_t* e = &ix->ents[i];
+      list_row(c, e->name, e->name, e->dir, e->size, e->mtime);
+    }
+  }
+  out_lit(c, "</table>\n</body></html>\n");
+  // the head goes in front of the body now that its length is known
+  size_t blen = c->out_len - head;
+  char* body = malloc(blen);
+  if(!body) return 500;
+  memcpy(body, c->out + head, blen);
+  c->out_len = head;
+  out_head(c, 200, "text/html; charset=utf-8", blen);
+  out_lit(c, "Cache-Control: no-cache\r\n\r\n");
+  if(!head_only) out_add(c, body, blen);
+  free(body);
+  return 0;
+}
+
+/* ---- requests ---- */
+
+typedef struct http_req {
+  const char* method;   size_t method_len;
+  const char* target;   size_t target_len;
+  int         http10;
+  const char* range;    size_t range_len;   // NULL if absent
+  int         conn_close, conn_keep;
+  int         has_body;
+} http_req_t;
+
+static int token_eq(const char* p, size_t n, const char* s) {
+  return strlen(s) == n && !strncasecmp(p, s, n);
+}
+
+/* Split the head (NUL-terminated, without the blank line) into its parts. */
+static int parse_head(char* head, http_req_t* r) {
+  memset(r, 0, sizeof(*r));
+  char* eol = strchr(head, '\n');
+  char* line_end = eol ? eol : head + strlen(head);
+  if(line_end > head && line_end[-1] == '\r') line_end--;
+  char* sp1 = memchr(head, ' ', (size_t)(line_end - head));
+  char* sp2 = sp1 ? memchr(sp1 + 1, ' ', (size_t)(line_end - sp1 - 1)) : NULL;
+  if(!sp2) return -1;
+  r->method = head;
+  r->method_len = (size_t)(sp1 - head);
+  r->target = sp1 + 1;
+  r->target_len = (size_t)(sp2 - sp1 - 1);
+  size_t vlen = (size_t)(line_end - sp2 - 1);
+  if(vlen != 8 || strncmp(sp2 + 1, "HTTP/1.", 7)) return -1;
+  r->http10 = sp2[8] == '0';
+  for(char* line = eol ? eol + 1 : NULL; line && *line; ) {
+    char* next = strchr(line, '\n');
+    char* end = next ? next : line + strlen(line);
+    if(end > line && end[-1] == '\r') end--;
+    char* colon = memchr(line, ':', (size_t)(end - line));
+    if(colon) {
+      size_t klen = (size_t)(colon - line);
+      char* v = colon + 1;
+      while(v < end && (*v == ' ' || *v == '\t')) v++;
+      size_t vl = (size_t)(end - v);
+      if(token_eq(line, klen, "Range")) {
+        r->range = v;
+        r->range_len = vl;
+      } else if(token_eq(line, klen, "Connection")) {
+        for(size_t i=0;i<vl;) {
+          size_t j = i;
+          while(j < vl && v[j] != ',') j++;
+          size_t a = i, b = j;
+          while(a < b && v[a] == ' ') a++;
+          while(b > a && v[b-1] == ' ') b--;
+          if(token_eq(v + a, b - a, "close")) r->conn_close = 1;
+          if(token_eq(v + a, b - a, "keep-alive")) r->conn_keep = 1;
+          i = j + 1;
+        }
+      } else if(token_eq(line, klen, "Transfer-Encoding")) {
+        r->has_body = 1;
+      } else if(token_eq(line, klen, "Content-Length")) {
+        if(vl != 1 || *v != '0') r->has_body = 1;
+      }
+    }
+    line = next ? next + 1 : NULL;
+  }
+  return 0;
+}
+
+/* A single "bytes=" range against size: 1 with [*from, *to], 0 to send the
+ * whole file (no, several or malformed ranges), -1 if unsatisfiable. */
+static int parse_range(const char* v, size_t n, uint64_t size, uint64_t* from, uint64_t* to) {
+  char buf[64];
+  if(n >= sizeof(buf) || n < 7 || strncasecmp(v, "bytes=", 6)) return 0;
+  memcpy(buf, v + 6, n - 6);
+  buf[n - 6] = 0;
+  if(strchr(buf, ',')) return 0;
+  char* dash = strchr(buf, '-');
+  if(!dash) return 0;
+  char* end;
+  if(dash == buf) {   // suffix: the last N bytes
+    uint64_t k = strtoull(dash + 1, &end, 10);
+    if(end == dash + 1 || *end) return 0;
+    if(!k || !size) return -1;
+    *from = k < size ? size - k : 0;
+    *to = size - 1;
+    return 1;
+  }
+  *from = strtoull(buf, &end, 10);
+  if(end != dash) return 0;
+  if(!dash[1]) {
+    *to = size - 1;
+  } else {
+    *to = strtoull(dash + 1, &end, 10);
+    if(*end || *to < *from) return 0;
+    if(*to >= size) *to = size - 1;
+  }
+  return *from < size ? 1 : -1;
+}
+
+static void serve_file(http_conn_t* c, const char* path, const http_req_t* r, int head_only) {
+  int fd = open(path, O_RDONLY);
+  struct stat sb;
+  if(fd < 0 || fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+    if(fd >= 0) close(fd);
+    respond_error(c, fd < 0 && errno == ENOENT ? 404 : 403, head_only, NULL);
+    return;
+  }
+  uint64_t size = (uint64_t)sb.st_size, from = 0, to = size ? size - 1 : 0;
+  int partial = r->range ? parse_range(r->range, r->range_len, size, &from, &to) : 0;
+  if(partial < 0) {
+    char cr[64];
+    snprintf(cr, sizeof(cr), "Content-Range: bytes */%llu\r\n", (unsigned long long)size);
+    close(fd);
+    respond_error(c, 416, head_only, cr);
+    return;
+  }
+  uint64_t len = size ? to - from + 1 : 0;
+  char lm[64];
+  http_date(lm, sizeof(lm), sb.st_mtime);
+  out_head(c, partial ? 206 : 200, mime_type(path), len);
+  out_fmt(c, "Accept-Ranges: bytes\r\nLast-Modified: %s\r\nETag: \"%llx-%llx\"\r\n", lm,
+          (unsigned long long)size, (unsigned long long)sb.st_mtime);
+  if(partial)
+    out_fmt(c, "Content-Range: bytes %llu-%llu/%llu\r\n", (unsigned long long)from,
+            (unsigned long long)to, (unsigned long long)size);
+  out_lit(c, "\r\n");
+  if(head_only || !len) {
+    close(fd);
+    return;
+  }
+  c->file = fd;
+  c->off = from;
+  c->left = len;
+}
+
+static void handle(http_conn_t* c, char* head) {
+  http_req_t r;
+  c->busy = 1;
+  if(parse_head(head, &r) < 0) {
+    c->close_after = 1;
+    respond_error(c, 400, 0, NULL);
+    return;
+  }
+  c->close_after = r.http10 ? !r.conn_keep : r.conn_close;
+  int head_only = token_eq(r.method, r.method_len, "HEAD");
+  if(!head_only && !token_eq(r.method, r.method_len, "GET")) {
+    c->close_after = 1;   // the body, if any, is not read
+    respond_error(c, 405, 0, "Allow: GET, HEAD\r\n");
+    return;
+  }
+  if(r.has_body) {
+    c->close_after = 1;
+    respond_error(c, 400, head_only, NULL);
+    return;
+  }
+  char path[PATH_MAX];
+  if(decode_path(r.target, r.target_len, path, sizeof(path)) < 0) {
+    respond_error(c, 403, head_only, NULL);
+    return;
+  }
+  size_t plen = strlen(path);
+  if(plen > 1 && path[plen-1] == '/') path[--plen] = 0;
+  int top = !strcmp(path, "/") && served("/") < 0;
+  if(!top && served(path) < 0) {
+    respond_error(c, 404, head_only, NULL);
+    return;
+  }
+  struct stat sb;
+  if(stat(path, &sb) < 0) {
+    respond_error(c, errno == ENOENT || errno == ENOTDIR ? 404 : 403, head_only, NULL);
+    return;
+  }
+  if(!S_ISDIR(sb.st_mode)) {
+    serve_file(c, path, &r, head_only);
+    return;
+  }
+  if(r.target[r.target_len - 1] != '/' && !memchr(r.target, '?', r.target_len)) {
+    // relative links in the listing need the trailing slash
+    char enc[PATH_MAX * 3];
+    encode_path(path, enc, sizeof(enc));
+    out_head(c, 301, "text/plain", 0);
+    out_fmt(c, "Location: %s/\r\n\r\n", strcmp(enc, "/") ? enc : "");
+    return;
+  }
+  int status = render_listing(c, path, &sb, head_only);
+  if(status) {
+    c->out_len = 0;
+    respond_error(c, status, head_only, NULL);
+  }
+}
+
+/* ---- connections ---- */
+
+static void conn_close(http_conn_t* c) {
+  evl_set(c->fd, 0, NULL);
+  close(c->fd);
+  if(c->file >= 0) close(c->file);
+  free(c->out);
+  memset(c, 0, sizeof(*c));
+  c->fd = c->file = -1;
+}
+
+/* Send what is pending, at most HTTP_SLICE bytes of body. 0 when the
+ * response is out, 1 if the socket is full, -1 to drop the connection. */
+static int conn_send(http_conn_t* c) {
+  while(c->out_off < c->out_len) {
+    ssize_t w = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, 0);
+    if(w < 0) return errno == EAGAIN || errno == EINTR ? 1 : -1;
+    c->out_off += (size_t)w;
+    c->last = time(NULL);
+  }
+  size_t budget = HTTP_SLICE;
+  while(c->left && budget) {
+    size_t n = c->left < budget ? (size_t)c->left : budget;
+#if defined(__FreeBSD__)
+    off_t sent = 0;
+    int r = sendfile(c->file, c->fd, (off_t)c->off, n, NULL, &sent, 0);
+    if(r < 0 && errno != EAGAIN && errno != EINTR && errno != EBUSY) return -1;
+    if(r == 0 && !sent) return -1;   // the file shrank under the announced length
+#else
+    static char buf[64 * 1024];
+    ssize_t rd = pread(c->file, buf, n < sizeof(buf) ? n : sizeof(buf), (off_t)c->off);
+    if(rd <= 0) return -1;
+    ssize_t sent = send(c->fd, buf, (size_t)rd, 0);
+    if(sent < 0 && errno != EAGAIN && errno != EINTR) return -1;
+    if(sent < 0) sent = 0;
+    int r = sent < rd ? -1 : 0;
+#endif
+    c->off += (uint64_t)sent;
+    c->left -= (uint64_t)sent;
+    budget -= (size_t)sent;
+    if(sent) c->last = time(NULL);
+    if(r < 0) return 1;
+  }
+  return c->left ? 1 : 0;
+}
+
+/* Answer the complete requests in the input buffer, one at a time. */
+static void conn_run(http_conn_t* c) {
+  for(;;) {
+    if(c->busy) {
+      int r = conn_send(c);
+      if(r < 0) { conn_close(c); return; }
+      if(r > 0) { evl_set(c->fd, EVL_WRITE, c); return; }
+      if(c->close_after) { conn_close(c); return; }
+      if(c->file >= 0) close(c->file);
+      c->file = -1;
+      c->out_len = c->out_off = 0;
+      c->busy = 0;
+    }
+    char* end = NULL;
+    size_t skip = 0;
+    for(size_t i=0;i+1<c->in_len;i++) {
+      if(c->in[i] != '\n') continue;
+      if(c->in[i+1] == '\n') { end = c->in + i; skip = 2; break; }
+      if(c->in[i+1] == '\r' && i+2 < c->in_len && c->in[i+2] == '\n') { end = c->in + i; skip = 3; break; }
+    }
+    if(!end) {
+      if(c->in_len == sizeof(c->in)) {
+        c->in_len = 0;
+        c->close_after = 1;
+        c->busy = 1;
+        respond_error(c, 400, 0, NULL);
+        continue;
+      }
+      evl_set(c->fd, EVL_READ, c);
+      return;
+    }
+    *end = 0;
+    size_t used = (size_t)(end - c->in) + skip;
+    char* head = c->in;
+    while(*head == '\r' || *head == '\n') head++;   // stray CRLF between requests
+    handle(c, head);
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+  }
+}
+
+static void conn_readable(http_conn_t* c) {
+  ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+  if(n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    conn_close(c);
+    return;
+  }
+  if(n < 0) return;
+  c->in_len += (size_t)n;
+  c->last = time(NULL);
+  conn_run(c);
+}
+
+static void http_accept(void) {
+  for(;;) {
+    int fd = accept(g_listen, NULL, NULL);
+    if(fd < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) klog_perror("http accept");
+      return;
+    }
+    http_conn_t* c = NULL;
+    for(int i=0;i<HTTP_MAX_CONNS && !c;i++) if(g_conns[i].fd < 0) c = &g_conns[i];
+    if(!c || set_nonblock(fd, 1) < 0 || evl_set(fd, EVL_READ, c) < 0) {
+      static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                 "Content-Length: 0\r\nConnection: close\r\n\r\n";
+      send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT);
+      close(fd);
+      continue;
+    }
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->file = -1;
+    c->last = time(NULL);
+  }
+}
+
+/* ---- event loop ---- */
+
+int http_init(int listen_fd) {
+  for(int i=0;i<HTTP_MAX_CONNS;i++) g_conns[i].fd = g_conns[i].file = -1;
+  if(!g_http.nroots) {
+    http_add_root("/data");
+    http_add_root("/mnt");
+  }
+  for(int i=0;i<g_http.nroots;i++) {
+    // "/data/" and "/data" are the same root
+    char* r = strdup(g_http.roots[i]);
+    size_t n = r ? strlen(r) : 0;
+    while(n > 1 && r[n-1] == '/') r[--n] = 0;
+    g_http.roots[i] = r ? r : g_http.roots[i];
+    if(!r || !realpath(r, g_real[i])) {
+      g_real[i][0] = 0;
+      klog_printf("http: root %s not available\n", g_http.roots[i]);
+    }
+  }
+  if(evl_set(listen_fd, EVL_READ, &g_listen_tag) < 0) return -1;
+  g_listen = listen_fd;
+  return 0;
+}
+
+int http_owns(const void* udata) {
+  const char* p = udata;
+  return p && (p == &g_listen_tag ||
+               (p >= (const char*)g_conns && p < (const char*)(g_conns + HTTP_MAX_CONNS)));
+}
+
+void http_event(void* udata, int mask) {
+  if(udata == &g_listen_tag) {
+    http_accept();
+    return;
+  }
+  http_conn_t* c = udata;
+  if(c->fd < 0) return;
+  if(c->busy) {
+    if(mask & EVL_WRITE) conn_run(c);
+  } else if(mask & EVL_READ) {
+    conn_readable(c);
+  }
+}
+
+int http_timeout_ms(void) {
+  time_t now = time(NULL), first = 0;
+  if(g_listen < 0) return -1;
+  for(int i=0;i<HTTP_MAX_CONNS;i++)
+    if(g_conns[i].fd >= 0 && (!first || g_conns[i].last < first)) first = g_conns[i].last;
+  if(!first) return -1;
+  time_t due = first + HTTP_IDLE_SECS;
+  return due <= now ? 0 : (int)(due - now) * 1000;
+}
+
+void http_sweep(void) {
+  time_t now = time(NULL);
+  if(g_listen < 0) return;
+  for(int i=0;i<HTTP_MAX_CONNS;i++)
+    if(g_conns[i].fd >= 0 && now - g_conns[i].last >= HTTP_IDLE_SECS) conn_close(&g_conns[i]);
+}
+
+void http_close_all(void) {
+  if(g_listen < 0) return;
+  for(int i=0;i<HTTP_MAX_CONNS;i++)
+    if(g_conns[i].fd >= 0) conn_close(&g_conns[i]);
+  evl_set(g_listen, 0, NULL);
+  close(g_listen);
+  g_listen = -1;
+  for(int i=0;i<HTTP_INDEX_SLOTS;i++) index_free(&g_index[i]);
+}
+
+void http_child(void) {
+  if(g_listen < 0) return;
+  close(g_listen);
+  for(int i=0;i<HTTP_MAX_CONNS;i++) {
+    if(g_conns[i].fd < 0) continue;
+    close(g_conns[i].fd);
+    if(g_conns[i].file >= 0) close(g_conns[i].file);
+  }
+}
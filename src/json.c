@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "json.h"
+#include "outbuf.h"
+
+static void json_put_escaped(const char* s) {
+  static const char hex[] = "0123456789abcdef";
+  char buf[256];
+  size_t n = 0;
+  for(; *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    if(n + 6 > sizeof(buf)) { stdout_write(buf, n); n = 0; }   // longest: \u00XX
+    if(c == '"' || c == '\\') {
+      buf[n++] = '\\';
+      buf[n++] = (char)c;
+    } else if(c == '\n') {
+      buf[n++] = '\\'; buf[n++] = 'n';
+    } else if(c == '\r') {
+      buf[n++] = '\\'; buf[n++] = 'r';
+    } else if(c == '\t') {
+      buf[n++] = '\\'; buf[n++] = 't';
+    } else if(c < 0x20) {
+      memcpy(buf + n, "\\u00", 4);
+      buf[n+4] = hex[c >> 4];
+      buf[n+5] = hex[c & 15];
+      n += 6;
+    } else {
+      buf[n++] = (char)c;
+    }
+  }
+  if(n) stdout_write(buf, n);
+}
+
+static void json_key(const char* key) {
+  stdout_write(",\"", 2);
+  stdout_write(key, strlen(key));
+  stdout_write("\":", 2);
+}
+
+void json_begin(const char* type) {
+  stdout_write("{\"type\":\"", 9);
+  json_put_escaped(type);
+  stdout_write("\"", 1);
+}
+
+void json_str(const char* key, const char* val) {
+  json_key(key);
+  stdout_write("\"", 1);
+  json_put_escaped(val ? val : "");
+  stdout_write("\"", 1);
+}
+
+void json_int(const char* key, long long val) {
+  char buf[24];
+  int n = snprintf(buf, sizeof(buf), "%lld", val);
+  json_key(key);
+  stdout_write(buf, (size_t)n);
+}
+
+void json_bool(const char* key, int val) {
+  json_key(key);
+  if(val) stdout_write("true", 4);
+  else stdout_write("false", 5);
+}
+
+void json_end(void) {
+  stdout_write("}\n", 2);
+}
@@ -0,0 +1,117 @@
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_BITS  14
+#define MAX_OFFSET 65535
+#define TAIL       5      // trailing bytes always emitted as literals
+
+static uint32_t read32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Length nibble overflow: 255-valued bytes, then the remainder. */
+static uint8_t* put_len(uint8_t* op, size_t n) {
+  for(; n >= 255; n -= 255) *op++ = 255;
+  *op++ = (uint8_t)n;
+  return op;
+}
+
+static uint8_t* emit(uint8_t* op, const uint8_t* lit, size_t nlit,
+                     size_t off, size_t mlen) {
+  uint8_t* token = op++;
+  *token = (uint8_t)((nlit >= 15 ? 15 : nlit) << 4);
+  if(nlit >= 15) op = put_len(op, nlit - 15);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if(!mlen) return op;
+  *op++ = (uint8_t)off;
+  *op++ = (uint8_t)(off >> 8);
+  mlen -= LZ_MIN_MATCH;
+  *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+  if(mlen >= 15) op = put_len(op, mlen - 15);
+  return op;
+}
+
+/* Bytes emit() may write for a sequence. */
+static size_t seq_cost(size_t nlit, size_t mlen) {
+  return 1 + nlit + nlit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+}
+
+size_t lz_compress(const void* src, size_t n, void* dst, size_t cap) {
+  const uint8_t* in = src;
+  uint8_t* op = dst;
+  uint8_t* oend = op + cap;
+  uint32_t tab[1 << HASH_BITS];   // position + 1 of the last 4-byte sequence
+  memset(tab, 0, sizeof(tab));
+  size_t anchor = 0, i = 0;
+  while(n > LZ_MIN_MATCH + TAIL && i < n - LZ_MIN_MATCH - TAIL) {
+    uint32_t v = read32(in + i);
+    uint32_t h = hash4(v);
+    size_t ref = tab[h];
+    tab[h] = (uint32_t)(i + 1);
+    if(!ref || i + 1 - ref > MAX_OFFSET || read32(in + ref - 1) != v) {
+      i += 1 + ((i - anchor) >> 6);   // skip faster through incompressible data
+      continue;
+    }
+    ref--;
+    size_t mlen = LZ_MIN_MATCH;
+    while(i + mlen < n - TAIL && in[ref + mlen] == in[i + mlen]) mlen++;
+    if(seq_cost(i - anchor, mlen) > (size_t)(oend - op)) return 0;
+    op = emit(op, in + anchor, i - anchor, i - ref, mlen);
+    i += mlen;
+    anchor = i;
+  }
+  if(seq_cost(n - anchor, 0) > (size_t)(oend - op)) return 0;
+  op = emit(op, in + anchor, n - anchor, 0, 0);
+  return (size_t)(op - (uint8_t*)dst);
+}
+
+static int get_len(const uint8_t** ip, const uint8_t* iend, size_t* n) {
+  uint8_t b;
+  do {
+    if(*ip >= iend) return -1;
+    b = *(*ip)++;
+    *n += b;
+  } while(b == 255);
+  return 0;
+}
+
+long lz_decompress(const void* src, size_t n, void* dst, size_t cap) {
+  const uint8_t* ip = src;
+  const uint8_t* iend = ip + n;
+  uint8_t* op = dst;
+  uint8_t* oend = op + cap;
+  while(ip < iend) {
+    uint8_t token = *ip++;
+    size_t nlit = token >> 4;
+    if(nlit == 15 && get_len(&ip, iend, &nlit) < 0) return -1;
+    if(nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op)) return -1;
+    memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if(ip == iend) break;   // last sequence: literals only
+    if(iend - ip < 2) return -1;
+    size_t off = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    if(!off || off > (size_t)(op - (uint8_t*)dst)) return -1;
+    size_t mlen = token & 15;
+    if(mlen == 15 && get_len(&ip, iend, &mlen) < 0) return -1;
+    mlen += LZ_MIN_MATCH;
+    if(mlen > (size_t)(oend - op)) return -1;
+    const uint8_t* m = op - off;
+    if(off >= mlen) {
+      memcpy(op, m, mlen);
+      op += mlen;
+    } else {
+      while(mlen--) *op++ = *m++;   // overlapping: repeats the last off bytes
+    }
+  }
+  return (long)(op - (uint8_t*)dst);
+}
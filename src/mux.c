@@ -0,0 +1,40 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "mux.h"
+
+int mux_next(reader_t* r, mux_frame_t* f) {
+  size_t have = reader_pending(r);
+  if(have < MUX_HDR) return 0;
+  const unsigned char* h = (const unsigned char*)reader_data(r);
+  uint16_t chan;
+  uint32_t len;
+  memcpy(&chan, h + 2, 2);
+  memcpy(&len, h + 4, 4);
+  len = ntohl(len);
+  if(h[0] > MUX_CREDIT || len > MUX_MAX_DATA) return -1;
+  if(have < MUX_HDR + len) return 0;
+  f->type = h[0];
+  f->chan = ntohs(chan);
+  f->len = len;
+  f->data = (const char*)h + MUX_HDR;
+  reader_consume(r, MUX_HDR + len);
+  return 1;
+}
+
+void mux_send(outbuf_t* o, int type, unsigned chan, const void* data, size_t len) {
+  unsigned char h[MUX_HDR];
+  uint16_t c = htons((uint16_t)chan);
+  uint32_t l = htonl((uint32_t)len);
+  h[0] = (unsigned char)type;
+  h[1] = 0;
+  memcpy(h + 2, &c, 2);
+  memcpy(h + 4, &l, 4);
+  out_write(o, h, sizeof(h));
+  if(len) out_write(o, data, len);
+}
+
+void mux_send_credit(outbuf_t* o, unsigned chan, uint32_t n) {
+  uint32_t v = htonl(n);
+  mux_send(o, MUX_CREDIT, chan, &v, sizeof(v));
+}
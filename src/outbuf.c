@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "outbuf.h"
+
+outbuf_t g_stdout = { .fd = 1, .linebuf = 1 };
+
+static pthread_key_t  g_out_key;
+static pthread_once_t g_out_once = PTHREAD_ONCE_INIT;
+
+void out_init(outbuf_t* o, int fd) {
+  memset(o, 0, sizeof(*o));
+  o->fd = fd;
+}
+
+void out_free(outbuf_t* o) {
+  free(o->buf);
+  o->buf = NULL;
+  o->len = o->cap = 0;
+}
+
+void out_discard(outbuf_t* o) {
+  o->len = 0;
+}
+
+static int out_reserve(outbuf_t* o, size_t extra) {
+  if(o->len + extra <= o->cap) return 0;
+  size_t ncap = o->cap ? o->cap : 4096;
+  while(ncap < o->len + extra) ncap *= 2;
+  char* nb = realloc(o->buf, ncap);
+  if(!nb) return -1;
+  o->buf = nb;
+  o->cap = ncap;
+  return 0;
+}
+
+/* Push buffered bytes, then `extra` if given, in as few syscalls as the
+ * socket allows. Returns bytes of `extra` consumed, or -1 on error. */
+static ssize_t out_push(outbuf_t* o, const char* extra, size_t elen) {
+  size_t boff = 0, eoff = 0;
+  while(boff < o->len || eoff < elen) {
+    struct iovec iov[2];
+    int n = 0;
+    if(boff < o->len) {
+      iov[n].iov_base = o->buf + boff;
+      iov[n].iov_len = o->len - boff;
+      n++;
+    }
+    if(eoff < elen) {
+      iov[n].iov_base = (char*)extra + eoff;
+      iov[n].iov_len = elen - eoff;
+      n++;
+    }
+    ssize_t w = writev(o->fd, iov, n);
+    if(w < 0) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+      o->len = 0;
+      return -1;
+    }
+    o->total += (uint64_t)w;
+    size_t fromb = o->len - boff;
+    if((size_t)w <= fromb) {
+      boff += (size_t)w;
+    } else {
+      boff = o->len;
+      eoff += (size_t)w - fromb;
+    }
+  }
+  memmove(o->buf, o->buf + boff, o->len - boff);
+  o->len -= boff;
+  return (ssize_t)eoff;
+}
+
+int out_flush(outbuf_t* o) {
+  if(!o->len || o->fd < 0) return 0;
+  return out_push(o, NULL, 0) < 0 ? -1 : 0;
+}
+
+/* Returns the bytes accepted: all of len, with whatever the fd did not take
+ * buffered, unless there was no memory to buffer it. */
+ssize_t out_write(outbuf_t* o, const void* data, size_t len) {
+  const char* p = (const char*)data;
+  size_t done = 0;
+  if(o->fd >= 0 && o->len + len >= OUT_FLUSH_AT) {
+    // big payloads go out straight from the caller's memory
+    ssize_t w = out_push(o, p, len);
+    if(w < 0) return -1;
+    done = (size_t)w;
+    if(done == len) return (ssize_t)done;
+  }
+  size_t rest = len - done;
+  if(out_reserve(o, rest) < 0) return done ? (ssize_t)done : -1;
+  memcpy(o->buf + o->len, p + done, rest);
+  o->len += rest;
+  if(o->linebuf && len && p[len-1] == '\n') out_flush(o);
+  return (ssize_t)len;
+}
+
+int out_vprintf(outbuf_t* o, const char* fmt, va_list ap) {
+  va_list cp;
+  va_copy(cp, ap);
+  if(out_reserve(o, 256) < 0) { va_end(cp); return -1; }
+  int n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, ap);
+  if(n >= 0 && (size_t)n >= o->cap - o->len) {
+    if(out_reserve(o, (size_t)n + 1) < 0) { va_end(cp); return -1; }
+    n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, cp);
+  }
+  va_end(cp);
+  if(n <= 0) return n;
+  o->len += (size_t)n;
+  if(o->len >= OUT_FLUSH_AT || (o->linebuf && o->buf[o->len-1] == '\n'))
+    out_flush(o);
+  return n;
+}
+
+int out_printf(outbuf_t* o, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = out_vprintf(o, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+void out_set_bulk(int fd, int bulk) {
+  int on = bulk ? 1 : 0;
+  int nd = !on;
+#if defined(TCP_NOPUSH)
+  setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on));
+#elif defined(TCP_CORK)
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nd, sizeof(nd));
+}
+
+static void out_key_init(void) {
+  pthread_key_create(&g_out_key, NULL);
+}
+
+outbuf_t* stdout_buf(void) {
+  pthread_once(&g_out_once, out_key_init);
+  return pthread_getspecific(g_out_key);
+}
+
+void stdout_set(outbuf_t* o) {
+  pthread_once(&g_out_once, out_key_init);
+  pthread_setspecific(g_out_key, o);
+}
+
+ssize_t stdout_write(const void* data, size_t len) {
+  outbuf_t* o = stdout_buf();
+  if(o) return out_write(o, data, len);
+  size_t off = 0;
+  while(off < len) {
+    ssize_t w = write(1, (const char*)data + off, len - off);
+    if(w < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    off += (size_t)w;
+  }
+  return (ssize_t)off;
+}
+
+void stdout_flush(void) {
+  outbuf_t* o = stdout_buf();
+  if(o) out_flush(o);
+}
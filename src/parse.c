@@ -0,0 +1,89 @@
+#include <stddef.h>
+
+#include "parse.h"
+
+static int is_space(char c) {
+  return c==' ' || c=='\t' || c=='\r' || c=='\n' || c=='\v' || c=='\f';
+}
+
+static int is_op(char c) {
+  return c=='|' || c=='>';
+}
+
+int parse_line(char* line, cmdline_t* cl) {
+  char* r = line;
+  int nargs = 0, nwords = 0;
+  int want_target = 0;   // next word is the redirect target
+  command_t* cur = NULL;
+
+  cl->ncmds = 0;
+  cl->redir_file = NULL;
+  cl->append_mode = 0;
+
+  for(;;) {
+    while(is_space(*r)) r++;
+    if(!*r) break;
+
+    char op = *r;
+    if(!is_op(op)) {
+      // Slice one word in place. Quotes and escapes are dropped by compacting
+      // behind the read pointer, so w never passes r.
+      char* start = r;
+      char* w = r;
+      char q = 0;
+      while(*r) {
+        char c = *r;
+        if(q) {
+          if(c == q) { q = 0; r++; continue; }
+          if(c == '\\' && q == '"' && (r[1] == '"' || r[1] == '\\')) r++;
+          *w++ = *r++;
+          continue;
+        }
+        if(is_space(c) || is_op(c)) break;
+        if(c == '"' || c == '\'') { q = c; r++; continue; }
+        if(c == '\\' && r[1]) r++;
+        *w++ = *r++;
+      }
+      if(q) return -1;      // unterminated quote
+      op = *r;              // terminating NUL below may land on it
+      *w = 0;
+
+      if(want_target) {
+        cl->redir_file = start;
+        want_target = 0;
+      } else {
+        if(cl->redir_file) return -1;   // words after the redirect target
+        if(nwords == PARSE_MAX_TOKS) return -1;
+        if(!cur) {
+          if(cl->ncmds == PARSE_MAX_PIPE) return -1;
+          cur = &cl->cmds[cl->ncmds++];
+          cur->argv = &cl->args[nargs];
+          cur->argc = 0;
+          cur->bi = NULL;
+        }
+        cl->args[nargs++] = start;
+        cur->argc++;
+        nwords++;
+      }
+      if(!op) break;
+      if(!is_op(op)) { r++; continue; }
+    }
+
+    // operator `op` at r (the byte itself may already be overwritten)
+    if(!cur || want_target || cl->redir_file) return -1;
+    if(op == '|') {
+      cl->args[nargs++] = NULL;
+      cur = NULL;
+      r++;
+    } else {
+      cl->append_mode = (r[1] == '>');
+      r += cl->append_mode ? 2 : 1;
+      want_target = 1;
+    }
+  }
+
+  if(want_target) return -1;
+  if(cur) cl->args[nargs++] = NULL;
+  else if(cl->ncmds) return -1;    // trailing pipe
+  return 0;
+}
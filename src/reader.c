@@ -0,0 +1,122 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "reader.h"
+
+void reader_init(reader_t* r, int fd) {
+  r->fd = fd;
+  r->off = r->end = r->scan = 0;
+  r->total = 0;
+}
+
+/* Consumed bytes are only compacted away when the tail runs out of room. */
+static void reader_compact(reader_t* r) {
+  if(r->off == 0) return;
+  size_t n = r->end - r->off;
+  if(n) memmove(r->buf, r->buf + r->off, n);
+  r->scan -= r->off;
+  r->off = 0;
+  r->end = n;
+}
+
+static ssize_t reader_fill_fd(reader_t* r, int fd) {
+  if(r->off == r->end) r->off = r->end = r->scan = 0;
+  else if(r->end == sizeof(r->buf)) reader_compact(r);
+  if(r->end == sizeof(r->buf)) { errno = ENOBUFS; return -1; }
+  ssize_t n;
+  do {
+    n = read(fd, r->buf + r->end, sizeof(r->buf) - r->end);
+  } while(n < 0 && errno == EINTR);
+  if(n > 0) r->end += (size_t)n;
+  return n;
+}
+
+ssize_t reader_fill(reader_t* r) {
+  ssize_t n = reader_fill_fd(r, r->fd);
+  if(n > 0) r->total += (uint64_t)n;
+  return n;
+}
+
+ssize_t reader_fill_from(reader_t* r, int fd) {
+  return reader_fill_fd(r, fd);
+}
+
+char* reader_line(reader_t* r, size_t* len) {
+  size_t from = r->scan > r->off ? r->scan : r->off;
+  char* nl = memchr(r->buf + from, '\n', r->end - from);
+  if(!nl) {
+    r->scan = r->end;   // don't rescan a partial line on the next call
+    return NULL;
+  }
+  char* line = r->buf + r->off;
+  size_t n = (size_t)(nl - line);
+  *nl = 0;
+  if(n && line[n-1] == '\r') line[--n] = 0;
+  r->off = (size_t)(nl - r->buf) + 1;
+  r->scan = r->off;
+  if(len) *len = n;
+  return line;
+}
+
+int reader_full(const reader_t* r) {
+  return r->end - r->off == sizeof(r->buf);
+}
+
+int reader_has_line(const reader_t* r) {
+  return memchr(r->buf + r->off, '\n', r->end - r->off) != NULL;
+}
+
+void reader_drop(reader_t* r) {
+  r->off = r->end = r->scan = 0;
+}
+
+void reader_consume(reader_t* r, size_t n) {
+  r->off += n;
+  if(r->scan < r->off) r->scan = r->off;
+}
+
+/* Seed dst with src's pending bytes, e.g. to free src's buffer for reuse. */
+void reader_take(reader_t* dst, const reader_t* src) {
+  size_t n = src->end - src->off;
+  memcpy(dst->buf, src->buf + src->off, n);
+  dst->off = dst->scan = 0;
+  dst->end = n;
+}
+
+ssize_t reader_read(reader_t* r, void* buf, size_t len) {
+  size_t have = r->end - r->off;
+  if(have) {
+    size_t n = have < len ? have : len;
+    memcpy(buf, r->buf + r->off, n);
+    r->off += n;
+    if(r->scan < r->off) r->scan = r->off;
+    return (ssize_t)n;
+  }
+  // large reads bypass the buffer entirely
+  ssize_t n;
+  do {
+    n = read(r->fd, buf, len);
+  } while(n < 0 && errno == EINTR);
+  if(n > 0) r->total += (uint64_t)n;
+  return n;
+}
+
+ssize_t reader_getline(reader_t* r, char* buf, size_t max) {
+  for(;;) {
+    size_t n;
+    char* line = reader_line(r, &n);
+    if(!line && (reader_full(r) || reader_fill(r) <= 0)) {
+      // overlong or unterminated last line: hand back what there is
+      n = r->end - r->off;
+      if(!n) return -1;
+      line = r->buf + r->off;
+      r->off = r->scan = r->end;
+    }
+    if(!line) continue;
+    if(n > max - 1) n = max - 1;
+    memcpy(buf, line, n);
+    buf[n] = 0;
+    return (ssize_t)n;
+  }
+}
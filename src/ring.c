@@ -0,0 +1,49 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+int ring_init(ring_t* r, size_t cap) {
+  memset(r, 0, sizeof(*r));
+  r->buf = malloc(cap);
+  if(!r->buf) return -1;
+  r->cap = cap;
+  return 0;
+}
+
+void ring_free(ring_t* r) {
+  free(r->buf);
+  memset(r, 0, sizeof(*r));
+}
+
+void ring_write(ring_t* r, const void* data, size_t len) {
+  const char* p = data;
+  if(!r->cap) return;
+  if(len >= r->cap) {
+    // only the newest cap bytes survive
+    r->dropped += r->len + (len - r->cap);
+    memcpy(r->buf, p + len - r->cap, r->cap);
+    r->head = 0;
+    r->len = r->cap;
+    return;
+  }
+  size_t over = r->len + len > r->cap ? r->len + len - r->cap : 0;
+  if(over) {
+    r->head = (r->head + over) % r->cap;
+    r->len -= over;
+    r->dropped += over;
+  }
+  size_t tail = (r->head + r->len) % r->cap;
+  size_t first = r->cap - tail < len ? r->cap - tail : len;
+  memcpy(r->buf + tail, p, first);
+  memcpy(r->buf, p + first, len - first);
+  r->len += len;
+}
+
+void ring_drain(ring_t* r, outbuf_t* o) {
+  size_t first = r->cap - r->head < r->len ? r->cap - r->head : r->len;
+  if(first) out_write(o, r->buf + r->head, first);
+  if(r->len > first) out_write(o, r->buf, r->len - first);
+  r->head = r->len = 0;
+  r->dropped = 0;
+}
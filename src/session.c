@@ -2,222 +2,1231 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <ctype.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <ps5/klog.h>
 
 #include "session.h"
 #include "builtins.h"
+#include "evloop.h"
+#include "reader.h"
+#include "outbuf.h"
+#include "parse.h"
+#include "mux.h"
+#include "ring.h"
+#include "admit.h"
+#include "bw.h"
+#include "http.h"
+#include "json.h"
 #include "util.h"   // added for dprintf
 
-#define MAX_LINE 2048
-#define MAX_TOKS 256
-#define MAX_PIPE 16
-
-typedef struct {
-  char** argv;
-  int argc;
-  int is_builtin;
-} command_t;
-
-static char* trim(char* s) {
-  while(isspace((unsigned char)*s)) s++;
-  char* e = s + strlen(s);
-  while(e>s && isspace((unsigned char)e[-1])) e--;
-  *e=0;
-  return s;
+
+typedef enum {
+  SESS_IDLE,      // reading command lines
+  SESS_JOB,       // a forked job owns the socket until it exits
+  SESS_CLOSING,   // draining output, then close
+  SESS_MUX,       // framed connection carrying channels (mux.h)
+  SESS_RELAY,     // shell-side end of a channel or of a persistent session
+  SESS_ATTACHED,  // client connection attached to a persistent session
+  SESS_DEAD,      // closed, freed by session_sweep()
+} session_state_t;
+
+/* Written by a job to its control pipe on exit, ahead of handed-back input. */
+typedef struct job_report {
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint32_t prompted;   // the job already sent "$ " with its last output
+  uint32_t closing;    // the command ended the session (exit, lost framing)
+} job_report_t;
+
+struct session {
+  int             id;
+  int             fd;
+  char            ip[16];
+  time_t          started;
+  uint64_t        bytes_in, bytes_out;
+  unsigned        ncmds;
+  int             last_rc;
+  int             machine;     // NDJSON records, commands end in a framed record
+  struct timespec cmd_t0;      // start of the current command line
+  session_state_t state;
+  pid_t           job_pid;     // 0 once reaped
+  int             job_fd;      // read end of the job's control pipe
+  int             job_status;
+  job_report_t    job_rep;
+  size_t          job_rep_len;
+  char            cwd[PATH_MAX];
+  reader_t        in;
+  outbuf_t        out;
+  // channels and persistent sessions: a relay holds one end of a socketpair,
+  // its shell session the other. conn is the client connection the relay
+  // feeds, a framed one for channels, NULL while a persistent one is detached
+  struct session* conn;
+  unsigned        chan;
+  int             shell_id;
+  uint32_t        credit;      // DATA bytes the peer still accepts
+  uint64_t        acked;       // delivered bytes already credited back
+  int             persist;     // shell: runs behind a relay, survives disconnects
+  ring_t          scroll;      // relay: output kept while detached
+  int             req;         // connection change requested by a builtin
+  int             req_id;
+  struct session* next;
+};
+
+static int        g_listen_fd = -1;
+static pid_t      g_listener_pid = 0;
+static session_t* g_sessions = NULL;
+static session_t* g_cur = NULL;   // session being serviced (inline builtin or job)
+static int        g_next_id = 1;
+static const size_t g_relay_backlog = 4 * OUT_FLUSH_AT;   // pause relays above
+static char       g_start_cwd[PATH_MAX] = "/";
+static int        g_chld_pipe[2] = { -1, -1 };   // SIGCHLD self-pipe
+static reader_t   g_job_in = { .fd = 0 };        // job side stdin
+
+/* Stdin of a builtin pipeline stage that reads the pipe from the stage
+ * before it, per thread. Builtins without one read the session. */
+static pthread_key_t  g_stage_in_key;
+static pthread_once_t g_stage_in_once = PTHREAD_ONCE_INIT;
+
+static void stage_in_key_init(void) {
+  pthread_key_create(&g_stage_in_key, NULL);
 }
 
-static int tokenize(char* line, char** toks) {
-  int ntok=0;
-  char* p=line;
-  while(*p) {
-    while(isspace((unsigned char)*p)) p++;
-    if(!*p) break;
-    if(*p=='|' || *p=='>' ) {
-      if(ntok<MAX_TOKS) {
-        if(*p=='>' && p[1]=='>') {
-          toks[ntok++]=strdup(">>");
-          p+=2;
-          continue;
-        }
-        char sym[2]={*p,0};
-        toks[ntok++]=strdup(sym);
-        p++;
-      } else break;
-      continue;
+static reader_t* stdin_reader(void) {
+  pthread_once(&g_stage_in_once, stage_in_key_init);
+  reader_t* r = pthread_getspecific(g_stage_in_key);
+  return r ? r : &g_job_in;
+}
+
+static void resolve_builtins(cmdline_t* cl) {
+  for(int ci=0; ci<cl->ncmds; ci++)
+    cl->cmds[ci].bi = builtin_lookup(cl->cmds[ci].argv[0]);
+}
+
+static int builtin_rc(int rc) {
+  return rc<0 ? 1 : (rc==255 ? 0 : rc);
+}
+
+/* Exit code of a reaped stage, as a shell reports it. */
+static int stage_status(int status) {
+  if(WIFEXITED(status)) return WEXITSTATUS(status);
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 1;
+}
+
+/* A pipeline stage. in_fd and out_fd belong to the stage and are closed
+ * when it ends; -1 is the session for input, the job's stdout for output. */
+typedef struct stage {
+  command_t* c;
+  int        in_fd, out_fd;
+  int        rc;           // builtin's own return value
+  pthread_t  thr;
+} stage_t;
+
+/* Run a builtin stage on the calling thread, with its own stdout buffer
+ * and stdin reader when it has a pipe or a file of its own. */
+static void* stage_main(void* arg) {
+  stage_t* st = arg;
+  outbuf_t out, *prev_out = stdout_buf();
+  reader_t in;
+  pthread_once(&g_stage_in_once, stage_in_key_init);
+  if(st->in_fd >= 0) {
+    reader_init(&in, st->in_fd);
+    pthread_setspecific(g_stage_in_key, &in);
+  }
+  if(st->out_fd >= 0) {
+    out_init(&out, st->out_fd);
+    stdout_set(&out);
+  }
+  st->rc = builtin_run(st->c->bi, st->c->argc, st->c->argv);
+  stdout_flush();
+  stdout_set(prev_out);
+  pthread_setspecific(g_stage_in_key, NULL);
+  if(st->out_fd >= 0) {
+    out_free(&out);
+    close(st->out_fd);   // the next stage sees EOF
+  }
+  if(st->in_fd >= 0) close(st->in_fd);   // upstream writers get EPIPE
+  return NULL;
+}
+
+/* Fork and exec a stage that is not a builtin. fds holds every pipeline fd
+ * the job has open, none of which the child may keep. */
+static pid_t stage_exec(stage_t* st, const int* fds, int nfds, pid_t listener_pid) {
+  pid_t pid = fork();
+  if(pid != 0) return pid;
+  signal(SIGPIPE, SIG_DFL);
+  if(st->in_fd >= 0) dup2(st->in_fd, 0);
+  if(st->out_fd >= 0) dup2(st->out_fd, 1);
+  for(int i=0;i<nfds;i++)
+    if(fds[i] >= 0) close(fds[i]);
+  stdout_set(NULL);
+  char lbuf[32];
+  snprintf(lbuf,sizeof(lbuf),"%d", listener_pid);
+  setenv("SESSION_LISTENER_PID", lbuf, 1);
+  execvp(st->c->argv[0], st->c->argv);
+  dprintf(1,"exec failed: %s\n", st->c->argv[0]);
+  _exit(127);
+}
+
+/* Stages run concurrently inside the job, connected by pipes, so data
+ * streams through them with memory bounded by the pipe buffers and a stage
+ * that never finishes still feeds the next one. Builtin stages are threads
+ * of the job, the last one the job's own thread; only commands without a
+ * builtin are forked and exec'd. Every stage's exit code lands in
+ * cl->stage_rc, the pipeline returns the last one. */
+static int execute_pipeline(cmdline_t* cl, pid_t listener_pid) {
+  command_t* cmds = cl->cmds;
+  int ncmds = cl->ncmds;
+  if(ncmds==0) return 0;
+  if(ncmds==1 && cmds[0].bi && !cl->redir_file) {
+    int rc = builtin_run(cmds[0].bi, cmds[0].argc, cmds[0].argv);
+    cl->stage_rc[0] = rc;
+    if(rc==255) return -2;
+    return rc;
+  }
+
+  stage_t st[PARSE_MAX_PIPE];
+  pid_t pids[PARSE_MAX_PIPE];
+  int fds[2 * PARSE_MAX_PIPE], nfds = 0;
+  for(int i=0;i<ncmds;i++) {
+    st[i] = (stage_t){ .c = &cmds[i], .in_fd = -1, .out_fd = -1, .rc = -1 };
+    pids[i] = 0;
+    cl->stage_rc[i] = 1;
+  }
+  if(cl->redir_file) {
+    int fd = open(cl->redir_file,
+                  O_WRONLY|O_CREAT|(cl->append_mode?O_APPEND:O_TRUNC), 0644);
+    if(fd<0) { dprintf(1,"redir open failed\n"); return 1; }
+    st[ncmds-1].out_fd = fds[nfds++] = fd;
+  }
+  for(int i=0;i<ncmds-1;i++) {
+    int p[2];
+    if(pipe(p) < 0) {
+      dprintf(1,"pipe error\n");
+      for(int j=0;j<nfds;j++) close(fds[j]);
+      return 1;
     }
-    char* start=p;
-    int inq=0;
-    while(*p && (inq || (!isspace((unsigned char)*p) && *p!='|' && *p!='>'))) {
-      if(*p=='"') inq=!inq;
-      p++;
+    st[i].out_fd = fds[nfds++] = p[1];
+    st[i+1].in_fd = fds[nfds++] = p[0];
+  }
+
+  // a stage that stopped reading must not kill the job with SIGPIPE
+  void (*prev_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+  stdout_flush();   // children must not inherit (and repeat) pending output
+  // fork before any thread exists, then drop the job's copies of their fds
+  for(int i=0;i<ncmds;i++) {
+    if(cmds[i].bi) continue;
+    pids[i] = stage_exec(&st[i], fds, nfds, listener_pid);
+    if(pids[i] < 0) dprintf(1,"fork error\n");
+    if(st[i].in_fd >= 0) close(st[i].in_fd);
+    if(st[i].out_fd >= 0) close(st[i].out_fd);
+  }
+  int started[PARSE_MAX_PIPE];
+  for(int i=0;i<ncmds;i++) {
+    started[i] = 0;
+    if(!cmds[i].bi || i == ncmds-1) continue;
+    started[i] = pthread_create(&st[i].thr, NULL, stage_main, &st[i]) == 0;
+    if(!started[i]) {
+      dprintf(1,"thread error\n");
+      if(st[i].in_fd >= 0) close(st[i].in_fd);
+      if(st[i].out_fd >= 0) close(st[i].out_fd);
     }
-    size_t len = p-start;
-    char* t = malloc(len+1);
-    memcpy(t,start,len);
-    t[len]=0;
-    if(t[0]=='"' && t[len-1]=='"' && len>=2) {
-      t[len-1]=0;
-      memmove(t,t+1,len-1);
+  }
+  if(cmds[ncmds-1].bi) {
+    stage_main(&st[ncmds-1]);
+    started[ncmds-1] = 1;
+  }
+
+  int closing = 0;
+  for(int i=0;i<ncmds;i++) {
+    if(cmds[i].bi) {
+      if(!started[i]) continue;
+      if(i < ncmds-1) pthread_join(st[i].thr, NULL);
+      cl->stage_rc[i] = builtin_rc(st[i].rc);
+      // only the first stage reads the session, and it may leave it unframed
+      if(i == 0 && st[i].rc == 255) closing = 1;
+      continue;
     }
-    if(ntok<MAX_TOKS) toks[ntok++]=t;
-  }
-  toks[ntok]=NULL;
-  return ntok;
-}
-
-static void free_tokens(char** toks, int ntok) {
-  for(int i=0;i<ntok;i++) free(toks[i]);
-}
-
-static int build_pipeline(char** toks, int ntok, command_t* cmds, int* ncmds,
-                          char** redir_file, int* append_mode) {
-  int ci=0;
-  int i=0;
-  while(i<ntok) {
-    if(ci>=MAX_PIPE) return -1;
-    cmds[ci].argv = malloc(sizeof(char*)*(MAX_TOKS));
-    cmds[ci].argc = 0;
-    cmds[ci].is_builtin = 0;
-    while(i<ntok) {
-      if(strcmp(toks[i],"|")==0) { i++; break; }
-      if(strcmp(toks[i],">")==0 || strcmp(toks[i],">>")==0) {
-        *append_mode = (toks[i][1]=='>');
-        i++;
-        if(i>=ntok) return -1;
-        *redir_file = strdup(toks[i]);
-        i++;
-        break;
+    int status;
+    if(pids[i] <= 0) continue;
+    while(waitpid(pids[i], &status, 0) < 0)
+      if(errno != EINTR) { status = -1; break; }
+    if(status != -1) cl->stage_rc[i] = stage_status(status);
+  }
+  signal(SIGPIPE, prev_pipe);
+  return closing ? -2 : cl->stage_rc[ncmds-1];
+}
+
+/* ---- session output buffer ---- */
+
+static void session_printf(session_t* s, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  out_vprintf(&s->out, fmt, ap);
+  va_end(ap);
+}
+
+/* ---- lifecycle ---- */
+
+static session_t* session_find(int id) {
+  for(session_t* s = g_sessions; s; s = s->next)
+    if(s->id == id && id > 0 && s->state != SESS_DEAD) return s;
+  return NULL;
+}
+
+/* Deferred connection changes, applied once the command line completes. */
+enum { REQ_NONE, REQ_MUX, REQ_PERSIST, REQ_DETACH, REQ_ATTACH };
+
+#define SESSION_SCROLLBACK (64 * 1024)   // output kept for a detached session
+
+static void relay_close(session_t* r, int notify);
+static void session_update_interest(session_t* s);
+static void mux_on_frames(session_t* conn);
+
+static void session_destroy(session_t* s) {
+  if(s->state == SESS_DEAD) return;
+  if(s->state == SESS_MUX || s->state == SESS_ATTACHED) {
+    // a framed connection takes its channels down, an attached client only
+    // detaches: the persistent shell keeps running and fills its scrollback
+    session_state_t was = s->state;
+    s->state = SESS_CLOSING;
+    for(session_t* o = g_sessions; o; o = o->next) {
+      if(o->conn != s || o->state != SESS_RELAY) continue;
+      if(was == SESS_MUX) {
+        relay_close(o, 0);
+      } else {
+        o->conn = NULL;
+        klog_printf("session %d (%s) detached\n", o->shell_id, s->ip);
+        session_update_interest(o);
       }
-      cmds[ci].argv[cmds[ci].argc++] = strdup(toks[i]);
-      i++;
     }
-    if(cmds[ci].argc==0) continue;
-    cmds[ci].argv[cmds[ci].argc]=NULL;
-    size_t bc;
-    const builtin_t* tbl = builtin_table(&bc);
-    for(size_t b=0;b<bc;b++) {
-      if(strcmp(tbl[b].name, cmds[ci].argv[0])==0 ||
-         (strcmp(cmds[ci].argv[0],"ll")==0 && strcmp(tbl[b].name,"ls")==0)) {
-        cmds[ci].is_builtin = 1;
-        break;
-      }
+  }
+  if(s->job_fd >= 0) { evl_set(s->job_fd, 0, NULL); close(s->job_fd); s->job_fd = -1; }
+  // the reaper collects the job once it is gone
+  if(s->job_pid > 0) { kill(s->job_pid, SIGTERM); s->job_pid = 0; }
+  evl_set(s->fd, 0, NULL);
+  close(s->fd);
+  s->fd = -1;
+  if(s->state != SESS_RELAY && s->id)
+    klog_printf("session %d (%s) closed\n", s->id, s->ip);
+  s->state = SESS_DEAD;
+}
+
+static session_t* relay_of_conn(const session_t* conn) {
+  for(session_t* r = g_sessions; r; r = r->next)
+    if(r->conn == conn && r->state == SESS_RELAY) return r;
+  return NULL;
+}
+
+static session_t* relay_of_shell(const session_t* shell) {
+  for(session_t* r = g_sessions; r; r = r->next)
+    if(r->shell_id == shell->id && r->state == SESS_RELAY) return r;
+  return NULL;
+}
+
+static void session_update_interest(session_t* s) {
+  switch(s->state) {
+  case SESS_IDLE:
+    evl_set(s->fd, EVL_READ | (s->out.len ? EVL_WRITE : 0), s);
+    break;
+  case SESS_JOB:
+    evl_set(s->fd, 0, NULL);
+    break;
+  case SESS_CLOSING:
+    if(s->out.len) evl_set(s->fd, EVL_WRITE, s);
+    else session_destroy(s);
+    break;
+  case SESS_MUX:
+    evl_set(s->fd, EVL_READ | (s->out.len ? EVL_WRITE : 0), s);
+    break;
+  case SESS_ATTACHED: {
+    // stop reading keystrokes while the shell is not consuming them
+    session_t* r = relay_of_conn(s);
+    int mask = s->out.len ? EVL_WRITE : 0;
+    if(!r || r->out.len < g_relay_backlog) mask |= EVL_READ;
+    evl_set(s->fd, mask, s);
+    break;
+  }
+  case SESS_RELAY: {
+    // read the shell side only while the client keeps up (and, for a channel,
+    // the peer has window), so one busy channel cannot starve the others;
+    // a detached relay always reads, into its scrollback
+    session_t* c = s->conn;
+    int mask = s->out.len ? EVL_WRITE : 0;
+    if(!c || (c->out.len < g_relay_backlog && (c->state != SESS_MUX || s->credit)))
+      mask |= EVL_READ;
+    evl_set(s->fd, mask, s);
+    break;
+  }
+  case SESS_DEAD:
+    break;
+  }
+}
+
+static void sigchld_handler(int sig) {
+  (void)sig;
+  int saved = errno;
+  char c = 0;
+  if(g_chld_pipe[1] >= 0) (void)write(g_chld_pipe[1], &c, 1);
+  errno = saved;
+}
+
+void session_init(int listen_fd, pid_t listener_pid) {
+  g_listen_fd = listen_fd;
+  g_listener_pid = listener_pid;
+  if(!getcwd(g_start_cwd, sizeof(g_start_cwd))) strcpy(g_start_cwd, "/");
+
+  if(pipe(g_chld_pipe) == 0) {
+    set_nonblock(g_chld_pipe[0], 1);
+    set_nonblock(g_chld_pipe[1], 1);
+    evl_set(g_chld_pipe[0], EVL_READ, NULL);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+  } else {
+    klog_perror("pipe");
+  }
+}
+
+static session_t* session_new(int fd, const char* remote_ip) {
+  session_t* s = calloc(1, sizeof(*s));
+  if(!s) return NULL;
+  s->id = g_next_id++;
+  s->fd = fd;
+  reader_init(&s->in, fd);
+  out_init(&s->out, fd);
+  s->job_fd = -1;
+  s->state = SESS_IDLE;
+  s->started = time(NULL);
+  strncpy(s->ip, remote_ip, sizeof(s->ip) - 1);
+  strcpy(s->cwd, g_start_cwd);
+  if(set_nonblock(fd, 1) < 0 || evl_set(fd, EVL_READ, s) < 0) {
+    free(s);
+    return NULL;
+  }
+  s->next = g_sessions;
+  g_sessions = s;
+  return s;
+}
+
+session_t* session_open(int fd, const char* remote_ip) {
+  session_t* s = session_new(fd, remote_ip);
+  if(!s) return NULL;
+  session_printf(s, "Pseudo-SSH (unencrypted) - remote %s\n", remote_ip);
+  session_printf(s, "Type 'help' for builtins.\n");
+  session_printf(s, "$ ");
+  out_set_bulk(fd, 0);
+  out_flush(&s->out);
+  session_update_interest(s);
+  return s;
+}
+
+void session_sweep(void) {
+  session_t** pp = &g_sessions;
+  while(*pp) {
+    session_t* s = *pp;
+    if(s->state == SESS_DEAD) {
+      *pp = s->next;
+      out_free(&s->out);
+      ring_free(&s->scroll);
+      free(s);
+    } else {
+      pp = &s->next;
     }
-    ci++;
   }
-  *ncmds = ci;
-  return 0;
 }
 
-static void free_pipeline(command_t* cmds, int ncmds, char* redir_file) {
-  for(int i=0;i<ncmds;i++) {
-    for(int j=0;j<cmds[i].argc;j++) free(cmds[i].argv[j]);
-    free(cmds[i].argv);
+void session_close_all(void) {
+  for(session_t* s = g_sessions; s; s = s->next) session_destroy(s);
+  session_sweep();
+  signal(SIGCHLD, SIG_DFL);
+  if(g_chld_pipe[0] >= 0) {
+    evl_set(g_chld_pipe[0], 0, NULL);
+    close(g_chld_pipe[0]);
+    close(g_chld_pipe[1]);
+    g_chld_pipe[0] = g_chld_pipe[1] = -1;
   }
-  if(redir_file) free(redir_file);
 }
 
-static int execute_pipeline(command_t* cmds, int ncmds, char* redir_file,
-                            int append_mode, pid_t listener_pid) {
-  if(ncmds==0) return 0;
-  if(ncmds==1 && cmds[0].is_builtin && !redir_file) {
-    int rc = run_builtin_in_current(cmds[0].argc, cmds[0].argv, listener_pid);
-    if(rc==255) return -2;
-    return rc;
+/* ---- command dispatch ---- */
+
+/* End-of-command marker: the "$ " prompt, or in machine mode a framed
+ * record carrying the exit code of every stage and the wall time. */
+static void session_end_cmd(session_t* s, outbuf_t* o, int rc,
+                            const int* stage_rc, int nstages) {
+  if(!s->machine) {
+    out_write(o, "$ ", 2);
+    return;
+  }
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  long long us = (long long)(t1.tv_sec - s->cmd_t0.tv_sec) * 1000000LL +
+                 (t1.tv_nsec - s->cmd_t0.tv_nsec) / 1000;
+  out_printf(o, "{\"type\":\"end\",\"rc\":%d,\"stages\":[", rc < 0 ? 1 : rc);
+  for(int i=0;i<nstages;i++) {
+    int r = stage_rc[i];
+    out_printf(o, "%s%d", i ? "," : "", r < 0 ? 1 : (r == 255 ? 0 : r));
   }
+  out_printf(o, "],\"us\":%lld}\n", us);
+}
 
-  int pipes[MAX_PIPE-1][2];
-  for(int i=0;i<ncmds-1;i++) {
-    if(pipe(pipes[i])<0) { dprintf(1,"pipe error\n"); return -1; }
+static int session_run_inline(session_t* s, command_t* cmd) {
+  if(chdir(s->cwd) < 0) chdir("/");
+  g_cur = s;
+  stdout_set(&s->out);
+  int rc = builtin_run(cmd->bi, cmd->argc, cmd->argv);
+  stdout_set(NULL);
+  g_cur = NULL;
+  if(!getcwd(s->cwd, sizeof(s->cwd))) strcpy(s->cwd, "/");
+  return rc == 255 ? -2 : rc;
+}
+
+static void __attribute__((noreturn))
+session_job_main(session_t* s, int ctl, cmdline_t* cl) {
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  close(g_listen_fd);
+  close(g_chld_pipe[0]);
+  close(g_chld_pipe[1]);
+  http_child();
+  evl_fini();
+  for(session_t* o = g_sessions; o; o = o->next) {
+    if(o == s || o->state == SESS_DEAD) continue;
+    close(o->fd);
+    if(o->job_fd >= 0) close(o->job_fd);
   }
+  fcntl(ctl, F_SETFD, FD_CLOEXEC);
+  set_nonblock(s->fd, 0);
+  dup2(s->fd, 0);
+  dup2(s->fd, 1);
+  dup2(s->fd, 2);
+  out_flush(&s->out);
+  out_discard(&s->out);
+  if(chdir(s->cwd) < 0) chdir("/");
+  g_cur = s;
+  // the parsed line points into s->in, so the job reads stdin from its own
+  // reader seeded with the input that is still pending
+  reader_init(&g_job_in, s->fd);
+  reader_take(&g_job_in, &s->in);
 
-  for(int i=0;i<ncmds;i++) {
-    pid_t pid = fork();
-    if(pid==0) {
-      if(i>0) {
-        dup2(pipes[i-1][0],0);
-      }
-      if(i<ncmds-1) {
-        dup2(pipes[i][1],1);
-      } else if(redir_file) {
-        int fd = open(redir_file,
-                      O_WRONLY|O_CREAT|(append_mode?O_APPEND|O_WRONLY:O_TRUNC),
-                      0644);
-        if(fd<0) { dprintf(1,"redir open failed\n"); _exit(1); }
-        dup2(fd,1);
-        close(fd);
+  // builtins producing listings or file data run corked and fully buffered,
+  // everything else stays line-buffered so progress output is timely
+  int bulk = 1;
+  for(int i=0;i<cl->ncmds;i++)
+    if(!cl->cmds[i].bi || !(cl->cmds[i].bi->flags & BI_BULK)) bulk = 0;
+  out_init(&g_stdout, 1);
+  g_stdout.linebuf = !bulk;
+  stdout_set(&g_stdout);
+  if(bulk) out_set_bulk(1, 1);
+
+  int rc = execute_pipeline(cl, g_listener_pid);
+
+  // coalesce the prompt with the last output unless more lines are queued;
+  // the machine mode terminator carries per-stage codes, so the job sends it
+  job_report_t rep = { 0, 0, 0, 0 };
+  if(rc == -2) {
+    rep.closing = 1;
+  } else if(s->machine || !reader_has_line(&g_job_in)) {
+    session_end_cmd(s, &g_stdout, rc, cl->stage_rc, cl->ncmds);
+    rep.prompted = 1;
+  }
+  stdout_flush();
+  if(bulk) out_set_bulk(1, 0);
+
+  // report traffic, then hand unread input back so pipelined lines survive
+  rep.bytes_in = g_job_in.total;
+  rep.bytes_out = g_stdout.total;
+  safe_write(ctl, &rep, sizeof(rep));
+  if(!rep.closing && reader_pending(&g_job_in))
+    safe_write(ctl, reader_data(&g_job_in), reader_pending(&g_job_in));
+  _exit(rc < 0 ? 1 : (rc & 0xff));
+}
+
+static int session_spawn_job(session_t* s, cmdline_t* cl) {
+  int ctl[2];
+  if(pipe(ctl) < 0) { session_printf(s, "pipe error\n"); return -1; }
+  pid_t pid = fork();
+  if(pid < 0) {
+    close(ctl[0]); close(ctl[1]);
+    session_printf(s, "fork error\n");
+    return -1;
+  }
+  if(pid == 0) {
+    close(ctl[0]);
+    session_job_main(s, ctl[1], cl);
+  }
+  close(ctl[1]);
+  // the job now owns the socket, pending output and buffered input
+  out_discard(&s->out);
+  reader_drop(&s->in);
+  s->job_pid = pid;
+  s->job_fd = ctl[0];
+  s->job_status = 0;
+  s->job_rep_len = 0;
+  s->state = SESS_JOB;
+  set_nonblock(ctl[0], 1);
+  evl_set(ctl[0], EVL_READ, s);
+  return 0;
+}
+
+/* Returns the exit code of a command run in the listener (-2 to close the
+ * session), or 0 once a job took over. */
+static int session_exec_line(session_t* s, char* line) {
+  cmdline_t cl;
+  clock_gettime(CLOCK_MONOTONIC, &s->cmd_t0);
+  if(parse_line(line, &cl) < 0) {
+    if(s->machine) session_printf(s, "{\"type\":\"error\",\"msg\":\"parse error\"}\n");
+    else session_printf(s, "parse error\n");
+    return 2;
+  }
+  if(cl.ncmds == 0) return 0;
+  resolve_builtins(&cl);
+  s->ncmds++;
+  int rc;
+  if(cl.ncmds==1 && cl.cmds[0].bi && !cl.redir_file &&
+     (cl.cmds[0].bi->flags & BI_INLINE)) {
+    rc = session_run_inline(s, &cl.cmds[0]);
+    s->last_rc = rc;
+  } else {
+    rc = session_spawn_job(s, &cl);
+  }
+  return rc;
+}
+
+static int session_apply_req(session_t* s, int* rc);
+
+/* Run every complete line already buffered, stopping when a job takes over.
+ * Lines are executed straight out of the reader, pipelined input included. */
+static void session_run_lines(session_t* s) {
+  while(s->state == SESS_IDLE) {
+    char* line = reader_line(&s->in, NULL);
+    if(!line) {
+      if(reader_full(&s->in)) {
+        session_printf(s, "line too long\n");
+        session_end_cmd(s, &s->out, 2, NULL, 0);
+        reader_drop(&s->in);
       }
-      for(int k=0;k<ncmds-1;k++) {
-        close(pipes[k][0]); close(pipes[k][1]);
+      return;
+    }
+    int rc = session_exec_line(s, line);
+    if(rc == -2) {
+      s->state = SESS_CLOSING;
+      return;
+    }
+    if(s->req && session_apply_req(s, &rc)) return;
+    if(s->state == SESS_IDLE) session_end_cmd(s, &s->out, rc, &rc, 1);
+  }
+}
+
+static void session_on_readable(session_t* s) {
+  ssize_t n = reader_fill(&s->in);
+  if(n < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+    session_destroy(s);
+    return;
+  }
+  if(n == 0) {
+    s->state = SESS_CLOSING;
+    return;
+  }
+  s->bytes_in += (size_t)n;
+  session_run_lines(s);
+}
+
+/* A job is over once its control pipe hit EOF and the reaper collected it. */
+static void session_job_finish(session_t* s) {
+  if(s->job_fd >= 0 || s->job_pid > 0 || s->state != SESS_JOB) return;
+  s->bytes_in += s->job_rep.bytes_in;
+  s->bytes_out += s->job_rep.bytes_out;
+  s->last_rc = WIFEXITED(s->job_status) ? WEXITSTATUS(s->job_status) : -1;
+  set_nonblock(s->fd, 1);
+  if(s->job_rep.closing) {
+    // whatever input is left cannot be trusted to be command lines
+    reader_drop(&s->in);
+    s->state = SESS_CLOSING;
+    return;
+  }
+  s->state = SESS_IDLE;
+  if(!s->job_rep.prompted) session_end_cmd(s, &s->out, s->last_rc, &s->last_rc, 1);
+  session_run_lines(s);
+}
+
+static void session_on_job_event(session_t* s) {
+  for(;;) {
+    ssize_t n;
+    if(s->job_rep_len < sizeof(s->job_rep)) {
+      n = read(s->job_fd, (char*)&s->job_rep + s->job_rep_len,
+               sizeof(s->job_rep) - s->job_rep_len);
+      if(n > 0) { s->job_rep_len += (size_t)n; continue; }
+    } else {
+      n = reader_fill_from(&s->in, s->job_fd);
+      if(n > 0) continue;
+    }
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if(n < 0 && errno == EINTR) continue;
+    break;   // EOF: the job is exiting
+  }
+  evl_set(s->job_fd, 0, NULL);
+  close(s->job_fd);
+  s->job_fd = -1;
+  if(s->job_rep_len < sizeof(s->job_rep)) memset(&s->job_rep, 0, sizeof(s->job_rep));
+  session_job_finish(s);
+}
+
+/* ---- channel multiplexing ---- */
+
+/* A framed connection (SESS_MUX) owns the socket. Each channel is an ordinary
+ * shell session on one end of a socketpair plus a relay (SESS_RELAY) holding
+ * the other end, which turns bytes into DATA frames and back. The relay only
+ * reads its shell while the peer has granted credit, so a long transfer on
+ * one channel cannot hold up the prompt on another. */
+
+static session_t* mux_relay(session_t* conn, unsigned chan) {
+  for(session_t* r = g_sessions; r; r = r->next)
+    if(r->conn == conn && r->state == SESS_RELAY && r->chan == chan) return r;
+  return NULL;
+}
+
+/* The shell behind a relay is gone (or must go): a channel is closed towards
+ * the peer, an attached client is let go once its output drained. */
+static void relay_close(session_t* r, int notify) {
+  session_t* c = r->conn;
+  if(c && c->state == SESS_MUX && notify) mux_send(&c->out, MUX_CLOSE, r->chan, NULL, 0);
+  else if(c && c->state == SESS_ATTACHED) c->state = SESS_CLOSING;
+  session_t* shell = session_find(r->shell_id);
+  if(shell) session_destroy(shell);
+  session_destroy(r);
+}
+
+static void mux_open_channel(session_t* conn, unsigned chan) {
+  int nchan = 0;
+  for(session_t* o = g_sessions; o; o = o->next)
+    if(o->conn == conn && o->state == SESS_RELAY) nchan++;
+  int sv[2] = { -1, -1 };
+  session_t* r = NULL;
+  session_t* shell = NULL;
+  if(nchan >= MUX_MAX_CHANS || socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) goto fail;
+  if(!(r = calloc(1, sizeof(*r)))) goto fail;
+  if(!(shell = session_new(sv[0], conn->ip))) goto fail;
+  shell->conn = conn;
+  shell->chan = chan;
+  r->fd = sv[1];
+  reader_init(&r->in, sv[1]);
+  out_init(&r->out, sv[1]);
+  r->job_fd = -1;
+  r->state = SESS_RELAY;
+  r->conn = conn;
+  r->chan = chan;
+  r->shell_id = shell->id;
+  r->credit = MUX_WINDOW;
+  set_nonblock(sv[1], 1);
+  r->next = g_sessions;
+  g_sessions = r;
+  mux_send(&conn->out, MUX_OPEN, chan, NULL, 0);
+  session_printf(shell, "$ ");
+  out_flush(&shell->out);
+  session_update_interest(shell);
+  return;
+fail:
+  free(r);
+  if(sv[0] >= 0) { close(sv[0]); close(sv[1]); }
+  mux_send(&conn->out, MUX_CLOSE, chan, NULL, 0);
+}
+
+/* Credit the peer for what reached the shell, in batches. */
+static void relay_credit(session_t* r) {
+  uint64_t n = r->out.total - r->acked;
+  if(n < MUX_WINDOW / 4) return;
+  mux_send_credit(&r->conn->out, r->chan, (uint32_t)n);
+  r->acked += n;
+}
+
+static void relay_flush(session_t* r) {
+  if(r->out.len && out_flush(&r->out) < 0) {
+    relay_close(r, 1);
+    return;
+  }
+  if(r->conn && r->conn->state == SESS_MUX) relay_credit(r);
+}
+
+static void relay_on_readable(session_t* r) {
+  session_t* c = r->conn;
+  char buf[MUX_MAX_DATA];
+  size_t want = sizeof(buf);
+  if(c && c->state == SESS_MUX && r->credit < want) want = r->credit;
+  if(!want) return;
+  ssize_t n = read(r->fd, buf, want);
+  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+  if(n <= 0) {
+    relay_close(r, 1);   // the shell session ended
+    return;
+  }
+  if(!c) {
+    ring_write(&r->scroll, buf, (size_t)n);
+    return;
+  }
+  if(c->state == SESS_MUX) {
+    mux_send(&c->out, MUX_DATA, r->chan, buf, (size_t)n);
+    r->credit -= (uint32_t)n;
+  } else {
+    out_write(&c->out, buf, (size_t)n);
+  }
+  c->bytes_out += (uint64_t)n;
+}
+
+static void mux_on_frames(session_t* conn) {
+  mux_frame_t f;
+  int rc = 0;
+  while(conn->state == SESS_MUX && (rc = mux_next(&conn->in, &f)) > 0) {
+    session_t* r = mux_relay(conn, f.chan);
+    switch(f.type) {
+    case MUX_OPEN:
+      if(!r) mux_open_channel(conn, f.chan);
+      break;
+    case MUX_CLOSE:
+      if(r) relay_close(r, 1);
+      break;
+    case MUX_CREDIT:
+      if(r && f.len == 4) {
+        uint32_t n;
+        memcpy(&n, f.data, 4);
+        n = ntohl(n);
+        r->credit = n > UINT32_MAX - r->credit ? UINT32_MAX : r->credit + n;
       }
-      char lbuf[32];
-      snprintf(lbuf,sizeof(lbuf),"%d", listener_pid);
-      setenv("SESSION_LISTENER_PID", lbuf, 1);
-      if(cmds[i].is_builtin) {
-        int rc = run_builtin_in_current(cmds[i].argc, cmds[i].argv, listener_pid);
-        _exit(rc<0?1:(rc==255?0:rc));
-      } else {
-        execvp(cmds[i].argv[0], cmds[i].argv);
-        dprintf(1,"exec failed: %s\n", cmds[i].argv[0]);
-        _exit(127);
+      break;
+    case MUX_DATA:
+      if(!r) break;
+      if(r->out.len + (r->out.total - r->acked) + f.len > MUX_WINDOW) {
+        rc = -1;   // the peer overran its window
+        break;
       }
+      out_write(&r->out, f.data, f.len);
+      relay_flush(r);
+      break;
+    }
+    if(rc < 0) break;
+  }
+  if(rc < 0) {
+    klog_printf("session %d (%s): bad mux frame\n", conn->id, conn->ip);
+    session_destroy(conn);
+  }
+}
+
+static void mux_on_readable(session_t* conn) {
+  ssize_t n = reader_fill(&conn->in);
+  if(n < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+    session_destroy(conn);
+    return;
+  }
+  if(n == 0) {
+    session_destroy(conn);
+    return;
+  }
+  conn->bytes_in += (size_t)n;
+  mux_on_frames(conn);
+}
+
+/* Keystrokes of an attached client go to the shell unchanged. */
+static void attached_on_readable(session_t* c) {
+  char buf[8192];
+  ssize_t n = read(c->fd, buf, sizeof(buf));
+  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+  if(n <= 0) {
+    session_destroy(c);   // disconnect detaches, the shell carries on
+    return;
+  }
+  c->bytes_in += (uint64_t)n;
+  session_t* r = relay_of_conn(c);
+  if(!r) return;
+  out_write(&r->out, buf, (size_t)n);
+  relay_flush(r);
+}
+
+/* Push queued output, then recompute interest for the client connection and
+ * all its relays (a drained connection lets paused relays read again). A
+ * client that was let go is closed here once drained. */
+static void conn_flush(session_t* conn) {
+  if(conn->state == SESS_DEAD) return;
+  if(conn->out.len && out_flush(&conn->out) < 0) {
+    session_destroy(conn);
+    return;
+  }
+  session_update_interest(conn);
+  for(session_t* r = g_sessions; r; r = r->next)
+    if(r->conn == conn && r->state == SESS_RELAY) session_update_interest(r);
+}
+
+static void relay_event(session_t* s, int mask) {
+  session_t* conn = s->state == SESS_RELAY ? s->conn : s;
+  if(s != conn) {
+    if(mask & EVL_READ) relay_on_readable(s);
+    if((mask & EVL_WRITE) && s->state == SESS_RELAY) relay_flush(s);
+    if(!conn && s->state == SESS_RELAY) session_update_interest(s);
+  } else if(mask & EVL_READ) {
+    if(s->state == SESS_MUX) mux_on_readable(s);
+    else if(s->state == SESS_ATTACHED) attached_on_readable(s);
+  }
+  if(conn) conn_flush(conn);
+}
+
+int session_mux(void) {
+  if(!g_cur || g_cur->conn || g_cur->persist || getpid() != g_listener_pid) return -1;
+  g_cur->req = REQ_MUX;
+  return 0;
+}
+
+/* ---- persistent sessions ---- */
+
+/* Like a channel, a persistent shell talks to a socketpair; its relay holds
+ * the other end and forwards to whichever client is attached. Without one,
+ * output goes into a bounded scrollback replayed on the next attach, and
+ * jobs keep running (or block on a full socketpair if nothing drains it). */
+
+static int session_make_persistent(session_t* s) {
+  if(s->persist) return 0;
+  int sv[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return -1;
+  session_t* c = calloc(1, sizeof(*c));
+  session_t* r = calloc(1, sizeof(*r));
+  if(!c || !r || ring_init(&r->scroll, SESSION_SCROLLBACK) < 0) {
+    free(c);
+    free(r);
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  set_nonblock(sv[0], 1);
+  set_nonblock(sv[1], 1);
+
+  // the client socket moves to a connection session, the shell (pending input
+  // and output included) carries on over the socketpair
+  evl_set(s->fd, 0, NULL);
+  c->fd = s->fd;
+  reader_init(&c->in, c->fd);
+  out_init(&c->out, c->fd);
+  c->job_fd = -1;
+  c->state = SESS_ATTACHED;
+  c->started = time(NULL);
+  c->shell_id = s->id;
+  memcpy(c->ip, s->ip, sizeof(c->ip));
+
+  r->fd = sv[1];
+  reader_init(&r->in, sv[1]);
+  out_init(&r->out, sv[1]);
+  r->job_fd = -1;
+  r->state = SESS_RELAY;
+  r->conn = c;
+  r->shell_id = s->id;
+
+  s->fd = sv[0];
+  s->in.fd = sv[0];
+  s->out.fd = sv[0];
+  s->persist = 1;
+
+  c->next = r;
+  r->next = g_sessions;
+  g_sessions = c;
+  session_update_interest(c);
+  session_update_interest(r);
+  return 0;
+}
+
+static void session_detach_client(session_t* s, const char* why) {
+  session_t* r = relay_of_shell(s);
+  session_t* c = r ? r->conn : NULL;
+  if(!c) return;
+  out_printf(&c->out, "[%s session %d]\n", why, s->id);
+  r->conn = NULL;
+  c->state = SESS_CLOSING;
+  klog_printf("session %d (%s) detached\n", s->id, c->ip);
+  session_update_interest(c);
+  session_update_interest(r);
+}
+
+/* The connection serving `c` is handed to persistent session `id`. */
+static int session_attach_to(session_t* c, int id) {
+  session_t* s = session_find(id);
+  session_t* r = s && s->persist ? relay_of_shell(s) : NULL;
+  if(!r) return -1;
+  if(r->conn) session_detach_client(s, "attached elsewhere, leaving");
+  c->state = SESS_ATTACHED;
+  c->shell_id = id;
+  r->conn = c;
+  klog_printf("session %d attached from %s (session %d)\n", id, c->ip, c->id);
+  if(r->scroll.dropped)
+    out_printf(&c->out, "[attached to session %d, %llu bytes of scrollback lost]\n",
+               id, (unsigned long long)r->scroll.dropped);
+  else
+    out_printf(&c->out, "[attached to session %d]\n", id);
+  int quiet = !r->scroll.len;
+  ring_drain(&r->scroll, &c->out);
+  if(quiet && s->state == SESS_IDLE && !s->out.len && !s->machine)
+    out_write(&c->out, "$ ", 2);
+  // anything typed after the attach line is meant for the shell
+  if(reader_pending(&c->in)) {
+    out_write(&r->out, reader_data(&c->in), reader_pending(&c->in));
+    reader_drop(&c->in);
+    relay_flush(r);
+  }
+  session_update_interest(r);
+  return 0;
+}
+
+/* Returns 1 once the connection changed hands and must not run more lines. */
+static int session_apply_req(session_t* s, int* rc) {
+  int req = s->req;
+  s->req = 0;
+  switch(req) {
+  case REQ_MUX:
+    // the reply is the last plain text; bytes after the line are frames
+    session_printf(s, "MUX/1\n");
+    s->state = SESS_MUX;
+    mux_on_frames(s);
+    return 1;
+  case REQ_PERSIST:
+    if(session_make_persistent(s) < 0) {
+      session_printf(s, "persist failed\n");
+      *rc = 1;
     }
+    return 0;
+  case REQ_DETACH:
+    if(session_make_persistent(s) < 0) {
+      session_printf(s, "detach failed\n");
+      *rc = 1;
+      return 0;
+    }
+    out_flush(&s->out);
+    session_detach_client(s, "detached from");
+    return 0;
+  case REQ_ATTACH:
+    if(session_attach_to(s, s->req_id) < 0) {
+      session_printf(s, "attach: session %d is gone\n", s->req_id);
+      *rc = 1;
+      return 0;
+    }
+    return 1;
   }
-  for(int i=0;i<ncmds-1;i++) { close(pipes[i][0]); close(pipes[i][1]); }
+  return 0;
+}
 
+int session_persist(void) {
+  if(!g_cur || g_cur->conn || getpid() != g_listener_pid) return -1;
+  g_cur->req = REQ_PERSIST;
+  return 0;
+}
+
+int session_detach(void) {
+  if(!g_cur || g_cur->conn || getpid() != g_listener_pid) return -1;
+  g_cur->req = REQ_DETACH;
+  return 0;
+}
+
+int session_attach(int id) {
+  if(!g_cur || g_cur->conn || g_cur->persist || getpid() != g_listener_pid) return -1;
+  session_t* s = session_find(id);
+  if(!s || !s->persist || s == g_cur) return -1;
+  g_cur->req = REQ_ATTACH;
+  g_cur->req_id = id;
+  return 0;
+}
+
+/* SIGCHLD bottom half: collect every exited child, jobs or strays. */
+static void session_reap(void) {
+  char drain[64];
+  while(read(g_chld_pipe[0], drain, sizeof(drain)) > 0) ;
   int status;
-  int exitcode=0;
-  for(int i=0;i<ncmds;i++) {
-    wait(&status);
-    if(WIFEXITED(status)) exitcode = WEXITSTATUS(status);
-  }
-  return exitcode;
-}
-
-static int read_line(int fd, char* buf, size_t max) {
-  size_t off=0;
-  while(off+1<max) {
-    char c;
-    ssize_t r = read(fd,&c,1);
-    if(r<=0) return -1;
-    if(c=='\r') continue;
-    if(c=='\n') break;
-    buf[off++]=c;
-  }
-  buf[off]=0;
-  return (int)off;
-}
-
-void session_handle(int fd, const char* remote_ip, pid_t listener_pid) {
-  dprintf(fd,"Pseudo-SSH (unencrypted) - remote %s\n", remote_ip);
-  dprintf(fd,"Type 'help' for builtins.\n");
-  dup2(fd,0);
-  dup2(fd,1);
-  dup2(fd,2);
-
-  char line[MAX_LINE];
-  while(1) {
-    dprintf(1,"$ ");
-    if(read_line(0,line,sizeof(line))<0) break;
-    char* ln = trim(line);
-    if(!*ln) continue;
-    char* toks[MAX_TOKS];
-    int ntok = tokenize(ln, toks);
-    if(ntok<=0) continue;
-    command_t cmds[MAX_PIPE];
-    int ncmds=0;
-    char* redir_file=NULL;
-    int append_mode=0;
-    if(build_pipeline(toks, ntok, cmds, &ncmds, &redir_file, &append_mode)<0) {
-      dprintf(1,"parse error\n");
-      free_tokens(toks, ntok);
+  pid_t pid;
+  while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    bw_reap(pid);
+    for(session_t* s = g_sessions; s; s = s->next) {
+      if(s->state != SESS_JOB || s->job_pid != pid) continue;
+      s->job_status = status;
+      s->job_pid = 0;
+      session_job_finish(s);
+      session_update_interest(s);
+      break;
+    }
+  }
+}
+
+void session_event(session_t* s, int fd, int mask) {
+  if(fd == g_chld_pipe[0]) { session_reap(); return; }
+  if(!s || s->state == SESS_DEAD) return;
+  if(s->state == SESS_MUX || s->state == SESS_RELAY || s->state == SESS_ATTACHED) {
+    relay_event(s, mask);
+    return;
+  }
+  if(fd == s->job_fd) {
+    session_on_job_event(s);
+  } else {
+    if((mask & EVL_READ) && s->state == SESS_IDLE) session_on_readable(s);
+    // one flush per wakeup: all output and the prompt leave together
+    if(s->state != SESS_DEAD && s->state != SESS_JOB && s->out.len &&
+       out_flush(&s->out) < 0) {
+      session_destroy(s);
+    }
+  }
+  if(s->state != SESS_DEAD) session_update_interest(s);
+}
+
+/* ---- job-side stdin ---- */
+
+int session_machine(void) {
+  return g_cur ? g_cur->machine : 0;
+}
+
+int session_set_machine(int on) {
+  if(!g_cur) return -1;
+  g_cur->machine = on;
+  return 0;
+}
+
+int session_id(void) {
+  return g_cur ? g_cur->id : 0;
+}
+
+/* Output a stage produced so far goes out before it blocks waiting for
+ * input, so data keeps moving through a pipeline that is fed slowly. */
+ssize_t session_stdin_read(void* buf, size_t len) {
+  reader_t* in = stdin_reader();
+  if(!reader_pending(in)) stdout_flush();
+  return reader_read(in, buf, len);
+}
+
+ssize_t session_stdin_line(char* buf, size_t max) {
+  reader_t* in = stdin_reader();
+  if(!reader_has_line(in)) stdout_flush();
+  return reader_getline(in, buf, max);
+}
+
+ssize_t session_stdin_peek(const char** data, size_t max) {
+  reader_t* in = stdin_reader();
+  if(!reader_pending(in)) {
+    stdout_flush();
+    ssize_t n = reader_fill(in);
+    if(n <= 0) return n;
+  }
+  *data = reader_data(in);
+  return (ssize_t)(reader_pending(in) < max ? reader_pending(in) : max);
+}
+
+void session_stdin_consume(size_t n) {
+  reader_consume(stdin_reader(), n);
+}
+
+int session_stdin_fd(void) {
+  return stdin_reader()->fd;
+}
+
+/* ---- registry ---- */
+
+static const char* session_state_name(const session_t* s) {
+  switch(s->state) {
+  case SESS_IDLE:    return "idle";
+  case SESS_JOB:     return "job";
+  case SESS_CLOSING: return "closing";
+  case SESS_MUX:     return "mux";
+  default:           return "dead";
+  }
+}
+
+/* Persistent shells show "d/" while nobody is attached. */
+static const char* session_state_label(const session_t* s, char* buf, size_t len) {
+  const char* name = session_state_name(s);
+  if(!s->persist) return name;
+  session_t* r = relay_of_shell(s);
+  snprintf(buf, len, "%s%s", r && !r->conn ? "d/" : "p/", name);
+  return buf;
+}
+
+void session_list(void) {
+  int machine = session_machine();
+  if(!machine)
+    dprintf(1, "  ID    PID REMOTE          STARTED   STATE         IN       OUT  CMDS  RC\n");
+  for(session_t* s = g_sessions; s; s = s->next) {
+    if(s->state == SESS_DEAD || s->state == SESS_RELAY || s->state == SESS_ATTACHED)
+      continue;
+    int pid = s->job_pid > 0 ? (int)s->job_pid : (int)g_listener_pid;
+    char sbuf[16];
+    const char* state = session_state_label(s, sbuf, sizeof(sbuf));
+    unsigned long long out = s->bytes_out + s->out.total;
+    if(machine) {
+      json_begin("session");
+      json_int("id", s->id);
+      json_int("pid", pid);
+      json_str("remote", s->ip);
+      json_int("started", (long long)s->started);
+      json_str("state", state);
+      json_int("in", (long long)s->bytes_in);
+      json_int("out", (long long)out);
+      json_int("cmds", s->ncmds);
+      json_int("rc", s->last_rc);
+      json_bool("self", s == g_cur);
+      json_end();
       continue;
     }
-    int rc = execute_pipeline(cmds, ncmds, redir_file, append_mode, listener_pid);
-    free_pipeline(cmds,ncmds,redir_file);
-    free_tokens(toks, ntok);
-    if(rc==-2) break;
+    struct tm tm; localtime_r(&s->started, &tm);
+    char tbuf[16];
+    strftime(tbuf, sizeof(tbuf), "%H:%M:%S", &tm);
+    dprintf(1, "%c%3d %6d %-15s %-9s %-8s %8llu %9llu %5u %3d\n",
+            s == g_cur ? '*' : ' ', s->id, pid, s->ip, tbuf, state,
+            (unsigned long long)s->bytes_in, out, s->ncmds, s->last_rc);
+  }
+  const admit_stats_t* st = admit_stats();
+  if(machine) {
+    json_begin("admit");
+    json_int("admitted", (long long)st->admitted);
+    json_int("full", (long long)st->rejected[ADMIT_FULL]);
+    json_int("per_ip", (long long)st->rejected[ADMIT_PER_IP]);
+    json_int("rate", (long long)st->rejected[ADMIT_RATE]);
+    json_int("accept_errors", (long long)st->accept_errors);
+    json_end();
+    return;
+  }
+  dprintf(1, "admitted %llu, rejected %llu full / %llu per-ip / %llu rate, "
+             "accept errors %llu\n",
+          (unsigned long long)st->admitted,
+          (unsigned long long)st->rejected[ADMIT_FULL],
+          (unsigned long long)st->rejected[ADMIT_PER_IP],
+          (unsigned long long)st->rejected[ADMIT_RATE],
+          (unsigned long long)st->accept_errors);
+}
+
+/* Sessions held against the admission limits: every shell that is not a mux
+ * channel, persistent ones included. Attached clients are not counted again. */
+int session_count(const char* ip, int* from_ip) {
+  int total = 0, mine = 0;
+  for(session_t* s = g_sessions; s; s = s->next) {
+    if(s->state == SESS_DEAD || s->state == SESS_RELAY || s->state == SESS_ATTACHED ||
+       s->conn)
+      continue;
+    total++;
+    if(ip && strcmp(s->ip, ip) == 0) mine++;
+  }
+  if(from_ip) *from_ip = mine;
+  return total;
+}
+
+int session_kill(int id) {
+  for(session_t* s = g_sessions; s; s = s->next) {
+    if(s->id != id || id <= 0 || s->state == SESS_DEAD) continue;
+    klog_printf("session %d (%s) killed\n", s->id, s->ip);
+    session_destroy(s);
+    return 0;
   }
+  return -1;
 }
@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <stdarg.h>   // for fallback dprintf
 #include <errno.h>
+#include <time.h>
 #include <sys/sysctl.h>
 #include <ps5/klog.h>
 
@@ -29,6 +30,10 @@
 
 #include "sshsvr.h"
 #include "session.h"
+#include "evloop.h"
+#include "admit.h"
+#include "bw.h"
+#include "http.h"
 #include "util.h"   // added
 
 #include <sys/types.h>
@@ -155,7 +160,7 @@ static int create_listener(uint16_t port) {
     klog_perror("bind");
     close(fd); return -1;
   }
-  if(listen(fd, 8) < 0) { klog_perror("listen"); close(fd); return -1; }
+  if(listen(fd, g_admit.backlog > 0 ? g_admit.backlog : SOMAXCONN) < 0) { klog_perror("listen"); close(fd); return -1; }
   return fd;
 }
 
@@ -175,6 +180,51 @@ static int bind_with_retry(uint16_t port, int force) {
   return lfd;
 }
 
+/* Turn a connection away before any session state exists for it. Logged at
+ * most once a second so a flood cannot fill the kernel log. */
+static void reject(int cfd, const char* ip, admit_verdict_t v) {
+  static time_t last_log;
+  char msg[96];
+  int n = snprintf(msg, sizeof(msg), "connection refused: %s\n", admit_reason(v));
+  send(cfd, msg, (size_t)n, MSG_DONTWAIT);
+  close(cfd);
+  time_t now = time(NULL);
+  if(now != last_log) {
+    last_log = now;
+    klog_printf("rejected %s: %s\n", ip, admit_reason(v));
+  }
+}
+
+/* Drain the accept queue; each admitted connection becomes an event-driven
+ * session inside this process, jobs fork only when a command needs it. */
+static void accept_pending(int lfd) {
+  for(;;) {
+    struct sockaddr_in caddr; socklen_t clen = sizeof(caddr);
+    int cfd = accept(lfd, (struct sockaddr*)&caddr, &clen);
+    if(cfd < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        admit_note_accept_error();
+        klog_perror("accept");
+      }
+      return;
+    }
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &caddr.sin_addr, ip, sizeof(ip));
+    int from_ip;
+    int total = session_count(ip, &from_ip);
+    admit_verdict_t v = admit_check(total, from_ip);
+    if(v != ADMIT_OK) {
+      reject(cfd, ip, v);
+      continue;
+    }
+    klog_printf("connection from %s\n", ip);
+    if(!session_open(cfd, ip)) {
+      klog_printf("session setup failed for %s\n", ip);
+      close(cfd);
+    }
+  }
+}
+
 void sshsvr_run(uint16_t port, int daemonize, int force_replace) {
   if(ensure_single_instance(force_replace) < 0)
     return;
@@ -211,6 +261,9 @@ void sshsvr_run(uint16_t port, int daemonize, int force_replace) {
   sa.sa_handler = sigterm_handler;
   sigaction(SIGTERM, &sa, NULL);
   sigaction(SIGINT, &sa, NULL);
+  // a client vanishing mid-write must not take the listener down
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
 
   int lfd = bind_with_retry(port, force_replace);
   if(lfd < 0) {
@@ -222,28 +275,45 @@ void sshsvr_run(uint16_t port, int daemonize, int force_replace) {
   write_pidfile(g_listener_pid);
   klog_printf("pid written");
 
-  while(g_running) {
-    struct sockaddr_in caddr; socklen_t clen = sizeof(caddr);
-    int cfd = accept(lfd, (struct sockaddr*)&caddr, &clen);
-    if(cfd < 0) {
-      if(!g_running) break;
-      klog_perror("accept");
-      continue;
+  set_nonblock(lfd, 1);
+  if(evl_init() < 0 || evl_set(lfd, EVL_READ, NULL) < 0) {
+    klog_perror("evl_init");
+    close(lfd);
+    if(daemonize) remove_pidfile();
+    return;
+  }
+  if(bw_init() < 0) klog_printf("sshsvr: no bandwidth scheduler (mmap failed)\n");
+  session_init(lfd, g_listener_pid);
+  if(g_http.port) {
+    int hfd = create_listener(g_http.port);
+    if(hfd >= 0 && (set_nonblock(hfd, 1) < 0 || http_init(hfd) < 0)) {
+      close(hfd);
+      hfd = -1;
     }
-    char ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &caddr.sin_addr, ip, sizeof(ip));
-    klog_printf("connection from %s\n", ip);
+    if(hfd >= 0) klog_printf("sshsvr: http on port %d\n", g_http.port);
+    else g_http.port = 0;
+  }
 
-    pid_t child = fork();
-    if(child == 0) {
-      close(lfd);
-      session_handle(cfd, ip, g_listener_pid);
-      close(cfd);
-      _exit(0);
+  while(g_running) {
+    evl_event_t evs[64];
+    int n = evl_wait(evs, 64, http_timeout_ms());
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      klog_perror("evl_wait");
+      break;
+    }
+    for(int i=0;i<n;i++) {
+      if(evs[i].fd == lfd) accept_pending(lfd);
+      else if(http_owns(evs[i].udata)) http_event(evs[i].udata, evs[i].mask);
+      else session_event(evs[i].udata, evs[i].fd, evs[i].mask);
     }
-    close(cfd);
+    session_sweep();
+    http_sweep();
   }
 
+  http_close_all();
+  session_close_all();
+  evl_fini();
   close(lfd);
   if(daemonize) remove_pidfile();
   klog_printf("sshsvr shutting down\n");
@@ -251,17 +321,26 @@ void sshsvr_run(uint16_t port, int daemonize, int force_replace) {
 
 static void usage(const char* prog) {
   dprintf(1,
-    "Usage: %s [-p port] [-d] [-F]\n"
+    "Usage: %s [-p port] [-d] [-F] [-b backlog] [-c max] [-i max] [-r rate[/burst]]\n"
+    "          [-H port [-R root]...]\n"
     "  -p <port>  listen port (default %d)\n"
     "  -d         daemonize\n"
-    "  -F         force replace existing instance\n",
-    prog, SSHSVR_DEFAULT_PORT);
+    "  -F         force replace existing instance\n"
+    "  -b <n>     listen backlog (default %d)\n"
+    "  -c <n>     max concurrent sessions, 0 = unlimited (default %d)\n"
+    "  -i <n>     max concurrent sessions per address (default %d)\n"
+    "  -r <n[/b]> new connections per second and burst (default %d/%d)\n"
+    "  -H <port>  also serve files over HTTP on this port, 0 = off (default %d)\n"
+    "  -R <dir>   directory tree HTTP serves, repeatable (default /data, /mnt)\n",
+    prog, SSHSVR_DEFAULT_PORT, g_admit.backlog, g_admit.max_sessions,
+    g_admit.max_per_ip, g_admit.rate, g_admit.burst, SSHSVR_HTTP_PORT);
 }
 
 int main(int argc, char** argv) {
   int port = SSHSVR_DEFAULT_PORT;
   int daemonize = 0;
   int force = 0;
+  g_http.port = SSHSVR_HTTP_PORT;
   for(int i=1;i<argc;i++) {
     if(strcmp(argv[i], "-p")==0 && i+1<argc) {
       port = atoi(argv[++i]);
@@ -269,6 +348,20 @@ int main(int argc, char** argv) {
       daemonize = 1;
     } else if(strcmp(argv[i], "-F")==0) {
       force = 1;
+    } else if(strcmp(argv[i], "-b")==0 && i+1<argc) {
+      g_admit.backlog = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-c")==0 && i+1<argc) {
+      g_admit.max_sessions = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-i")==0 && i+1<argc) {
+      g_admit.max_per_ip = atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-r")==0 && i+1<argc) {
+      char* slash;
+      g_admit.rate = (int)strtol(argv[++i], &slash, 10);
+      if(*slash == '/') g_admit.burst = atoi(slash + 1);
+    } else if(strcmp(argv[i], "-H")==0 && i+1<argc) {
+      g_http.port = (uint16_t)atoi(argv[++i]);
+    } else if(strcmp(argv[i], "-R")==0 && i+1<argc) {
+      if(http_add_root(argv[++i]) < 0) klog_printf("sshsvr: too many roots, %s ignored\n", argv[i]);
     } else if(strcmp(argv[i], "-h")==0 || strcmp(argv[i], "--help")==0) {
       usage(argv[0]);
       return 0;
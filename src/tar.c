@@ -0,0 +1,472 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tar.h"
+#include "bw.h"
+#include "session.h"
+#include "util.h"
+
+typedef struct tar_hdr {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char type;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} tar_hdr_t;
+
+static const char g_zero[2 * TAR_BLOCK];
+
+/* ---- header fields ---- */
+
+/* Octal with a NUL, or GNU base-256 when the value needs more digits. */
+static void put_num(char* f, size_t len, uint64_t v) {
+  if(v >> (3 * (len - 1))) {
+    memset(f, 0, len);
+    f[0] = (char)0x80;
+    for(size_t i=len-1; i>0 && v; i--, v >>= 8) f[i] = (char)(v & 0xff);
+    return;
+  }
+  snprintf(f, len, "%0*llo", (int)len - 1, (unsigned long long)v);
+}
+
+static uint64_t get_num(const char* f, size_t len) {
+  uint64_t v = 0;
+  size_t i = 0;
+  if((unsigned char)f[0] & 0x80) {
+    for(i=1;i<len;i++) v = v << 8 | (unsigned char)f[i];
+    return v;
+  }
+  while(i < len && f[i] == ' ') i++;
+  for(; i<len && f[i]>='0' && f[i]<='7'; i++) v = v * 8 + (uint64_t)(f[i] - '0');
+  return v;
+}
+
+/* Sum of the header bytes, the checksum field counted as spaces. */
+static unsigned hdr_sum(const tar_hdr_t* h) {
+  const unsigned char* p = (const unsigned char*)h;
+  size_t cs = offsetof(tar_hdr_t, chksum);
+  unsigned sum = 0;
+  for(size_t i=0;i<TAR_BLOCK;i++)
+    sum += i >= cs && i < cs + sizeof(h->chksum) ? ' ' : p[i];
+  return sum;
+}
+
+/* ---- send ---- */
+
+static void emit(xfer_out_t* o, tar_stats_t* ts, const void* p, size_t n) {
+  xfer_out_write(o, p, n);
+  ts->xs.bytes += n;
+}
+
+static void emit_pad(xfer_out_t* o, tar_stats_t* ts, uint64_t size) {
+  size_t r = (size_t)(size % TAR_BLOCK);
+  if(r) emit(o, ts, g_zero, TAR_BLOCK - r);
+}
+
+static void emit_hdr(xfer_out_t* o, tar_stats_t* ts, const char* name, char type,
+                     const struct stat* sb, uint64_t size, const char* link);
+
+/* GNU long name ('L') or link target ('K') for the entry that follows. */
+static void emit_long(xfer_out_t* o, tar_stats_t* ts, char type, const char* s) {
+  size_t n = strlen(s) + 1;
+  emit_hdr(o, ts, "././@LongLink", type, NULL, n, NULL);
+  emit(o, ts, s, n);
+  emit_pad(o, ts, n);
+}
+
+static void emit_hdr(xfer_out_t* o, tar_stats_t* ts, const char* name, char type,
+                     const struct stat* sb, uint64_t size, const char* link) {
+  tar_hdr_t h;
+  size_t nl = strlen(name), ll = link ? strlen(link) : 0;
+  if(ll >= sizeof(h.linkname)) emit_long(o, ts, 'K', link);
+  if(nl >= sizeof(h.name)) emit_long(o, ts, 'L', name);
+  memset(&h, 0, sizeof(h));
+  memcpy(h.name, name, nl < sizeof(h.name) ? nl : sizeof(h.name));
+  put_num(h.mode, sizeof(h.mode), sb ? sb->st_mode & 07777 : 0644);
+  put_num(h.uid, sizeof(h.uid), 0);
+  put_num(h.gid, sizeof(h.gid), 0);
+  put_num(h.size, sizeof(h.size), size);
+  put_num(h.mtime, sizeof(h.mtime), sb ? (uint64_t)sb->st_mtime : 0);
+  h.type = type;
+  if(link) memcpy(h.linkname, link, ll < sizeof(h.linkname) ? ll : sizeof(h.linkname));
+  memcpy(h.magic, "ustar", 6);
+  memcpy(h.version, "00", 2);
+  snprintf(h.chksum, sizeof(h.chksum), "%06o", hdr_sum(&h));
+  h.chksum[7] = ' ';
+  emit(o, ts, &h, TAR_BLOCK);
+}
+
+/* Read size bytes of fd straight into the output buffers. A file that
+ * shrank meanwhile is padded with zeros to the size in its header. */
+static void emit_file(xfer_out_t* o, tar_stats_t* ts, int fd, uint64_t size) {
+  for(uint64_t left = size; left; ) {
+    size_t room;
+    char* b = xfer_out_room(o, &room);
+    size_t want = left < room ? (size_t)left : room;
+    ssize_t n = fd >= 0 ? read(fd, b, want) : 0;
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) {
+      fd = -1;
+      memset(b, 0, want);
+      n = (ssize_t)want;
+    }
+    xfer_out_advance(o, (size_t)n);
+    left -= (uint64_t)n;
+  }
+  ts->xs.bytes += size;
+  emit_pad(o, ts, size);
+}
+
+typedef struct level {
+  DIR*   d;
+  size_t len;     // of the relative path up to this directory
+} level_t;
+
+int tar_send(int fd, tar_stats_t* ts) {
+  memset(ts, 0, sizeof(*ts));
+  xfer_begin(&ts->xs);
+  DIR* root = fdopendir(fd);
+  xfer_out_t* o = root ? xfer_out_open() : NULL;
+  if(!o) {
+    if(root) closedir(root);
+    else close(fd);
+    return -1;
+  }
+  level_t stack[TAR_MAX_DEPTH];
+  char path[PATH_MAX];
+  int depth = 0;
+  stack[0] = (level_t){ root, 0 };
+  while(depth >= 0 && !xfer_out_failed(o)) {
+    level_t* lv = &stack[depth];
+    struct dirent* e = readdir(lv->d);
+    if(!e) {
+      closedir(lv->d);
+      depth--;
+      continue;
+    }
+    if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+    size_t nl = strlen(e->d_name);
+    if(lv->len + nl + 2 > sizeof(path)) { ts->skipped++; continue; }
+    memcpy(path + lv->len, e->d_name, nl + 1);
+    int dfd = dirfd(lv->d);
+    struct stat sb;
+    if(fstatat(dfd, e->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) { ts->skipped++; continue; }
+    if(S_ISDIR(sb.st_mode)) {
+      int cfd = depth + 1 < TAR_MAX_DEPTH ? openat(dfd, e->d_name, O_RDONLY|O_DIRECTORY) : -1;
+      DIR* cd = cfd >= 0 ? fdopendir(cfd) : NULL;
+      if(!cd) {
+        if(cfd >= 0) close(cfd);
+        ts->skipped++;
+        continue;
+      }
+      path[lv->len + nl] = '/';
+      path[lv->len + nl + 1] = 0;
+      emit_hdr(o, ts, path, '5', &sb, 0, NULL);
+      ts->dirs++;
+      stack[++depth] = (level_t){ cd, lv->len + nl + 1 };
+    } else if(S_ISREG(sb.st_mode)) {
+      int fd = openat(dfd, e->d_name, O_RDONLY);
+      if(fd < 0) { ts->skipped++; continue; }
+      emit_hdr(o, ts, path, '0', &sb, (uint64_t)sb.st_size, NULL);
+      emit_file(o, ts, fd, (uint64_t)sb.st_size);
+      close(fd);
+      ts->files++;
+    } else if(S_ISLNK(sb.st_mode)) {
+      char link[PATH_MAX];
+      ssize_t n = readlinkat(dfd, e->d_name, link, sizeof(link) - 1);
+      if(n < 0) { ts->skipped++; continue; }
+      link[n] = 0;
+      emit_hdr(o, ts, path, '2', &sb, 0, link);
+      ts->links++;
+    } else {
+      ts->skipped++;   // devices, fifos, sockets
+    }
+  }
+  int cut = depth >= 0;
+  for(; depth >= 0; depth--) closedir(stack[depth].d);
+  if(!cut) {
+    emit(o, ts, g_zero, sizeof(g_zero));
+    while(ts->xs.bytes % TAR_RECORD) emit(o, ts, g_zero, TAR_BLOCK);
+  }
+  int rc = xfer_out_close(o) < 0 || cut ? -1 : 0;
+  xfer_end(&ts->xs);
+  return rc;
+}
+
+/* ---- receive ---- */
+
+typedef struct tar_in {
+  uint64_t size;   // stream length, UINT64_MAX if unknown
+  uint64_t used;
+  char*    buf;
+} tar_in_t;
+
+#define TAR_IN_BUF (64 * 1024)
+
+/* 0, -1 if the connection ended, -2 if n would run past the stream. */
+static int in_read(tar_in_t* in, void* p, size_t n) {
+  if(in->size != UINT64_MAX && n > in->size - in->used) return -2;
+  if(xfer_read_exact(p, n) < 0) return -1;
+  in->used += n;
+  bw_io(n);
+  return 0;
+}
+
+/* n bytes of entry data into fd, or dropped if fd < 0. Big files go through
+ * xfer_recv() so the disk writes overlap the network reads. Returns 1 if a
+ * write failed (the data is consumed anyway), or in_read()'s errors. */
+static int in_data(tar_in_t* in, int fd, uint64_t n) {
+  if(in->size != UINT64_MAX && n > in->size - in->used) return -2;
+  if(fd >= 0 && n >= XFER_BUF_SIZE) {
+    xfer_stats_t st;
+    const char* err;
+    memset(&st, 0, sizeof(st));
+    int rc = xfer_recv(fd, 0, n, XFER_PLAIN, NULL, NULL, &st, &err);
+    in->used += st.bytes;
+    if(st.bytes != n) return -1;
+    return rc < 0 ? 1 : 0;
+  }
+  int werr = 0;
+  while(n) {
+    ssize_t r = session_stdin_read(in->buf, n < TAR_IN_BUF ? (size_t)n : TAR_IN_BUF);
+    if(r <= 0) return -1;
+    in->used += (uint64_t)r;
+    n -= (uint64_t)r;
+    bw_io((uint64_t)r);
+    if(fd >= 0 && !werr && safe_write(fd, in->buf, (size_t)r) != r) werr = 1;
+  }
+  return werr;
+}
+
+/* Like mkdir -p; the last component gets mode. */
+static int make_path(char* path, mode_t mode) {
+  for(char* c = path + 1; *c; c++) {
+    if(*c != '/') continue;
+    *c = 0;
+    int rc = mkdir(path, 0755);
+    *c = '/';
+    if(rc < 0 && errno != EEXIST) return -1;
+  }
+  if(mkdir(path, mode) < 0 && errno != EEXIST) return -1;
+  return 0;
+}
+
+/* The directory holding rel in the tree open as root, made as needed, with
+ * *leaf set to rel's last component. Components are opened one at a time
+ * with O_NOFOLLOW, so nothing is written through a symlink, whether the tree
+ * had it or an earlier entry of the archive created it. -1 if a component
+ * cannot be made or is not a directory. */
+static int open_parent(int root, char* rel, char** leaf) {
+  int dfd = dup(root);
+  char* c = rel;
+  for(char* slash; dfd >= 0 && (slash = strchr(c, '/')); c = slash + 1) {
+    *slash = 0;
+    if(*c && strcmp(c, ".")) {
+      int next = -1;
+      if(mkdirat(dfd, c, 0755) == 0 || errno == EEXIST)
+        next = openat(dfd, c, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+      close(dfd);
+      dfd = next;
+    }
+    *slash = '/';
+  }
+  *leaf = c;
+  return dfd;
+}
+
+/* A directory entry: made, or already there as a real directory. */
+static int make_dir(int dfd, const char* leaf, mode_t mode) {
+  struct stat st;
+  if(mkdirat(dfd, leaf, mode) == 0) return 0;
+  if(errno != EEXIST) return -1;
+  return fstatat(dfd, leaf, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode) ? 0 : -1;
+}
+
+/* A file entry, replacing a symlink of the same name rather than following it. */
+static int open_file(int dfd, const char* leaf, mode_t mode) {
+  int fd = openat(dfd, leaf, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, mode);
+  if(fd < 0 && (errno == ELOOP || errno == EMLINK) && unlinkat(dfd, leaf, 0) == 0)
+    fd = openat(dfd, leaf, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW, mode);
+  return fd;
+}
+
+/* name without "./" prefixes and trailing slashes; NULL if it is absolute or
+ * has a ".." component. */
+static char* safe_name(char* name) {
+  while(name[0] == '.' && name[1] == '/') name += 2;
+  if(name[0] == '/') return NULL;
+  for(const char* c = name; *c; ) {
+    const char* end = strchr(c, '/');
+    size_t n = end ? (size_t)(end - c) : strlen(c);
+    if(n == 2 && c[0] == '.' && c[1] == '.') return NULL;
+    c += n;
+    while(*c == '/') c++;
+  }
+  size_t n = strlen(name);
+  while(n && name[n - 1] == '/') name[--n] = 0;
+  return name;
+}
+
+/* pax extended header: "<len> <key>=<value>\n" records. */
+static void pax_parse(char* p, size_t n, char* path, char* link, uint64_t* size) {
+  while(n) {
+    char* end;
+    unsigned long len = strtoul(p, &end, 10);
+    if(!len || len > n || *end != ' ' || p[len - 1] != '\n') return;
+    p[len - 1] = 0;
+    char* eq = strchr(end + 1, '=');
+    if(eq) {
+      *eq = 0;
+      if(!strcmp(end + 1, "path")) snprintf(path, PATH_MAX, "%s", eq + 1);
+      else if(!strcmp(end + 1, "linkpath")) snprintf(link, PATH_MAX, "%s", eq + 1);
+      else if(!strcmp(end + 1, "size")) *size = strtoull(eq + 1, NULL, 10);
+    }
+    p += len;
+    n -= len;
+  }
+}
+
+static int is_zero(const void* p, size_t n) {
+  return !memcmp(p, g_zero, n);
+}
+
+int tar_recv(const char* dir, uint64_t size, tar_stats_t* ts, const char** err) {
+  memset(ts, 0, sizeof(*ts));
+  xfer_begin(&ts->xs);
+  tar_in_t in = { size, 0, malloc(TAR_IN_BUF) };
+  char* full = malloc(PATH_MAX);
+  char* lname = malloc(PATH_MAX);     // from 'L' or pax, for the next entry
+  char* llink = malloc(PATH_MAX);
+  if(!in.buf || !full || !lname || !llink) {
+    free(in.buf); free(full); free(lname); free(llink);
+    *err = "out of memory";
+    return -1;
+  }
+  snprintf(full, PATH_MAX, "%s", dir);
+  make_path(full, 0755);
+  int root = open(dir, O_RDONLY|O_DIRECTORY);   // -1: every entry is skipped
+  lname[0] = llink[0] = 0;
+  uint64_t xsize = UINT64_MAX;        // pax size for the next entry
+  int rc = 0, zeros = 0;
+  tar_hdr_t h;
+  while(zeros < 2) {
+    int r = in_read(&in, &h, TAR_BLOCK);
+    if(r < 0) {
+      *err = r == -1 ? "connection closed early" : "archive ends early";
+      rc = r;
+      break;
+    }
+    if(is_zero(&h, TAR_BLOCK)) { zeros++; continue; }
+    zeros = 0;
+    if(hdr_sum(&h) != get_num(h.chksum, sizeof(h.chksum))) {
+      *err = "bad header checksum";
+      rc = -2;   // no way to find the next header
+      break;
+    }
+    uint64_t esize = xsize != UINT64_MAX ? xsize : get_num(h.size, sizeof(h.size));
+    uint64_t pad = (TAR_BLOCK - esize % TAR_BLOCK) % TAR_BLOCK;
+    xsize = UINT64_MAX;
+    if(h.type == 'L' || h.type == 'K' || h.type == 'x') {
+      // metadata for the next entry, used when it fits
+      int fits = esize < TAR_IN_BUF;
+      r = fits ? in_read(&in, in.buf, (size_t)esize) : in_data(&in, -1, esize);
+      if(r == 0 && fits) {
+        in.buf[esize] = 0;
+        if(h.type == 'x') pax_parse(in.buf, (size_t)esize, lname, llink, &xsize);
+        else snprintf(h.type == 'L' ? lname : llink, PATH_MAX, "%s", in.buf);
+      }
+      if(r == 0) r = in_data(&in, -1, pad);
+      if(r < 0) {
+        *err = r == -1 ? "connection closed early" : "archive ends early";
+        rc = r;
+        break;
+      }
+      continue;
+    }
+    char name[sizeof(h.prefix) + 1 + sizeof(h.name) + 1];
+    if(!memcmp(h.magic, "ustar", 5) && h.prefix[0])
+      snprintf(name, sizeof(name), "%.*s/%.*s", (int)sizeof(h.prefix), h.prefix,
+               (int)sizeof(h.name), h.name);
+    else
+      snprintf(name, sizeof(name), "%.*s", (int)sizeof(h.name), h.name);
+    char* rel = safe_name(lname[0] ? lname : name);
+    char link[PATH_MAX];
+    if(llink[0]) snprintf(link, sizeof(link), "%s", llink);
+    else snprintf(link, sizeof(link), "%.*s", (int)sizeof(h.linkname), h.linkname);
+    mode_t mode = (mode_t)get_num(h.mode, sizeof(h.mode)) & 07777;
+    int fd = -1, dfd, ok = 0;
+    char* leaf;
+    if(rel && (!*rel || !strcmp(rel, "."))) {
+      ok = 1;   // the directory itself
+    } else if(rel && (dfd = open_parent(root, rel, &leaf)) >= 0) {
+      if(h.type == '5') {
+        ok = make_dir(dfd, leaf, mode | 0700) == 0;
+        if(ok) ts->dirs++;
+      } else if(h.type == '2') {
+        unlinkat(dfd, leaf, 0);
+        ok = symlinkat(link, dfd, leaf) == 0;
+        if(ok) ts->links++;
+      } else if(h.type == '0' || h.type == 0 || h.type == '7') {
+        fd = open_file(dfd, leaf, mode ? mode : 0644);
+        ok = fd >= 0;
+      }
+      close(dfd);
+    }
+    lname[0] = llink[0] = 0;
+    r = in_data(&in, fd, esize);
+    if(fd >= 0) {
+      if(r == 0) {
+        struct timespec tv[2] = { { 0, UTIME_OMIT }, { (time_t)get_num(h.mtime, sizeof(h.mtime)), 0 } };
+        futimens(fd, tv);
+      }
+      if(close(fd) < 0 && r == 0) r = 1;
+      if(r == 0) ts->files++;
+      else ok = 0;
+    }
+    if(r == 1) r = 0;
+    if(r == 0) r = in_data(&in, -1, pad);
+    if(r < 0) {
+      *err = r == -1 ? "connection closed early" : "archive ends early";
+      rc = r;
+      break;
+    }
+    if(!ok) ts->skipped++;
+  }
+  // the rest of the last record, or with a known length all of the rest
+  uint64_t tail = size != UINT64_MAX ? size - in.used
+                : (TAR_RECORD - in.used % TAR_RECORD) % TAR_RECORD;
+  if(rc != -1 && in_data(&in, -1, tail) < 0) {
+    *err = "connection closed early";
+    rc = -1;
+  }
+  if(root >= 0) close(root);
+  free(in.buf);
+  free(full);
+  free(lname);
+  free(llink);
+  ts->xs.bytes = in.used;
+  xfer_end(&ts->xs);
+  // without a length the end of a broken stream cannot be found
+  if(rc == -2 && size == UINT64_MAX) return -2;
+  return rc < 0 ? -1 : 0;
+}
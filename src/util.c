@@ -1,5 +1,8 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/syscall.h>
@@ -7,6 +10,7 @@
 #include <ps5/klog.h>
 
 #include "util.h"
+#include "outbuf.h"
 
 int set_proc_name(const char* name) {
   return syscall(SYS_thr_set_name, -1, name);
@@ -26,22 +30,6 @@ ssize_t safe_write(int fd, const void* buf, size_t len) {
   return (ssize_t)off;
 }
 
-ssize_t safe_read_line(int fd, char* buf, size_t maxlen) {
-  size_t i = 0; char c;
-  while(i + 1 < maxlen) {
-    ssize_t r = read(fd, &c, 1);
-    if(r == 0) break;
-    if(r < 0) {
-      if(errno == EINTR) continue; else return -1;
-    }
-    if(c == '\r') continue; // ignore CR
-    if(c == '\n') break;
-    buf[i++] = c;
-  }
-  buf[i] = 0;
-  return (ssize_t)i;
-}
-
 int copy_to_fd(int dst_fd, int src_fd) {
   char b[1024];
   ssize_t r;
@@ -50,3 +38,36 @@ int copy_to_fd(int dst_fd, int src_fd) {
   }
   return r < 0 ? -1 : 0;
 }
+
+int set_nonblock(int fd, int on) {
+  int fl = fcntl(fd, F_GETFL, 0);
+  if(fl < 0) return -1;
+  fl = on ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK);
+  return fcntl(fd, F_SETFL, fl);
+}
+
+int sshsvr_dprintf(int fd, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  outbuf_t* o = fd == 1 || fd == 2 ? stdout_buf() : NULL;
+  if(o) {
+    int n = out_vprintf(o, fmt, ap);
+    va_end(ap);
+    return n;
+  }
+  char sbuf[1024];
+  char* buf = sbuf;
+  va_list cp;
+  va_copy(cp, ap);
+  int n = vsnprintf(sbuf, sizeof(sbuf), fmt, ap);
+  va_end(ap);
+  if(n >= (int)sizeof(sbuf)) {
+    buf = malloc((size_t)n + 1);
+    if(buf) vsnprintf(buf, (size_t)n + 1, fmt, cp);
+  }
+  va_end(cp);
+  if(n < 0 || !buf) return -1;
+  ssize_t w = safe_write(fd, buf, (size_t)n);
+  if(buf != sbuf) free(buf);
+  return w < 0 ? -1 : n;
+}
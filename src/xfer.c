@@ -0,0 +1,850 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "xfer.h"
+#include "bw.h"
+#include "crc32c.h"
+#include "delta.h"
+#include "json.h"
+#include "lz.h"
+#include "outbuf.h"
+#include "session.h"
+#include "util.h"
+
+/* ---- statistics ---- */
+
+static double tv_secs(struct timeval tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double mono_secs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void xfer_begin(xfer_stats_t* st) {
+  memset(st, 0, sizeof(*st));
+  clock_gettime(CLOCK_MONOTONIC, &st->t0);
+  getrusage(RUSAGE_SELF, &st->ru0);
+}
+
+void xfer_end(xfer_stats_t* st) {
+  struct timespec t1;
+  struct rusage ru;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  getrusage(RUSAGE_SELF, &ru);
+  st->secs = (t1.tv_sec - st->t0.tv_sec) + (t1.tv_nsec - st->t0.tv_nsec) / 1e9;
+  st->cpu_secs = tv_secs(ru.ru_utime) - tv_secs(st->ru0.ru_utime) +
+                 tv_secs(ru.ru_stime) - tv_secs(st->ru0.ru_stime);
+}
+
+void xfer_report(const char* op, const char* path, const xfer_stats_t* st) {
+  if(session_machine()) {
+    json_begin("xfer");
+    json_str("op", op);
+    json_str("path", path);
+    json_int("bytes", (long long)st->bytes);
+    json_int("us", (long long)(st->secs * 1e6));
+    json_int("cpu_us", (long long)(st->cpu_secs * 1e6));
+    if(st->wire) {
+      json_int("wire", (long long)st->wire);
+      json_int("blocks", (long long)st->blocks);
+      json_int("packed", (long long)st->packed);
+      json_int("codec_us", (long long)(st->codec_secs * 1e6));
+    }
+    json_end();
+    return;
+  }
+  double secs = st->secs > 0 ? st->secs : 1e-9;
+  if(!st->wire) {
+    dprintf(1, "%s: %llu bytes in %.3f s, %.1f MB/s, cpu %.0f%%\n", op,
+            (unsigned long long)st->bytes, st->secs, st->bytes / secs / 1e6,
+            100.0 * st->cpu_secs / secs);
+    return;
+  }
+  dprintf(1, "%s: %llu bytes in %.3f s, %.1f MB/s, cpu %.0f%%, wire %llu (%.2fx), "
+             "%llu/%llu blocks packed, codec %.3f s\n", op,
+          (unsigned long long)st->bytes, st->secs, st->bytes / secs / 1e6,
+          100.0 * st->cpu_secs / secs, (unsigned long long)st->wire,
+          (double)st->bytes / st->wire, (unsigned long long)st->packed,
+          (unsigned long long)st->blocks, st->codec_secs);
+}
+
+/* ---- digests ---- */
+
+static int is_hex(const char* s, size_t n) {
+  if(strlen(s) != n) return 0;
+  for(size_t i=0;i<n;i++)
+    if(!((s[i]>='0' && s[i]<='9') || (s[i]>='a' && s[i]<='f') || (s[i]>='A' && s[i]<='F')))
+      return 0;
+  return 1;
+}
+
+int xfer_digest_init(xfer_digest_t* d, int sha, const char* expect) {
+  memset(d, 0, sizeof(*d));
+  if(expect && !is_hex(expect, 8) && !is_hex(expect, 2 * SHA256_LEN)) return -1;
+  d->expect = expect;
+  d->sha = sha || (expect && strlen(expect) > 8);
+  if(d->sha) sha256_init(&d->sha256);
+  return 0;
+}
+
+void xfer_digest_update(xfer_digest_t* d, const void* data, size_t len) {
+  d->crc = crc32c(d->crc, data, len);
+  if(d->sha) sha256_update(&d->sha256, data, len);
+  d->bytes += len;
+}
+
+int xfer_digest_report(xfer_digest_t* d, const char* path) {
+  char crc[9], sha[2 * SHA256_LEN + 1] = "";
+  snprintf(crc, sizeof(crc), "%08x", d->crc);
+  if(d->sha) {
+    unsigned char h[SHA256_LEN];
+    sha256_final(&d->sha256, h);
+    for(int i=0;i<SHA256_LEN;i++) snprintf(sha + 2 * i, 3, "%02x", h[i]);
+  }
+  int match = !d->expect || !strcasecmp(d->expect, strlen(d->expect) == 8 ? crc : sha);
+  if(session_machine()) {
+    json_begin("digest");
+    json_str("path", path);
+    json_int("bytes", (long long)d->bytes);
+    json_str("crc32c", crc);
+    if(d->sha) json_str("sha256", sha);
+    if(d->expect) json_bool("match", match);
+    json_end();
+  } else {
+    dprintf(1, "crc32c %s%s%s %llu %s%s\n", crc, d->sha ? " sha256 " : "", sha,
+            (unsigned long long)d->bytes, path,
+            !d->expect ? "" : match ? " ok" : " MISMATCH");
+  }
+  return match ? 0 : -1;
+}
+
+/* ---- resume checkpoints ---- */
+
+void xfer_ckpt_open(xfer_ckpt_t* c, const char* dest, int data_fd, uint64_t base) {
+  memset(c, 0, sizeof(*c));
+  c->data_fd = data_fd;
+  c->base = base;
+  snprintf(c->path, sizeof(c->path), "%s.part", dest);
+  c->fd = open(c->path, O_WRONLY|O_CREAT, 0644);
+  if(c->fd >= 0) {
+    // the starting offset is valid right away
+    char line[24];
+    int n = snprintf(line, sizeof(line), "%020llu\n", (unsigned long long)base);
+    (void)!pwrite(c->fd, line, (size_t)n, 0);
+  }
+}
+
+static void ckpt_save(xfer_ckpt_t* c) {
+  if(c->fd < 0) return;
+  fsync(c->data_fd);   // never point past what is on disk
+  char line[24];
+  int n = snprintf(line, sizeof(line), "%020llu\n", (unsigned long long)(c->base + c->done));
+  (void)!pwrite(c->fd, line, (size_t)n, 0);
+  c->saved = c->done;
+}
+
+void xfer_ckpt_advance(xfer_ckpt_t* c, uint64_t n) {
+  c->done += n;
+  if(c->done - c->saved >= XFER_CKPT_EVERY) ckpt_save(c);
+}
+
+void xfer_ckpt_close(xfer_ckpt_t* c, int complete) {
+  if(c->fd < 0) return;
+  if(complete) unlink(c->path);
+  else ckpt_save(c);
+  close(c->fd);
+  c->fd = -1;
+}
+
+int xfer_ckpt_read(const char* dest, uint64_t* off) {
+  char path[PATH_MAX], line[24];
+  snprintf(path, sizeof(path), "%s.part", dest);
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return -1;
+  ssize_t n = read(fd, line, sizeof(line) - 1);
+  close(fd);
+  if(n <= 0) return -1;
+  line[n] = 0;
+  *off = strtoull(line, NULL, 10);
+  return 0;
+}
+
+/* ---- write-behind ---- */
+
+/* Filled buffers are bufs[tail..head) modulo XFER_NBUFS. The receiver fills
+ * bufs[head] while the writer drains bufs[tail]; each waits on the other
+ * only when the ring is full or empty. */
+typedef struct write_behind {
+  int             fd;
+  uint64_t        pos;       // file offset of the next buffer
+  xfer_ckpt_t*    ck;
+  xfer_digest_t*  dg;
+  int             out;       // to stdout: WB_DIRECT or WB_BUFFERED, not fd
+  outbuf_t*       sink;      // the starting thread's stdout, for WB_BUFFERED
+  int             threaded;
+  pthread_t       thr;
+  pthread_mutex_t mu;
+  pthread_cond_t  cv;
+  char*           bufs[XFER_NBUFS];
+  size_t          len[XFER_NBUFS];
+  unsigned        head, tail;
+  int             done;
+  int             err;       // errno of the first failed write, data discarded after
+  int             have;      // receiver holds bufs[head]
+  size_t          fill;
+} write_behind_t;
+
+enum { WB_FILE, WB_DIRECT, WB_BUFFERED };
+
+static int write_at(int fd, const char* p, size_t n, uint64_t pos) {
+  while(n) {
+    ssize_t w = pwrite(fd, p, n, (off_t)pos);
+    if(w < 0 && errno == EINTR) continue;
+    if(w < 0 && errno == ESPIPE) return safe_write(fd, p, n) == (ssize_t)n ? 0 : -1;
+    if(w <= 0) return -1;
+    p += w;
+    n -= (size_t)w;
+    pos += (uint64_t)w;
+  }
+  return 0;
+}
+
+static void wb_write(write_behind_t* wb, const char* p, size_t n) {
+  if(wb->err) return;
+  if(wb->dg) xfer_digest_update(wb->dg, p, n);
+  int rc = wb->out == WB_DIRECT ? (safe_write(1, p, n) == (ssize_t)n ? 0 : -1)
+         : wb->out == WB_BUFFERED ? (stdout_write(p, n) == (ssize_t)n ? 0 : -1)
+         : write_at(wb->fd, p, n, wb->pos);
+  if(rc < 0) {
+    wb->err = errno ? errno : EIO;
+    return;
+  }
+  wb->pos += n;
+  if(wb->ck) xfer_ckpt_advance(wb->ck, n);
+}
+
+static void* wb_main(void* arg) {
+  write_behind_t* wb = arg;
+  stdout_set(wb->sink);
+  pthread_mutex_lock(&wb->mu);
+  for(;;) {
+    while(wb->tail == wb->head && !wb->done) pthread_cond_wait(&wb->cv, &wb->mu);
+    if(wb->tail == wb->head) break;
+    unsigned i = wb->tail % XFER_NBUFS;
+    pthread_mutex_unlock(&wb->mu);
+    wb_write(wb, wb->bufs[i], wb->len[i]);
+    pthread_mutex_lock(&wb->mu);
+    wb->tail++;
+    pthread_cond_signal(&wb->cv);
+  }
+  pthread_mutex_unlock(&wb->mu);
+  return NULL;
+}
+
+static void wb_free(write_behind_t* wb) {
+  for(int i=0;i<XFER_NBUFS;i++) free(wb->bufs[i]);
+}
+
+static int wb_start(write_behind_t* wb, int fd, uint64_t off, xfer_ckpt_t* ck,
+                    xfer_digest_t* dg) {
+  memset(wb, 0, sizeof(*wb));
+  wb->fd = fd;
+  wb->pos = off;
+  wb->ck = ck;
+  wb->dg = dg;
+  wb->sink = stdout_buf();
+  for(int i=0;i<XFER_NBUFS;i++) {
+    void* p;
+    if(posix_memalign(&p, XFER_ALIGN, XFER_BUF_SIZE) != 0) {
+      wb_free(wb);
+      return -1;
+    }
+    wb->bufs[i] = p;
+  }
+  pthread_mutex_init(&wb->mu, NULL);
+  pthread_cond_init(&wb->cv, NULL);
+  // without a thread the receiver writes each buffer itself
+  wb->threaded = pthread_create(&wb->thr, NULL, wb_main, wb) == 0;
+  return 0;
+}
+
+/* The buffer being filled, waiting for the writer to free one if needed. */
+static char* wb_cur(write_behind_t* wb) {
+  if(!wb->have) {
+    if(wb->threaded) {
+      pthread_mutex_lock(&wb->mu);
+      while(wb->head - wb->tail == XFER_NBUFS) pthread_cond_wait(&wb->cv, &wb->mu);
+      pthread_mutex_unlock(&wb->mu);
+    }
+    wb->have = 1;
+    wb->fill = 0;
+  }
+  return wb->bufs[wb->head % XFER_NBUFS];
+}
+
+static void wb_push(write_behind_t* wb) {
+  if(!wb->have || !wb->fill) return;
+  unsigned i = wb->head % XFER_NBUFS;
+  wb->have = 0;
+  if(!wb->threaded) {
+    wb_write(wb, wb->bufs[i], wb->fill);
+    return;
+  }
+  pthread_mutex_lock(&wb->mu);
+  wb->len[i] = wb->fill;
+  wb->head++;
+  pthread_cond_signal(&wb->cv);
+  pthread_mutex_unlock(&wb->mu);
+}
+
+static int wb_finish(write_behind_t* wb) {
+  wb_push(wb);
+  if(wb->threaded) {
+    pthread_mutex_lock(&wb->mu);
+    wb->done = 1;
+    pthread_cond_signal(&wb->cv);
+    pthread_mutex_unlock(&wb->mu);
+    pthread_join(wb->thr, NULL);
+  }
+  pthread_mutex_destroy(&wb->mu);
+  pthread_cond_destroy(&wb->cv);
+  wb_free(wb);
+  return wb->err;
+}
+
+/* ---- receive ---- */
+
+int xfer_read_exact(void* buf, size_t len) {
+  char* p = buf;
+  while(len) {
+    ssize_t n = session_stdin_read(p, len);
+    if(n <= 0) return -1;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/* Read and drop n bytes of input. */
+static int skip_input(uint64_t n) {
+  char buf[16384];
+  while(n) {
+    size_t k = n < sizeof(buf) ? (size_t)n : sizeof(buf);
+    if(xfer_read_exact(buf, k) < 0) return -1;
+    bw_io(k);
+    n -= k;
+  }
+  return 0;
+}
+
+/* Move n bytes of input into the write-behind buffers. */
+static int recv_bytes(write_behind_t* wb, uint64_t n, xfer_stats_t* st) {
+  while(n) {
+    char* b = wb_cur(wb);
+    size_t room = XFER_BUF_SIZE - wb->fill;
+    size_t want = n < room ? (size_t)n : room;
+    ssize_t r = session_stdin_read(b + wb->fill, want);
+    if(r <= 0) return -1;
+    wb->fill += (size_t)r;
+    n -= (uint64_t)r;
+    st->bytes += (uint64_t)r;
+    if(wb->fill == XFER_BUF_SIZE) wb_push(wb);
+    bw_io((uint64_t)r);
+  }
+  return 0;
+}
+
+/* Compressed blocks are inflated straight into the write-behind buffers.
+ * After a corrupt block the rest of the stream is read and dropped; -2 if a
+ * header's length is beyond any block, so the stream's end is lost. */
+static int recv_lz(write_behind_t* wb, xfer_stats_t* st, const char** err) {
+  char* z = malloc(XFER_Z_BLOCK);
+  if(!z) { *err = "out of memory"; return -1; }
+  int rc = 0;
+  for(;;) {
+    uint32_t h[2];
+    if(xfer_read_exact(h, sizeof(h)) < 0) { *err = "connection closed early"; rc = -1; break; }
+    uint32_t raw = ntohl(h[0]), stored = ntohl(h[1]);
+    st->wire += sizeof(h);
+    if(!raw) break;
+    if(stored > XFER_Z_BLOCK) {
+      // no way to find the end of the stream after this
+      *err = "bad block header";
+      rc = -2;
+      break;
+    }
+    if(raw > XFER_Z_BLOCK || stored > raw) {
+      // the length still frames the block: drop it and read on
+      if(xfer_read_exact(z, stored) < 0) { *err = "connection closed early"; rc = -1; break; }
+      st->wire += stored;
+      bw_io(stored);
+      if(!rc) *err = "bad block header";
+      rc = -1;
+      continue;
+    }
+    st->wire += stored;
+    st->blocks++;
+    if(stored == raw && !rc) {
+      if(recv_bytes(wb, raw, st) < 0) { *err = "connection closed early"; rc = -1; break; }
+      continue;
+    }
+    if(xfer_read_exact(z, stored) < 0) { *err = "connection closed early"; rc = -1; break; }
+    bw_io(stored);
+    if(rc) continue;
+    char* b = wb_cur(wb);
+    if(XFER_BUF_SIZE - wb->fill < raw) {
+      wb_push(wb);
+      b = wb_cur(wb);
+    }
+    double t0 = mono_secs();
+    long n = lz_decompress(z, stored, b + wb->fill, raw);
+    st->codec_secs += mono_secs() - t0;
+    if(n != (long)raw) {
+      *err = "corrupt block";
+      rc = -1;
+      continue;
+    }
+    st->packed++;
+    st->bytes += raw;
+    wb->fill += raw;
+    if(wb->fill == XFER_BUF_SIZE) wb_push(wb);
+  }
+  free(z);
+  return rc;
+}
+
+int xfer_recv(int fd, uint64_t off, uint64_t size, int mode, xfer_ckpt_t* ck,
+              xfer_digest_t* dg, xfer_stats_t* st, const char** err) {
+  write_behind_t wb;
+  if(wb_start(&wb, fd, off, ck, dg) < 0) {
+    *err = "out of memory";
+    return -1;
+  }
+  int rc = 0;
+  if(mode == XFER_PLAIN) {
+    if(recv_bytes(&wb, size, st) < 0) { *err = "connection closed early"; rc = -1; }
+  } else if(mode == XFER_LZ) {
+    rc = recv_lz(&wb, st, err);
+  } else {
+    for(;;) {
+      uint32_t n;
+      if(xfer_read_exact(&n, sizeof(n)) < 0) { *err = "connection closed early"; rc = -1; break; }
+      n = ntohl(n);
+      if(!n) break;
+      if(recv_bytes(&wb, n, st) < 0) { *err = "connection closed early"; rc = -1; break; }
+    }
+  }
+  if(!rc && mode != XFER_PLAIN && size != UINT64_MAX && st->bytes != size) {
+    *err = "size mismatch";
+    rc = -1;
+  }
+  int werr = wb_finish(&wb);
+  if(werr && !rc) {
+    *err = strerror(werr);
+    rc = -1;
+  }
+  return rc;
+}
+
+/* ---- delta receive ---- */
+
+int xfer_recv_delta(int old, uint64_t old_size, uint32_t block, int fd,
+                    xfer_delta_t* d, xfer_digest_t* dg, xfer_stats_t* st,
+                    const char** err) {
+  write_behind_t wb;
+  memset(d, 0, sizeof(*d));
+  if(wb_start(&wb, fd, 0, NULL, dg) < 0) {
+    *err = "out of memory";
+    return -1;
+  }
+  uint64_t nblocks = (old_size + block - 1) / block;
+  uint64_t size = 0;
+  uint32_t crc = 0;
+  int rc = 0;
+  for(;;) {
+    unsigned char op;
+    uint32_t a[3];
+    if(xfer_read_exact(&op, 1) < 0) { *err = "connection closed early"; rc = -1; break; }
+    if(op != 'C' && op != 'L' && op != 'E') {
+      // no way to find the end of the stream after this
+      *err = "bad delta op";
+      rc = -2;
+      break;
+    }
+    size_t alen = op == 'E' ? 12 : op == 'C' ? 8 : 4;
+    if(xfer_read_exact(a, alen) < 0) { *err = "connection closed early"; rc = -1; break; }
+    d->wire += 1 + alen;
+    if(op == 'E') {
+      size = (uint64_t)ntohl(a[0]) << 32 | ntohl(a[1]);
+      crc = ntohl(a[2]);
+      break;
+    }
+    if(op == 'L') {
+      uint32_t n = ntohl(a[0]);
+      if(n > DELTA_MAX_LIT) {
+        // oversized, but its length still frames it
+        if(skip_input(n) < 0) { *err = "connection closed early"; rc = -1; break; }
+        d->wire += n;
+        if(!rc) *err = "bad delta op";
+        rc = -1;
+        continue;
+      }
+      if(recv_bytes(&wb, n, st) < 0) { *err = "connection closed early"; rc = -1; break; }
+      d->literal += n;
+      d->wire += n;
+      continue;
+    }
+    uint64_t first = ntohl(a[0]), count = ntohl(a[1]);
+    if(first + count > nblocks) {
+      if(!rc) *err = "block out of range";
+      rc = -1;
+    }
+    if(rc) continue;
+    uint64_t pos = first * block, end = (first + count) * block;
+    if(end > old_size) end = old_size;
+    d->matched += count;
+    while(pos < end) {
+      char* b = wb_cur(&wb);
+      size_t room = XFER_BUF_SIZE - wb.fill;
+      size_t want = end - pos < room ? (size_t)(end - pos) : room;
+      ssize_t n = pread(old, b + wb.fill, want, (off_t)pos);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) {
+        *err = n < 0 ? strerror(errno) : "file shrank";
+        rc = -1;
+        break;
+      }
+      wb.fill += (size_t)n;
+      pos += (uint64_t)n;
+      st->bytes += (uint64_t)n;
+      if(wb.fill == XFER_BUF_SIZE) wb_push(&wb);
+    }
+  }
+  int werr = wb_finish(&wb);
+  if(werr && !rc) {
+    *err = strerror(werr);
+    rc = -1;
+  }
+  if(!rc && (st->bytes != size || dg->crc != crc)) {
+    *err = st->bytes != size ? "size mismatch" : "crc32c mismatch";
+    rc = -1;
+  }
+  return rc;
+}
+
+/* ---- local copy ---- */
+
+#define XFER_COPY_CHUNK (64 * 1024 * 1024)   // per copy_file_range() call
+
+#if defined(__linux__) || (defined(__FreeBSD__) && __FreeBSD_version >= 1300000)
+/* In-kernel copy from st->bytes on. 1 if the kernel cannot copy between
+ * these files, which leaves the rest to the caller. */
+static int copy_kernel(int in, int out, xfer_stats_t* st, const char** err) {
+  for(;;) {
+    off_t ioff = (off_t)st->bytes, ooff = (off_t)st->bytes;
+    ssize_t n = copy_file_range(in, &ioff, out, &ooff, bw_chunk(XFER_COPY_CHUNK), 0);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && !st->bytes && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                               errno == EOPNOTSUPP || errno == EBADF))
+      return 1;
+    if(n < 0) { *err = strerror(errno); return -1; }
+    if(!n) return 0;
+    st->bytes += (uint64_t)n;
+    bw_io((uint64_t)n);
+  }
+}
+#endif
+
+static int copy_small(int in, int out, xfer_digest_t* dg, xfer_stats_t* st, const char** err) {
+  void* p;
+  if(posix_memalign(&p, XFER_ALIGN, XFER_BUF_SIZE) != 0) { *err = "out of memory"; return -1; }
+  char* buf = p;
+  int rc = 0;
+  for(;;) {
+    ssize_t n = pread(in, buf, XFER_BUF_SIZE, (off_t)st->bytes);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) { *err = strerror(errno); rc = -1; break; }
+    if(!n) break;
+    if(write_at(out, buf, (size_t)n, st->bytes) < 0) { *err = strerror(errno); rc = -1; break; }
+    if(dg) xfer_digest_update(dg, buf, (size_t)n);
+    st->bytes += (uint64_t)n;
+    bw_io((uint64_t)n);
+  }
+  free(buf);
+  return rc;
+}
+
+static int copy_buffered(int in, int out, xfer_digest_t* dg, xfer_stats_t* st, const char** err) {
+  write_behind_t wb;
+  if(wb_start(&wb, out, st->bytes, NULL, dg) < 0) { *err = "out of memory"; return -1; }
+  int rc = 0;
+  for(;;) {
+    char* b = wb_cur(&wb);
+    ssize_t n = pread(in, b + wb.fill, XFER_BUF_SIZE - wb.fill, (off_t)st->bytes);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) { *err = strerror(errno); rc = -1; break; }
+    if(!n) break;
+    wb.fill += (size_t)n;
+    st->bytes += (uint64_t)n;
+    if(wb.fill == XFER_BUF_SIZE) wb_push(&wb);
+    bw_io((uint64_t)n);
+  }
+  int werr = wb_finish(&wb);
+  if(werr && !rc) {
+    *err = strerror(werr);
+    rc = -1;
+  }
+  return rc;
+}
+
+int xfer_copy(int in, int out, uint64_t size, xfer_digest_t* dg, xfer_stats_t* st,
+              const char** err) {
+  // one extent up front instead of growing the file a buffer at a time;
+  // filesystems that cannot preallocate just skip it
+  if(size > XFER_BUF_SIZE) posix_fallocate(out, 0, (off_t)size);
+  posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+  int rc = 1;
+#if defined(__linux__) || (defined(__FreeBSD__) && __FreeBSD_version >= 1300000)
+  if(!dg) rc = copy_kernel(in, out, st, err);
+#endif
+  if(rc > 0)
+    rc = size <= XFER_BUF_SIZE ? copy_small(in, out, dg, st, err)
+                               : copy_buffered(in, out, dg, st, err);
+  // preallocation set the length to size: trim to what was copied
+  if(st->bytes != size && ftruncate(out, (off_t)st->bytes) < 0 && !rc) {
+    *err = strerror(errno);
+    rc = -1;
+  }
+  return rc;
+}
+
+/* ---- send ---- */
+
+#define XFER_SEND_CHUNK (16 * 1024 * 1024)   // per sendfile() call
+
+static int stdout_is_socket(void) {
+  struct stat sb;
+  return stdout_buf() == &g_stdout && g_stdout.fd == 1 && fstat(1, &sb) == 0 &&
+         S_ISSOCK(sb.st_mode);
+}
+
+#if defined(__FreeBSD__)
+static int send_zero_copy(int fd, uint64_t off, uint64_t len, xfer_stats_t* st) {
+  while(st->bytes < len) {
+    uint64_t left = len - st->bytes;
+    size_t chunk = bw_chunk(XFER_SEND_CHUNK);
+    off_t sent = 0;
+    int r = sendfile(fd, 1, (off_t)(off + st->bytes),
+                     left < chunk ? (size_t)left : chunk, NULL, &sent, 0);
+    st->bytes += (uint64_t)sent;
+    bw_io((uint64_t)sent);
+    if(r < 0) {
+      if(errno == EINTR || errno == EAGAIN) continue;
+      return -1;
+    }
+    if(!sent) break;   // end of file
+  }
+  return 0;
+}
+#endif
+
+static int send_blocks(int fd, uint64_t off, uint64_t len, xfer_digest_t* dg,
+                       xfer_stats_t* st, int direct) {
+  void* p;
+  if(posix_memalign(&p, XFER_ALIGN, XFER_BUF_SIZE) != 0) return -1;
+  char* buf = p;
+  int rc = 0;
+  while(st->bytes < len) {
+    uint64_t left = len - st->bytes;
+    ssize_t n = pread(fd, buf, left < XFER_BUF_SIZE ? (size_t)left : XFER_BUF_SIZE,
+                      (off_t)(off + st->bytes));
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) break;
+    if(dg) xfer_digest_update(dg, buf, (size_t)n);
+    ssize_t w = direct ? safe_write(1, buf, (size_t)n) : stdout_write(buf, (size_t)n);
+    if(w != n) { rc = -1; break; }
+    st->bytes += (uint64_t)n;
+    bw_io((uint64_t)n);
+  }
+  free(buf);
+  return rc;
+}
+
+int xfer_send(int fd, uint64_t off, uint64_t len, xfer_digest_t* dg, xfer_stats_t* st) {
+  if(!stdout_is_socket()) return send_blocks(fd, off, len, dg, st, 0);
+  // whatever is buffered goes first, then the file bypasses the buffer
+  stdout_flush();
+#if defined(__FreeBSD__)
+  if(!dg) return send_zero_copy(fd, off, len, st);
+#endif
+  return send_blocks(fd, off, len, dg, st, 1);
+}
+
+/* ---- compressed send ---- */
+
+#define Z_HDR 8   // raw and stored length
+
+/* Frame one block of n bytes at raw + Z_HDR (room for the header in front):
+ * compressed into out if a sample of the block shrinks by at least 1/8 and
+ * the whole block by at least 1/16, stored as is otherwise. Returns the
+ * frame to send and its size in *len. */
+static char* lz_frame(char* raw, size_t n, char* out, size_t* len, xfer_stats_t* st) {
+  uint32_t h[2] = { htonl((uint32_t)n), htonl((uint32_t)n) };
+  char sample[LZ_BOUND(XFER_Z_SAMPLE)];
+  const char* data = raw + Z_HDR;
+  char* frame = raw;
+  *len = n;
+  double t0 = mono_secs();
+  size_t sn = n < XFER_Z_SAMPLE ? n : XFER_Z_SAMPLE;
+  size_t sz = lz_compress(data + (n - sn) / 2, sn, sample, sn - sn / 8);
+  if(sz) {
+    size_t z = lz_compress(data, n, out + Z_HDR, n - n / 16);
+    if(z) {
+      h[1] = htonl((uint32_t)z);
+      frame = out;
+      *len = z;
+      st->packed++;
+    }
+  }
+  st->codec_secs += mono_secs() - t0;
+  st->blocks++;
+  memcpy(frame, h, Z_HDR);
+  *len += Z_HDR;
+  st->wire += *len;
+  return frame;
+}
+
+int xfer_send_lz(int fd, uint64_t off, uint64_t len, xfer_digest_t* dg, xfer_stats_t* st) {
+  int direct = stdout_is_socket();
+  if(direct) stdout_flush();
+  char* raw = malloc(Z_HDR + XFER_Z_BLOCK);
+  char* out = malloc(Z_HDR + LZ_BOUND(XFER_Z_BLOCK));
+  int rc = raw && out ? 0 : -1;
+  while(!rc && st->bytes < len) {
+    uint64_t left = len - st->bytes;
+    ssize_t n = pread(fd, raw + Z_HDR, left < XFER_Z_BLOCK ? (size_t)left : XFER_Z_BLOCK,
+                      (off_t)(off + st->bytes));
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) break;
+    if(dg) xfer_digest_update(dg, raw + Z_HDR, (size_t)n);
+    size_t flen;
+    const char* f = lz_frame(raw, (size_t)n, out, &flen, st);
+    ssize_t w = direct ? safe_write(1, f, flen) : stdout_write(f, flen);
+    if(w != (ssize_t)flen) rc = -1;
+    else st->bytes += (uint64_t)n;
+    bw_io(flen);
+  }
+  if(!rc) {
+    static const char end[Z_HDR];
+    st->wire += sizeof(end);
+    if((direct ? safe_write(1, end, sizeof(end)) : stdout_write(end, sizeof(end))) != sizeof(end))
+      rc = -1;
+  }
+  free(raw);
+  free(out);
+  return rc;
+}
+
+/* ---- generated output ---- */
+
+struct xfer_out {
+  write_behind_t wb;
+};
+
+xfer_out_t* xfer_out_open(void) {
+  xfer_out_t* o = malloc(sizeof(*o));
+  if(!o) return NULL;
+  int direct = stdout_is_socket();
+  if(direct) stdout_flush();
+  if(wb_start(&o->wb, 1, 0, NULL, NULL) < 0) {
+    free(o);
+    return NULL;
+  }
+  o->wb.out = direct ? WB_DIRECT : WB_BUFFERED;
+  return o;
+}
+
+char* xfer_out_room(xfer_out_t* o, size_t* room) {
+  char* b = wb_cur(&o->wb);
+  if(o->wb.fill == XFER_BUF_SIZE) {
+    wb_push(&o->wb);
+    b = wb_cur(&o->wb);
+  }
+  *room = XFER_BUF_SIZE - o->wb.fill;
+  return b + o->wb.fill;
+}
+
+void xfer_out_advance(xfer_out_t* o, size_t n) {
+  o->wb.fill += n;
+  if(o->wb.fill == XFER_BUF_SIZE) wb_push(&o->wb);
+  bw_io(n);
+}
+
+void xfer_out_write(xfer_out_t* o, const void* data, size_t n) {
+  const char* p = data;
+  while(n) {
+    size_t room;
+    char* b = xfer_out_room(o, &room);
+    size_t k = n < room ? n : room;
+    memcpy(b, p, k);
+    xfer_out_advance(o, k);
+    p += k;
+    n -= k;
+  }
+}
+
+int xfer_out_failed(xfer_out_t* o) {
+  pthread_mutex_lock(&o->wb.mu);
+  int err = o->wb.err;
+  pthread_mutex_unlock(&o->wb.mu);
+  return err != 0;
+}
+
+int xfer_out_close(xfer_out_t* o) {
+  int err = wb_finish(&o->wb);
+  free(o);
+  return err ? -1 : 0;
+}
+
+/* ---- signatures ---- */
+
+int xfer_send_sigs(int fd, uint64_t size, uint32_t block) {
+  size_t chunk = XFER_BUF_SIZE / block * block;
+  char* buf = malloc(chunk);
+  if(!buf) return -1;
+  int rc = 0;
+  for(uint64_t off = 0; off < size && !rc; ) {
+    uint64_t left = size - off;
+    size_t want = left < chunk ? (size_t)left : chunk;
+    ssize_t n = pread(fd, buf, want, (off_t)off);
+    if(n < 0 && errno == EINTR) continue;
+    // the count is promised: unreadable blocks are signed as zeros, and a
+    // copy of them fails when it reads the file
+    if(n < (ssize_t)want) memset(buf + (n > 0 ? n : 0), 0, want - (size_t)(n > 0 ? n : 0));
+    for(size_t i=0;i<want && !rc;i+=block) {
+      size_t bl = want - i < block ? want - i : block;
+      unsigned char sig[DELTA_SIG_SIZE];
+      uint32_t weak = htonl(delta_weak(buf + i, bl));
+      memcpy(sig, &weak, 4);
+      delta_strong(buf + i, bl, sig + 4);
+      if(stdout_write(sig, sizeof(sig)) != sizeof(sig)) rc = -1;
+    }
+    off += want;
+  }
+  free(buf);
+  return rc;
+}
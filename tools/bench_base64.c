@@ -0,0 +1,153 @@
+/* Base64 microbenchmark: the old one-group-at-a-time codec versus each
+ * kernel in src/base64.c this CPU can run, on line-sized (get/put) and
+ * MB-sized blocks. Every kernel is checked against the old codec first,
+ * including rejection of a bad character at each position.
+ * Host build: make bench-base64 && ./tools/bench_base64 [MiB]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "base64.h"
+
+/* ---- legacy codec, as it was in src/base64.c ---- */
+
+static const char b64_tab[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static int legacy_encode(const unsigned char* in, int inlen, char* out) {
+  int olen = 0;
+  for(int i=0;i<inlen;i+=3) {
+    unsigned v = in[i] << 16;
+    if(i+1<inlen) v |= in[i+1] << 8;
+    if(i+2<inlen) v |= in[i+2];
+    out[olen++] = b64_tab[(v >> 18) & 0x3F];
+    out[olen++] = b64_tab[(v >> 12) & 0x3F];
+    out[olen++] = (i+1<inlen) ? b64_tab[(v >> 6) & 0x3F] : '=';
+    out[olen++] = (i+2<inlen) ? b64_tab[v & 0x3F] : '=';
+  }
+  return olen;
+}
+
+static int b64_rev(char c) {
+  if(c>='A'&&c<='Z') return c-'A';
+  if(c>='a'&&c<='z') return c-'a'+26;
+  if(c>='0'&&c<='9') return c-'0'+52;
+  if(c=='+') return 62;
+  if(c=='/') return 63;
+  if(c=='=') return -2;
+  return -1;
+}
+
+static int legacy_decode(const char* in, int inlen, unsigned char* out) {
+  if(inlen % 4) return -1;
+  int olen=0;
+  for(int i=0;i<inlen;i+=4) {
+    int a=b64_rev(in[i]), b=b64_rev(in[i+1]), c=b64_rev(in[i+2]), d=b64_rev(in[i+3]);
+    if(a<0||b<0||c<-2||d<-2) return -1;
+    unsigned v=(a<<18)|(b<<12)|((c<0?0:c)<<6)|(d<0?0:d);
+    out[olen++] = (v>>16)&0xFF;
+    if(c!=-2) out[olen++] = (v>>8)&0xFF;
+    if(d!=-2) out[olen++] = v&0xFF;
+  }
+  return olen;
+}
+
+/* ---- checks ---- */
+
+static int check(const unsigned char* data) {
+  static char enc[8192], ref[8192];
+  static unsigned char dec[8192];
+  for(int n=0;n<=3072;n += n < 100 ? 1 : 37) {
+    int el = b64_encode_block(data, n, enc);
+    if(el != legacy_encode(data, n, ref) || memcmp(enc, ref, (size_t)el)) return -1;
+    if(b64_decode_block(enc, el, dec) != n || memcmp(dec, data, (size_t)n)) return -1;
+  }
+  // one bad character at each position of a 4096-character line
+  int el = b64_encode_block(data, 3072, enc);
+  for(int i=0;i<el;i++) {
+    char c = enc[i];
+    enc[i] = (char)(i % 3 == 0 ? '*' : i % 3 == 1 ? '\n' : 0x80 | i);
+    int rc = b64_decode_block(enc, el, dec);
+    enc[i] = '=';
+    int rc2 = b64_decode_block(enc, el, dec);   // padding inside the data
+    enc[i] = c;
+    if(rc != -1 || (i < el - 1 && rc2 != -1)) return -1;
+  }
+  return 0;
+}
+
+/* ---- driver ---- */
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t g_size;
+static unsigned char* g_data;
+static char* g_text;
+static unsigned char* g_back;
+
+static void run(const char* name,
+                int (*enc)(const unsigned char*, int, char*),
+                int (*dec)(const char*, int, unsigned char*), size_t block) {
+  int reps = 0;
+  double t0 = now_s(), te;
+  do {
+    for(size_t off=0; off<g_size; off+=block) {
+      size_t n = g_size - off < block ? g_size - off : block;
+      enc(g_data + off, (int)n, g_text + off / 3 * 4);
+    }
+    reps++;
+  } while((te = now_s() - t0) < 0.3);
+  double enc_mbs = reps * g_size / te / 1e6;
+  reps = 0;
+  long bad = 0;
+  t0 = now_s();
+  double td;
+  size_t tblock = block / 3 * 4;
+  do {
+    for(size_t off=0; off<g_size / 3 * 4; off+=tblock) {
+      size_t n = g_size / 3 * 4 - off < tblock ? g_size / 3 * 4 - off : tblock;
+      if(dec(g_text + off, (int)n, g_back + off / 4 * 3) < 0) bad++;
+    }
+    reps++;
+  } while((td = now_s() - t0) < 0.3);
+  double dec_mbs = reps * g_size / td / 1e6;
+  printf("%-8s %8zu %10.1f %10.1f%s\n", name, block, enc_mbs, dec_mbs,
+         bad || memcmp(g_back, g_data, g_size) ? "  MISMATCH" : "");
+}
+
+int main(int argc, char** argv) {
+  int mib = argc > 1 ? atoi(argv[1]) : 8;
+  if(mib <= 0) mib = 1;
+  g_size = (size_t)mib * 1024 * 1024 / 3 * 3;   // no padding inside the stream
+  g_data = malloc(g_size);
+  g_text = malloc(g_size / 3 * 4);
+  g_back = malloc(g_size);
+  if(!g_data || !g_text || !g_back) return 1;
+  srand(1);
+  for(size_t i=0;i<g_size;i++) g_data[i] = (unsigned char)rand();
+
+  static const char* kernels[] = { "scalar", "sse4", "avx2" };
+  const char* best = b64_kernel();
+  printf("default kernel: %s, %zu bytes per run\n", best, g_size);
+  printf("%-8s %8s %10s %10s\n", "kernel", "block", "enc MB/s", "dec MB/s");
+  size_t blocks[] = { 3072, 1024 * 1024 / 3 * 3 };
+  for(int b=0;b<2;b++) {
+    run("legacy", legacy_encode, legacy_decode, blocks[b]);
+    for(int k=0;k<3;k++) {
+      if(b64_set_kernel(kernels[k]) < 0) continue;
+      if(check(g_data) < 0) {
+        printf("%-8s FAILED self-check\n", kernels[k]);
+        return 1;
+      }
+      run(kernels[k], b64_encode_block, b64_decode_block, blocks[b]);
+    }
+  }
+  b64_set_kernel(best);
+  return 0;
+}
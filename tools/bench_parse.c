@@ -0,0 +1,171 @@
+/* Command line parse microbenchmark: the old strdup()-per-token tokenizer
+ * plus build_pipeline() versus the in-place parser in src/parse.c.
+ * Host build: make bench-parse && ./tools/bench_parse [iterations]
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parse.h"
+
+#define MAX_TOKS 256
+#define MAX_PIPE 16
+
+static unsigned long g_allocs;
+
+static void* counted_malloc(size_t n) { g_allocs++; return malloc(n); }
+static char* counted_strdup(const char* s) { g_allocs++; return strdup(s); }
+
+/* ---- legacy parser, as it was in src/session.c ---- */
+
+typedef struct {
+  char** argv;
+  int argc;
+  int is_builtin;
+} legacy_cmd_t;
+
+static char* trim(char* s) {
+  while(isspace((unsigned char)*s)) s++;
+  char* e = s + strlen(s);
+  while(e>s && isspace((unsigned char)e[-1])) e--;
+  *e=0;
+  return s;
+}
+
+static int tokenize(char* line, char** toks) {
+  int ntok=0;
+  char* p=line;
+  while(*p) {
+    while(isspace((unsigned char)*p)) p++;
+    if(!*p) break;
+    if(*p=='|' || *p=='>' ) {
+      if(ntok<MAX_TOKS) {
+        if(*p=='>' && p[1]=='>') {
+          toks[ntok++]=counted_strdup(">>");
+          p+=2;
+          continue;
+        }
+        char sym[2]={*p,0};
+        toks[ntok++]=counted_strdup(sym);
+        p++;
+      } else break;
+      continue;
+    }
+    char* start=p;
+    int inq=0;
+    while(*p && (inq || (!isspace((unsigned char)*p) && *p!='|' && *p!='>'))) {
+      if(*p=='"') inq=!inq;
+      p++;
+    }
+    size_t len = p-start;
+    char* t = counted_malloc(len+1);
+    memcpy(t,start,len);
+    t[len]=0;
+    if(t[0]=='"' && t[len-1]=='"' && len>=2) {
+      t[len-1]=0;
+      memmove(t,t+1,len-1);
+    }
+    if(ntok<MAX_TOKS) toks[ntok++]=t;
+  }
+  toks[ntok]=NULL;
+  return ntok;
+}
+
+static int build_pipeline(char** toks, int ntok, legacy_cmd_t* cmds, int* ncmds,
+                          char** redir_file, int* append_mode) {
+  int ci=0;
+  int i=0;
+  while(i<ntok) {
+    if(ci>=MAX_PIPE) return -1;
+    cmds[ci].argv = counted_malloc(sizeof(char*)*(MAX_TOKS));
+    cmds[ci].argc = 0;
+    cmds[ci].is_builtin = 0;
+    while(i<ntok) {
+      if(strcmp(toks[i],"|")==0) { i++; break; }
+      if(strcmp(toks[i],">")==0 || strcmp(toks[i],">>")==0) {
+        *append_mode = (toks[i][1]=='>');
+        i++;
+        if(i>=ntok) return -1;
+        *redir_file = counted_strdup(toks[i]);
+        i++;
+        break;
+      }
+      cmds[ci].argv[cmds[ci].argc++] = counted_strdup(toks[i]);
+      i++;
+    }
+    if(cmds[ci].argc==0) continue;
+    cmds[ci].argv[cmds[ci].argc]=NULL;
+    ci++;
+  }
+  *ncmds = ci;
+  return 0;
+}
+
+static int legacy_parse(char* line) {
+  char* toks[MAX_TOKS+1];
+  char* ln = trim(line);
+  int ntok = tokenize(ln, toks);
+  legacy_cmd_t cmds[MAX_PIPE];
+  int ncmds=0, append=0;
+  char* redir=NULL;
+  int rc = build_pipeline(toks, ntok, cmds, &ncmds, &redir, &append);
+  int argc = ncmds ? cmds[0].argc : 0;
+  for(int i=0;i<ncmds;i++) {
+    for(int j=0;j<cmds[i].argc;j++) free(cmds[i].argv[j]);
+    free(cmds[i].argv);
+  }
+  free(redir);
+  for(int i=0;i<ntok;i++) free(toks[i]);
+  return rc < 0 ? -1 : argc;
+}
+
+static int arena_parse(char* line) {
+  cmdline_t cl;
+  if(parse_line(line, &cl) < 0) return -1;
+  return cl.ncmds ? cl.cmds[0].argc : 0;
+}
+
+/* ---- driver ---- */
+
+static const char* g_lines[] = {
+  "ls -l /mnt/usb0",
+  "cd /data/homebrew",
+  "cat /data/logs/install.log | cat > /data/out.txt",
+  "install -w \"My Game (USA) v1.02.pkg\"",
+  "cp -r /mnt/usb0/homebrew/savedata /data/backup/savedata-2026",
+  "execelf --heap 64M --env FOO=bar --env DEBUG=1 /data/bin/tool.elf -a -b -c arg1 arg2",
+  "ls -la /user/app | cat | cat | cat >> /data/tmp/listing.txt",
+};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char* name, int (*fn)(char*), long iters) {
+  size_t nlines = sizeof(g_lines)/sizeof(g_lines[0]);
+  char buf[1024];
+  long sink = 0;
+  g_allocs = 0;
+  double t0 = now_ns();
+  for(long i=0;i<iters;i++) {
+    const char* src = g_lines[i % nlines];
+    size_t len = strlen(src);
+    memcpy(buf, src, len + 1);
+    sink += fn(buf);
+  }
+  double dt = now_ns() - t0;
+  printf("%-8s %9.1f ns/line %7.2f allocs/line (checksum %ld)\n",
+         name, dt / iters, (double)g_allocs / iters, sink);
+}
+
+int main(int argc, char** argv) {
+  long iters = argc > 1 ? atol(argv[1]) : 2000000;
+  if(iters <= 0) iters = 1;
+  run("legacy", legacy_parse, iters);
+  run("arena", arena_parse, iters);
+  return 0;
+}
@@ -0,0 +1,441 @@
+/* End-to-end server benchmark. Starts the host build of the listener, drives
+ * N concurrent loopback sessions through a command mix and reports connect
+ * time, p50/p99 latency per command and transfer throughput.
+ * Host build: make bench-server && ./tools/bench_server [-n sessions]
+ *             [-r rounds] [-m mix] [-p port] [-s server] [-k]
+ * A mix is a comma list of ls, ps, cat:<size>, get:<size>, getb:<size>,
+ * put:<size> and putb:<size> (getb/putb are the raw -b transfers) with K/M
+ * size suffixes, e.g. "ls,ps,get:1M,put:1M". Exits non-zero if a session could
+ * not connect or a command failed (including output with a NUL byte).
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <dirent.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "base64.h"
+
+#define MAX_OPS 32
+
+enum { OP_LS, OP_PS, OP_CAT, OP_GET, OP_GETB, OP_PUT, OP_PUTB };
+
+typedef struct op {
+  int    kind;
+  size_t size;
+  char   label[24];
+  char*  body;       // put: encoded upload, terminated by ".\n"; putb: raw
+  size_t body_len;
+} op_t;
+
+typedef struct conn {
+  int    fd;
+  int    bol;        // at the start of a line
+  int    bad;        // output held a NUL byte, i.e. a broken record
+  size_t off, len;
+  char   buf[65536];
+} conn_t;
+
+static op_t     g_ops[MAX_OPS];
+static int      g_nops;
+static int      g_sessions = 8;
+static int      g_rounds = 20;
+static int      g_port = 2399;
+static double*  g_lat[MAX_OPS];      // [op][session * rounds + round], us
+static int      g_errors[MAX_OPS];
+static double*  g_connect;           // per session, us
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static size_t parse_size(const char* s) {
+  char* end;
+  unsigned long long v = strtoull(s, &end, 10);
+  if(*end == 'K' || *end == 'k') v *= 1024ULL;
+  else if(*end == 'M' || *end == 'm') v *= 1024ULL * 1024ULL;
+  return (size_t)v;
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+  const char* p = data;
+  while(len) {
+    ssize_t w = write(fd, p, len);
+    if(w < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    p += w;
+    len -= (size_t)w;
+  }
+  return 0;
+}
+
+/* ---- mix and fixtures ---- */
+
+static int parse_mix(const char* mix) {
+  char tmp[512];
+  snprintf(tmp, sizeof(tmp), "%s", mix);
+  for(char* tok = strtok(tmp, ","); tok; tok = strtok(NULL, ",")) {
+    if(g_nops == MAX_OPS) return -1;
+    op_t* op = &g_ops[g_nops];
+    char* colon = strchr(tok, ':');
+    if(colon) *colon = 0;
+    if(!strcmp(tok, "ls")) op->kind = OP_LS;
+    else if(!strcmp(tok, "ps")) op->kind = OP_PS;
+    else if(!strcmp(tok, "cat")) op->kind = OP_CAT;
+    else if(!strcmp(tok, "get")) op->kind = OP_GET;
+    else if(!strcmp(tok, "getb")) op->kind = OP_GETB;
+    else if(!strcmp(tok, "put")) op->kind = OP_PUT;
+    else if(!strcmp(tok, "putb")) op->kind = OP_PUTB;
+    else return -1;
+    if(op->kind >= OP_CAT) {
+      if(!colon || !(op->size = parse_size(colon + 1))) return -1;
+      snprintf(op->label, sizeof(op->label), "%s:%s", tok, colon + 1);
+    } else {
+      snprintf(op->label, sizeof(op->label), "%s", tok);
+    }
+    g_nops++;
+  }
+  return g_nops ? 0 : -1;
+}
+
+/* Printable text (so cat output never looks like a terminator). */
+static void fill_text(char* buf, size_t len, unsigned seed) {
+  for(size_t i=0;i<len;i++) {
+    seed = seed * 1103515245u + 12345u;
+    buf[i] = (i % 64 == 63) ? '\n' : (char)('a' + (seed >> 16) % 26);
+  }
+}
+
+static int make_fixtures(const char* dir) {
+  // a name whose control character is escaped right at the end of the JSON
+  // writer's 256 byte chunk, listed by every ls
+  char path[600];
+  int len = snprintf(path, sizeof(path), "%s/", dir);
+  memset(path + len, 'a', 250);
+  memcpy(path + len + 250, "\001b", 3);
+  int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(fd < 0) return -1;
+  close(fd);
+  for(int i=0;i<g_nops;i++) {
+    op_t* op = &g_ops[i];
+    if(op->kind < OP_CAT) continue;
+    char* data = malloc(op->size);
+    if(!data) return -1;
+    fill_text(data, op->size, (unsigned)op->size);
+    if(op->kind == OP_PUT) {
+      // encode once, replayed by every session
+      size_t blocks = (op->size + 3071) / 3072;
+      op->body = malloc(blocks * 4097 + 2);
+      if(!op->body) { free(data); return -1; }
+      size_t n = 0;
+      for(size_t off = 0; off < op->size; off += 3072) {
+        size_t chunk = op->size - off < 3072 ? op->size - off : 3072;
+        n += (size_t)b64_encode_block((unsigned char*)data + off, (int)chunk, op->body + n);
+        op->body[n++] = '\n';
+      }
+      memcpy(op->body + n, ".\n", 2);
+      op->body_len = n + 2;
+    } else if(op->kind == OP_PUTB) {
+      op->body = data;
+      op->body_len = op->size;
+      continue;
+    } else {
+      snprintf(path, sizeof(path), "%s/data_%zu", dir, op->size);
+      int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      if(fd < 0 || write_all(fd, data, op->size) < 0) { free(data); return -1; }
+      close(fd);
+    }
+    free(data);
+  }
+  return 0;
+}
+
+static void remove_dir(const char* dir) {
+  DIR* d = opendir(dir);
+  if(!d) return;
+  struct dirent* de;
+  char path[600];
+  while((de = readdir(d))) {
+    if(de->d_name[0] == '.') continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    unlink(path);
+  }
+  closedir(d);
+  rmdir(dir);
+}
+
+/* ---- connection ---- */
+
+static ssize_t conn_fill(conn_t* c) {
+  if(c->off) {
+    memmove(c->buf, c->buf + c->off, c->len - c->off);
+    c->len -= c->off;
+    c->off = 0;
+  }
+  ssize_t n;
+  do {
+    n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+  } while(n < 0 && errno == EINTR);
+  if(n > 0) c->len += (size_t)n;
+  return n;
+}
+
+/* Skip input up to and including `tok`, which ends a line or a prompt. */
+static int conn_expect(conn_t* c, const char* tok) {
+  size_t tl = strlen(tok);
+  for(;;) {
+    char* p = memmem(c->buf + c->off, c->len - c->off, tok, tl);
+    if(p) {
+      c->off = (size_t)(p - c->buf) + tl;
+      c->bol = 1;
+      return 0;
+    }
+    if(c->len - c->off >= tl) c->off = c->len - tl + 1;
+    if(conn_fill(c) <= 0) return -1;
+  }
+}
+
+/* Read command output up to the machine mode terminator; returns its rc. */
+static int conn_wait_end(conn_t* c) {
+  static const char tag[] = "{\"type\":\"end\"";
+  const size_t tl = sizeof(tag) - 1;
+  for(;;) {
+    while(c->off < c->len) {
+      char* p = c->buf + c->off;
+      size_t n = c->len - c->off;
+      if(c->bol && !memcmp(p, tag, n < tl ? n : tl)) {
+        char* nl = n >= tl ? memchr(p, '\n', n) : NULL;
+        if(!nl) break;   // need the whole record
+        char* rc = memmem(p, (size_t)(nl - p), "\"rc\":", 5);
+        c->off += (size_t)(nl - p) + 1;
+        return rc ? atoi(rc + 5) : -1;
+      }
+      char* nl = memchr(p, '\n', n);
+      size_t seg = nl ? (size_t)(nl - p) + 1 : n;
+      if(memchr(p, 0, seg)) c->bad = 1;
+      c->off += seg;
+      c->bol = nl != NULL;
+    }
+    if(conn_fill(c) <= 0) return -1;
+  }
+}
+
+static int conn_open(conn_t* c) {
+  c->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(c->fd < 0) return -1;
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons((uint16_t)g_port);
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(connect(c->fd, (struct sockaddr*)&a, sizeof(a)) < 0) {
+    close(c->fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  // a wedged server fails the run instead of hanging it
+  struct timeval tv = { 30, 0 };
+  setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  c->off = c->len = 0;
+  c->bol = 1;
+  return 0;
+}
+
+/* ---- workers ---- */
+
+static int run_op(conn_t* c, int id, int i) {
+  const op_t* op = &g_ops[i];
+  char line[128];
+  switch(op->kind) {
+  case OP_LS:  snprintf(line, sizeof(line), "ls -l\n"); break;
+  case OP_PS:  snprintf(line, sizeof(line), "ps\n"); break;
+  case OP_CAT: snprintf(line, sizeof(line), "cat data_%zu\n", op->size); break;
+  case OP_GET: snprintf(line, sizeof(line), "get data_%zu\n", op->size); break;
+  case OP_GETB: snprintf(line, sizeof(line), "get -b data_%zu\n", op->size); break;
+  case OP_PUT: snprintf(line, sizeof(line), "put up_%d_%d\n", id, i); break;
+  case OP_PUTB: snprintf(line, sizeof(line), "put -b up_%d_%d %zu\n", id, i, op->size); break;
+  }
+  if(write_all(c->fd, line, strlen(line)) < 0) return -1;
+  if(op->kind >= OP_PUT) {
+    if(conn_expect(c, ".\n") < 0) return -1;
+    if(write_all(c->fd, op->body, op->body_len) < 0) return -1;
+  }
+  c->bad = 0;
+  int rc = conn_wait_end(c);
+  return rc == 0 && c->bad ? 1 : rc;
+}
+
+static void* worker(void* arg) {
+  int id = (int)(intptr_t)arg;
+  conn_t* c = malloc(sizeof(*c));
+  if(!c) return NULL;
+  double t0 = now_us();
+  if(conn_open(c) < 0 || conn_expect(c, "$ ") < 0) {
+    fprintf(stderr, "session %d: connect failed\n", id);
+    free(c);
+    return NULL;
+  }
+  g_connect[id] = now_us() - t0;
+  if(write_all(c->fd, "mode json\n", 10) < 0 || conn_wait_end(c) < 0) goto out;
+  for(int r=0;r<g_rounds;r++) {
+    for(int i=0;i<g_nops;i++) {
+      double s = now_us();
+      int rc = run_op(c, id, i);
+      g_lat[i][id * g_rounds + r] = now_us() - s;
+      if(rc != 0) {
+        pthread_mutex_lock(&g_lock);
+        g_errors[i]++;
+        pthread_mutex_unlock(&g_lock);
+        if(rc < 0) goto out;   // connection lost
+      }
+    }
+  }
+out:
+  close(c->fd);
+  free(c);
+  return NULL;
+}
+
+/* ---- report ---- */
+
+static int cmp_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static double pct(const double* v, int n, double p) {
+  if(!n) return 0;
+  int i = (int)(p * (n - 1) + 0.5);
+  return v[i];
+}
+
+/* Drops unfilled samples (negative) and sorts the rest in place. */
+static int collect(double* v, int n) {
+  int m = 0;
+  for(int i=0;i<n;i++) if(v[i] >= 0) v[m++] = v[i];
+  qsort(v, m, sizeof(double), cmp_double);
+  return m;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+    "usage: %s [-n sessions] [-r rounds] [-m mix] [-p port] [-s server] [-k]\n"
+    "  -k  keep the fixture directory and server log\n", prog);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  const char* server = "./tools/sshsvr_host";
+  const char* mix = "ls,ps,cat:4K,cat:256K,get:64K,put:64K,get:1M,put:1M,getb:1M,putb:1M";
+  int opt, keep = 0;
+  while((opt = getopt(argc, argv, "n:r:m:p:s:k")) != -1) {
+    switch(opt) {
+    case 'n': g_sessions = atoi(optarg); break;
+    case 'r': g_rounds = atoi(optarg); break;
+    case 'm': mix = optarg; break;
+    case 'p': g_port = atoi(optarg); break;
+    case 's': server = optarg; break;
+    case 'k': keep = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if(g_sessions <= 0 || g_rounds <= 0 || parse_mix(mix) < 0) usage(argv[0]);
+
+  char dir[] = "/tmp/sshsvr-bench.XXXXXX";
+  if(!mkdtemp(dir) || make_fixtures(dir) < 0) { perror("fixtures"); return 1; }
+  char abs_server[1024];
+  if(!realpath(server, abs_server)) { perror(server); return 1; }
+
+  pid_t srv = fork();
+  if(srv == 0) {
+    char log[600], port[16];
+    snprintf(log, sizeof(log), "%s/server.log", dir);
+    snprintf(port, sizeof(port), "%d", g_port);
+    int lfd = open(log, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(lfd >= 0) { dup2(lfd, 1); dup2(lfd, 2); close(lfd); }
+    // the payload loader starts it without stdin, so fd 0 is a socket
+    close(0);
+    if(chdir(dir) < 0) _exit(127);
+    execl(abs_server, abs_server, "-p", port, (char*)NULL);
+    _exit(127);
+  }
+  // wait for the listener
+  conn_t* probe = malloc(sizeof(*probe));
+  int up = 0;
+  for(int i=0;i<100 && !up;i++) {
+    if(conn_open(probe) == 0) { up = 1; close(probe->fd); }
+    else usleep(50000);
+  }
+  free(probe);
+  if(!up) {
+    fprintf(stderr, "server did not come up on port %d (log in %s)\n", g_port, dir);
+    kill(srv, SIGTERM);
+    return 1;
+  }
+
+  int nsamples = g_sessions * g_rounds;
+  g_connect = malloc(sizeof(double) * g_sessions);
+  for(int i=0;i<g_sessions;i++) g_connect[i] = -1;
+  for(int i=0;i<g_nops;i++) {
+    g_lat[i] = malloc(sizeof(double) * nsamples);
+    for(int j=0;j<nsamples;j++) g_lat[i][j] = -1;
+  }
+
+  pthread_t* th = malloc(sizeof(pthread_t) * g_sessions);
+  double t0 = now_us();
+  for(int i=0;i<g_sessions;i++)
+    pthread_create(&th[i], NULL, worker, (void*)(intptr_t)i);
+  for(int i=0;i<g_sessions;i++) pthread_join(th[i], NULL);
+  double wall = now_us() - t0;
+
+  kill(srv, SIGTERM);
+  waitpid(srv, NULL, 0);
+
+  printf("sessions %d, rounds %d, mix %s\n", g_sessions, g_rounds, mix);
+  int nc = collect(g_connect, g_sessions);
+  printf("connect   %6d   p50 %9.1f us   p99 %9.1f us\n",
+         nc, pct(g_connect, nc, 0.50), pct(g_connect, nc, 0.99));
+  printf("%-12s %6s %12s %12s %9s %6s\n", "command", "count", "p50 us", "p99 us", "MB/s", "errors");
+  long total = 0;
+  double bytes = 0;
+  for(int i=0;i<g_nops;i++) {
+    int n = collect(g_lat[i], nsamples);
+    double sum = 0;
+    for(int j=0;j<n;j++) sum += g_lat[i][j];
+    total += n;
+    printf("%-12s %6d %12.1f %12.1f", g_ops[i].label, n,
+           pct(g_lat[i], n, 0.50), pct(g_lat[i], n, 0.99));
+    if(g_ops[i].size && sum > 0) {
+      printf(" %9.1f", (double)g_ops[i].size * n / sum);   // bytes/us == MB/s
+      bytes += (double)g_ops[i].size * n;
+    } else {
+      printf(" %9s", "-");
+    }
+    printf(" %6d\n", g_errors[i]);
+  }
+  printf("total     %ld commands in %.2f s (%.0f cmd/s), %.1f MB/s aggregate\n",
+         total, wall / 1e6, total / (wall / 1e6), bytes / wall);
+  if(keep) printf("fixtures and server log in %s\n", dir);
+  else remove_dir(dir);
+  int failed = nc < g_sessions;
+  for(int i=0;i<g_nops;i++) failed |= g_errors[i] != 0;
+  return failed;
+}
@@ -0,0 +1,439 @@
+/* Delta upload client for the sync builtin. The console sends the signature
+ * of each block of its copy; this side slides a window over the local file,
+ * looks the window's rolling checksum up among them, confirms hits with the
+ * strong hash and sends references to matching blocks and literal data for
+ * everything else (formats in include/delta.h). Only changed regions cross
+ * the network; the console checks the rebuilt file's size and CRC-32C
+ * before replacing its copy.
+ * Host build: make psync
+ *   ./tools/psync [-h host] [-p port] [-B block] <local> <remote>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "crc32c.h"
+#include "delta.h"
+
+#define HASH_BITS 16
+#define OUT_SIZE  (256 * 1024)
+
+typedef struct conn {
+  int    fd;
+  size_t off, len;
+  char   buf[65536];
+} conn_t;
+
+static const char* g_host = "127.0.0.1";
+static int         g_port = 2222;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+  const char* p = data;
+  while(len) {
+    ssize_t w = write(fd, p, len);
+    if(w < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    p += w;
+    len -= (size_t)w;
+  }
+  return 0;
+}
+
+/* Double quotes for the server's parser, escaping " and \. */
+static void quote(char* dst, size_t max, const char* src) {
+  size_t n = 0;
+  dst[n++] = '"';
+  for(; *src && n + 3 < max; src++) {
+    if(*src == '"' || *src == '\\') dst[n++] = '\\';
+    dst[n++] = *src;
+  }
+  dst[n++] = '"';
+  dst[n] = 0;
+}
+
+/* ---- connection ---- */
+
+static ssize_t conn_fill(conn_t* c) {
+  if(c->off) {
+    memmove(c->buf, c->buf + c->off, c->len - c->off);
+    c->len -= c->off;
+    c->off = 0;
+  }
+  ssize_t n;
+  do {
+    n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+  } while(n < 0 && errno == EINTR);
+  if(n > 0) c->len += (size_t)n;
+  return n;
+}
+
+/* Next line without its newline, valid until the next conn_ call. */
+static char* conn_line(conn_t* c) {
+  for(;;) {
+    char* p = c->buf + c->off;
+    char* nl = memchr(p, '\n', c->len - c->off);
+    if(nl) {
+      *nl = 0;
+      c->off = (size_t)(nl - c->buf) + 1;
+      return p;
+    }
+    if(c->len - c->off == sizeof(c->buf) || conn_fill(c) <= 0) return NULL;
+  }
+}
+
+static int conn_read(conn_t* c, void* buf, size_t len) {
+  char* p = buf;
+  while(len) {
+    if(c->off == c->len && conn_fill(c) <= 0) return -1;
+    size_t n = c->len - c->off < len ? c->len - c->off : len;
+    memcpy(p, c->buf + c->off, n);
+    c->off += n;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Skip input up to and including `tok`. */
+static int conn_expect(conn_t* c, const char* tok) {
+  size_t tl = strlen(tok);
+  for(;;) {
+    char* p = memmem(c->buf + c->off, c->len - c->off, tok, tl);
+    if(p) {
+      c->off = (size_t)(p - c->buf) + tl;
+      return 0;
+    }
+    if(c->len - c->off >= tl) c->off = c->len - tl + 1;
+    if(conn_fill(c) <= 0) return -1;
+  }
+}
+
+static long long json_num(const char* rec, const char* key) {
+  char pat[64];
+  snprintf(pat, sizeof(pat), "\"%s\":", key);
+  const char* p = strstr(rec, pat);
+  return p ? strtoll(p + strlen(pat), NULL, 10) : -1;
+}
+
+/* Records up to the end-of-command terminator; returns its rc. Lines other
+ * than records (error messages) are passed to stderr. */
+static int conn_wait_end(conn_t* c, const char* type, char* rec, size_t max) {
+  char pat[64];
+  if(type) snprintf(pat, sizeof(pat), "{\"type\":\"%s\"", type);
+  for(;;) {
+    char* line = conn_line(c);
+    if(!line) return -1;
+    if(!strncmp(line, "{\"type\":\"end\"", 13)) return (int)json_num(line, "rc");
+    if(type && rec && !strncmp(line, pat, strlen(pat))) snprintf(rec, max, "%s", line);
+    else if(line[0] != '{') fprintf(stderr, "console: %s\n", line);
+  }
+}
+
+static int conn_open(conn_t* c) {
+  struct addrinfo hints, *ai;
+  char port[16];
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port, sizeof(port), "%d", g_port);
+  if(getaddrinfo(g_host, port, &hints, &ai) != 0) return -1;
+  c->fd = socket(ai->ai_family, ai->ai_socktype, 0);
+  c->off = c->len = 0;
+  if(c->fd < 0 || connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+    if(c->fd >= 0) close(c->fd);
+    freeaddrinfo(ai);
+    return -1;
+  }
+  freeaddrinfo(ai);
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if(conn_expect(c, "$ ") < 0 || write_all(c->fd, "mode json\n", 10) < 0 ||
+     conn_wait_end(c, NULL, NULL, 0) != 0) {
+    close(c->fd);
+    return -1;
+  }
+  return 0;
+}
+
+/* ---- signatures ---- */
+
+typedef struct sig {
+  uint32_t      weak;
+  int32_t       next;   // chain of blocks in the same bucket, -1 ends it
+  unsigned char strong[DELTA_STRONG];
+} sig_t;
+
+static sig_t*   g_sigs;
+static int32_t  g_head[1 << HASH_BITS];
+static uint32_t g_nsigs;
+
+static unsigned bucket(uint32_t weak) {
+  return (weak ^ weak >> HASH_BITS) & ((1 << HASH_BITS) - 1);
+}
+
+static int read_sigs(conn_t* c) {
+  g_sigs = calloc(g_nsigs ? g_nsigs : 1, sizeof(*g_sigs));
+  if(!g_sigs) return -1;
+  memset(g_head, 0xff, sizeof(g_head));
+  for(uint32_t i=0;i<g_nsigs;i++) {
+    unsigned char raw[DELTA_SIG_SIZE];
+    uint32_t weak;
+    if(conn_read(c, raw, sizeof(raw)) < 0) return -1;
+    memcpy(&weak, raw, 4);
+    g_sigs[i].weak = ntohl(weak);
+    memcpy(g_sigs[i].strong, raw + 4, DELTA_STRONG);
+  }
+  // chained back to front so every bucket lists its earliest block first
+  for(uint32_t i=g_nsigs;i-->0;) {
+    unsigned b = bucket(g_sigs[i].weak);
+    g_sigs[i].next = g_head[b];
+    g_head[b] = (int32_t)i;
+  }
+  return 0;
+}
+
+/* ---- delta ---- */
+
+typedef struct delta {
+  int      fd;
+  char     out[OUT_SIZE];
+  size_t   fill;
+  uint32_t first, count;   // copy op being extended
+  uint64_t matched, literal, wire;
+  int      err;
+} delta_t;
+
+static void emit(delta_t* d, const void* p, size_t n) {
+  if(d->fill + n > sizeof(d->out)) {
+    if(write_all(d->fd, d->out, d->fill) < 0) d->err = 1;
+    d->fill = 0;
+  }
+  if(n > sizeof(d->out)) {
+    if(write_all(d->fd, p, n) < 0) d->err = 1;
+  } else {
+    memcpy(d->out + d->fill, p, n);
+    d->fill += n;
+  }
+  d->wire += n;
+}
+
+static void flush_copy(delta_t* d) {
+  if(!d->count) return;
+  unsigned char op[9] = { 'C' };
+  uint32_t a[2] = { htonl(d->first), htonl(d->count) };
+  memcpy(op + 1, a, 8);
+  emit(d, op, sizeof(op));
+  d->count = 0;
+}
+
+static void emit_copy(delta_t* d, uint32_t block) {
+  d->matched++;
+  if(d->count && d->first + d->count == block) {
+    d->count++;
+    return;
+  }
+  flush_copy(d);
+  d->first = block;
+  d->count = 1;
+}
+
+static void emit_literal(delta_t* d, const unsigned char* p, size_t n) {
+  flush_copy(d);
+  while(n) {
+    uint32_t k = n < DELTA_MAX_LIT ? (uint32_t)n : DELTA_MAX_LIT;
+    unsigned char op[5] = { 'L' };
+    uint32_t len = htonl(k);
+    memcpy(op + 1, &len, 4);
+    emit(d, op, sizeof(op));
+    emit(d, p, k);
+    d->literal += k;
+    p += k;
+    n -= k;
+  }
+}
+
+/* Block whose signature matches p[0..len), or -1. `hint` (the block after
+ * the last match) is tried first so unchanged runs stay one copy op. */
+static int64_t find_block(const unsigned char* p, size_t len, uint32_t weak, int64_t hint) {
+  unsigned char strong[DELTA_STRONG];
+  int have = 0;
+  if(hint >= 0 && hint < g_nsigs && g_sigs[hint].weak == weak) {
+    delta_strong(p, len, strong);
+    have = 1;
+    if(!memcmp(strong, g_sigs[hint].strong, DELTA_STRONG)) return hint;
+  }
+  for(int32_t i=g_head[bucket(weak)]; i>=0; i=g_sigs[i].next) {
+    if(g_sigs[i].weak != weak) continue;
+    if(!have) {
+      delta_strong(p, len, strong);
+      have = 1;
+    }
+    if(!memcmp(strong, g_sigs[i].strong, DELTA_STRONG)) return i;
+  }
+  return -1;
+}
+
+/* Ops turning the console's copy (old_size bytes in blocks of `block`) into
+ * data[0..size), ending with the size and CRC-32C of the result. */
+static void make_delta(delta_t* d, const unsigned char* data, uint64_t size,
+                       uint32_t block, uint64_t old_size) {
+  uint64_t pos = 0, lit = 0;
+  int64_t hint = -1;
+  delta_roll_t r;
+  int rolling = 0;
+  while(g_nsigs && pos + block <= size) {
+    if(!rolling) {
+      delta_roll_init(&r, data + pos, block);
+      rolling = 1;
+    }
+    int64_t b = find_block(data + pos, block, delta_roll_sum(&r), hint);
+    // the last block is only a full-size match if the old file ends on one
+    if(b >= 0 && (uint64_t)(b + 1) * block <= old_size) {
+      if(pos > lit) emit_literal(d, data + lit, (size_t)(pos - lit));
+      emit_copy(d, (uint32_t)b);
+      pos += block;
+      lit = pos;
+      hint = b + 1;
+      rolling = 0;
+      continue;
+    }
+    if(pos + block == size) break;
+    delta_roll_step(&r, data[pos], data[pos + block]);
+    pos++;
+    if(pos - lit >= DELTA_MAX_LIT) {
+      emit_literal(d, data + lit, DELTA_MAX_LIT);
+      lit += DELTA_MAX_LIT;
+    }
+  }
+  // a short last block can only match the end of this file
+  uint64_t tail = old_size % block;
+  if(g_nsigs && tail && size >= lit + tail) {
+    const unsigned char* p = data + size - tail;
+    uint32_t last = g_nsigs - 1;
+    unsigned char strong[DELTA_STRONG];
+    if(delta_weak(p, (size_t)tail) == g_sigs[last].weak) {
+      delta_strong(p, (size_t)tail, strong);
+      if(!memcmp(strong, g_sigs[last].strong, DELTA_STRONG)) {
+        emit_literal(d, data + lit, (size_t)(size - tail - lit));
+        emit_copy(d, last);
+        lit = size;
+      }
+    }
+  }
+  if(size > lit) emit_literal(d, data + lit, (size_t)(size - lit));
+  flush_copy(d);
+  unsigned char op[13] = { 'E' };
+  uint32_t a[3] = { htonl((uint32_t)(size >> 32)), htonl((uint32_t)size),
+                    htonl(crc32c(0, data, (size_t)size)) };
+  memcpy(op + 1, a, 12);
+  emit(d, op, sizeof(op));
+  if(write_all(d->fd, d->out, d->fill) < 0) d->err = 1;
+  d->fill = 0;
+}
+
+/* ---- main ---- */
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage: %s [-h host] [-p port] [-B block] <local> <remote>\n", prog);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  long block = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "h:p:B:")) != -1) {
+    switch(opt) {
+    case 'h': g_host = optarg; break;
+    case 'p': g_port = atoi(optarg); break;
+    case 'B': block = atol(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if(argc - optind != 2) usage(argv[0]);
+  const char* local = argv[optind];
+  const char* remote = argv[optind + 1];
+
+  int fd = open(local, O_RDONLY);
+  struct stat sb;
+  if(fd < 0 || fstat(fd, &sb) < 0) { perror(local); return 1; }
+  uint64_t size = (uint64_t)sb.st_size;
+  const unsigned char* data = NULL;
+  if(size) {
+    data = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) { perror(local); return 1; }
+  }
+
+  conn_t* c = malloc(sizeof(*c));
+  delta_t* d = calloc(1, sizeof(*d));
+  if(!c || !d || conn_open(c) < 0) {
+    fprintf(stderr, "psync: cannot connect to %s:%d\n", g_host, g_port);
+    return 1;
+  }
+  char cmd[1200], q[1024], rec[512];
+  quote(q, sizeof(q), remote);
+  if(block) snprintf(cmd, sizeof(cmd), "sync -B %ld %s\n", block, q);
+  else snprintf(cmd, sizeof(cmd), "sync %s\n", q);
+  double t0 = now_s();
+  if(write_all(c->fd, cmd, strlen(cmd)) < 0) return 1;
+  char* line = conn_line(c);
+  if(!line || strncmp(line, "{\"type\":\"sync\"", 14)) {
+    if(line) fprintf(stderr, "console: %s\n", line);
+    fprintf(stderr, "psync: %s: refused by the console\n", remote);
+    return 1;
+  }
+  uint32_t bsize = (uint32_t)json_num(line, "block");
+  uint64_t old_size = (uint64_t)json_num(line, "size");
+  g_nsigs = (uint32_t)json_num(line, "blocks");
+  if(bsize < DELTA_MIN_BLOCK || bsize > DELTA_MAX_BLOCK ||
+     (old_size + bsize - 1) / bsize != g_nsigs || read_sigs(c) < 0) {
+    fprintf(stderr, "psync: bad signature stream\n");
+    return 1;
+  }
+  double t_sig = now_s() - t0;
+
+  d->fd = c->fd;
+  make_delta(d, data, size, bsize, old_size);
+  if(d->err) {
+    fprintf(stderr, "psync: connection lost\n");
+    return 1;
+  }
+  rec[0] = 0;
+  int rc = conn_wait_end(c, "xfer", rec, sizeof(rec));
+  double secs = now_s() - t0;
+  if(rc != 0) {
+    fprintf(stderr, "psync: %s: not updated (rc %d)\n", remote, rc);
+    return 1;
+  }
+  printf("sync %llu bytes in %.3f s (signatures %.3f s): %llu blocks copied of %u (%u bytes), "
+         "%llu literal bytes, wire %llu bytes\n",
+         (unsigned long long)size, secs, t_sig, (unsigned long long)d->matched, g_nsigs,
+         bsize, (unsigned long long)d->literal,
+         (unsigned long long)(d->wire + (uint64_t)g_nsigs * DELTA_SIG_SIZE));
+  close(c->fd);
+  free(c);
+  free(d);
+  free(g_sigs);
+  if(size) munmap((void*)data, (size_t)size);
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,456 @@
+/* Parallel segmented transfer client. Splits a file into one byte range per
+ * stream and moves every range over its own session with the raw range
+ * builtins (get -b -o/-n, put -b -o/-t). Both ends compute the CRC-32C of
+ * each range as it passes (-c) and compare them, so verifying takes no
+ * second pass over the file. With -z the ranges travel as compressed block
+ * streams (get -b -z, put -b -z).
+ * Host build: make pxfer
+ *   ./tools/pxfer [-h host] [-p port] [-j streams] [-z] get <remote> <local>
+ *   ./tools/pxfer [-h host] [-p port] [-j streams] [-z] put <local> <remote>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "crc32c.h"
+#include "lz.h"
+
+#define MAX_STREAMS 16
+#define SEG_ALIGN   (1024 * 1024)
+#define IO_CHUNK    (1024 * 1024)
+#define Z_BLOCK     (256 * 1024)   // XFER_Z_BLOCK on the console
+#define Z_HDR       8
+
+typedef struct conn {
+  int    fd;
+  size_t off, len;
+  char   buf[65536];
+} conn_t;
+
+typedef struct seg {
+  int      id;
+  uint64_t off, len;
+  uint64_t wire;       // -z: encoded bytes
+  uint32_t crc;        // of the range, as it passed through here
+  int      ok;
+  char     err[128];
+} seg_t;
+
+static const char* g_host = "127.0.0.1";
+static int         g_port = 2222;
+static int         g_put;          // direction: 0 pull, 1 push
+static int         g_compress;
+static int         g_local = -1;   // local file, pread/pwrite by every stream
+static char        g_remote[1024]; // quoted for the command line
+static uint64_t    g_total;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+  const char* p = data;
+  while(len) {
+    ssize_t w = write(fd, p, len);
+    if(w < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    p += w;
+    len -= (size_t)w;
+  }
+  return 0;
+}
+
+/* Double quotes for the server's parser, escaping " and \. */
+static void quote(char* dst, size_t max, const char* src) {
+  size_t n = 0;
+  dst[n++] = '"';
+  for(; *src && n + 3 < max; src++) {
+    if(*src == '"' || *src == '\\') dst[n++] = '\\';
+    dst[n++] = *src;
+  }
+  dst[n++] = '"';
+  dst[n] = 0;
+}
+
+/* ---- connection ---- */
+
+static ssize_t conn_fill(conn_t* c) {
+  if(c->off) {
+    memmove(c->buf, c->buf + c->off, c->len - c->off);
+    c->len -= c->off;
+    c->off = 0;
+  }
+  ssize_t n;
+  do {
+    n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+  } while(n < 0 && errno == EINTR);
+  if(n > 0) c->len += (size_t)n;
+  return n;
+}
+
+/* Next line without its newline, valid until the next conn_ call. */
+static char* conn_line(conn_t* c) {
+  for(;;) {
+    char* p = c->buf + c->off;
+    char* nl = memchr(p, '\n', c->len - c->off);
+    if(nl) {
+      *nl = 0;
+      c->off = (size_t)(nl - c->buf) + 1;
+      return p;
+    }
+    if(c->len - c->off == sizeof(c->buf) || conn_fill(c) <= 0) return NULL;
+  }
+}
+
+static int conn_read(conn_t* c, void* buf, size_t len) {
+  char* p = buf;
+  while(len) {
+    if(c->off == c->len && conn_fill(c) <= 0) return -1;
+    size_t n = c->len - c->off < len ? c->len - c->off : len;
+    memcpy(p, c->buf + c->off, n);
+    c->off += n;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Skip input up to and including `tok`. */
+static int conn_expect(conn_t* c, const char* tok) {
+  size_t tl = strlen(tok);
+  for(;;) {
+    char* p = memmem(c->buf + c->off, c->len - c->off, tok, tl);
+    if(p) {
+      c->off = (size_t)(p - c->buf) + tl;
+      return 0;
+    }
+    if(c->len - c->off >= tl) c->off = c->len - tl + 1;
+    if(conn_fill(c) <= 0) return -1;
+  }
+}
+
+static long long json_num(const char* rec, const char* key) {
+  char pat[64];
+  snprintf(pat, sizeof(pat), "\"%s\":", key);
+  const char* p = strstr(rec, pat);
+  return p ? strtoll(p + strlen(pat), NULL, 10) : -1;
+}
+
+/* Records up to the end-of-command terminator; returns its rc. A record of
+ * `type` seen on the way is copied to rec. */
+static int conn_wait_end(conn_t* c, const char* type, char* rec, size_t max) {
+  char pat[64];
+  if(type) snprintf(pat, sizeof(pat), "{\"type\":\"%s\"", type);
+  for(;;) {
+    char* line = conn_line(c);
+    if(!line) return -1;
+    if(!strncmp(line, "{\"type\":\"end\"", 13)) return (int)json_num(line, "rc");
+    if(type && rec && !strncmp(line, pat, strlen(pat))) snprintf(rec, max, "%s", line);
+  }
+}
+
+static int conn_open(conn_t* c) {
+  struct addrinfo hints, *ai;
+  char port[16];
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port, sizeof(port), "%d", g_port);
+  if(getaddrinfo(g_host, port, &hints, &ai) != 0) return -1;
+  c->fd = socket(ai->ai_family, ai->ai_socktype, 0);
+  c->off = c->len = 0;
+  if(c->fd < 0 || connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+    if(c->fd >= 0) close(c->fd);
+    freeaddrinfo(ai);
+    return -1;
+  }
+  freeaddrinfo(ai);
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if(conn_expect(c, "$ ") < 0 || write_all(c->fd, "mode json\n", 10) < 0 ||
+     conn_wait_end(c, NULL, NULL, 0) != 0) {
+    close(c->fd);
+    return -1;
+  }
+  return 0;
+}
+
+/* ---- segments ---- */
+
+/* The console's digest record for the range against ours. */
+static int seg_verify(conn_t* c, seg_t* s) {
+  char rec[512] = "", hex[16];
+  if(conn_wait_end(c, "digest", rec, sizeof(rec)) != 0) return -1;
+  snprintf(hex, sizeof(hex), "\"%08x\"", s->crc);
+  if((uint64_t)json_num(rec, "bytes") != s->len || !strstr(rec, hex)) {
+    snprintf(s->err, sizeof(s->err), "crc32c mismatch (local %08x): %.80s", s->crc, rec);
+    return -1;
+  }
+  return 0;
+}
+
+/* get -b -z: blocks of (raw length, stored length) headers and data. */
+static int seg_get_lz(conn_t* c, seg_t* s) {
+  char* z = malloc(Z_BLOCK);
+  char* raw = malloc(Z_BLOCK);
+  uint64_t done = 0;
+  int rc = z && raw ? 0 : -1;
+  while(!rc) {
+    uint32_t h[2];
+    if(conn_read(c, h, Z_HDR) < 0) { rc = -1; break; }
+    uint32_t n = ntohl(h[0]), stored = ntohl(h[1]);
+    s->wire += Z_HDR + stored;
+    if(!n) break;
+    if(n > Z_BLOCK || stored > n || n > s->len - done || conn_read(c, z, stored) < 0) {
+      snprintf(s->err, sizeof(s->err), "bad block at %llu", (unsigned long long)done);
+      rc = -1;
+      break;
+    }
+    const char* data = z;
+    if(stored < n) {
+      if(lz_decompress(z, stored, raw, n) != (long)n) {
+        snprintf(s->err, sizeof(s->err), "corrupt block at %llu", (unsigned long long)done);
+        rc = -1;
+        break;
+      }
+      data = raw;
+    }
+    if(pwrite(g_local, data, n, (off_t)(s->off + done)) != (ssize_t)n) {
+      snprintf(s->err, sizeof(s->err), "local write: %s", strerror(errno));
+      rc = -1;
+      break;
+    }
+    s->crc = crc32c(s->crc, data, n);
+    done += n;
+  }
+  free(z);
+  free(raw);
+  if(!rc && done != s->len) {
+    snprintf(s->err, sizeof(s->err), "short stream: %llu bytes", (unsigned long long)done);
+    rc = -1;
+  }
+  return rc;
+}
+
+static int seg_get(conn_t* c, seg_t* s) {
+  char cmd[1200];
+  snprintf(cmd, sizeof(cmd), "get -b -c%s -o %llu -n %llu %s\n",
+           g_compress ? " -z" : "", (unsigned long long)s->off, (unsigned long long)s->len, g_remote);
+  if(write_all(c->fd, cmd, strlen(cmd)) < 0) return -1;
+  char* line = conn_line(c);
+  if(!line || strncmp(line, "{\"type\":\"get\"", 13) ||
+     (uint64_t)json_num(line, "size") != s->len) {
+    snprintf(s->err, sizeof(s->err), "unexpected reply: %.80s", line ? line : "EOF");
+    return -1;
+  }
+  if(g_compress) {
+    if(seg_get_lz(c, s) < 0) return -1;
+    return seg_verify(c, s);
+  }
+  uint64_t done = 0;
+  while(done < s->len) {
+    if(c->off == c->len && conn_fill(c) <= 0) return -1;
+    size_t n = c->len - c->off;
+    if(n > s->len - done) n = (size_t)(s->len - done);
+    if(pwrite(g_local, c->buf + c->off, n, (off_t)(s->off + done)) != (ssize_t)n) {
+      snprintf(s->err, sizeof(s->err), "local write: %s", strerror(errno));
+      return -1;
+    }
+    s->crc = crc32c(s->crc, c->buf + c->off, n);
+    c->off += n;
+    done += n;
+  }
+  return seg_verify(c, s);
+}
+
+/* put -b -z: each block is stored as is unless it
+ * compresses by at least 1/16. */
+static int send_lz(conn_t* c, seg_t* s, uint64_t* done) {
+  char* raw = malloc(Z_HDR + Z_BLOCK);
+  char* out = malloc(Z_HDR + LZ_BOUND(Z_BLOCK));
+  int rc = raw && out ? 0 : -1;
+  while(!rc && *done < s->len) {
+    size_t n = s->len - *done < Z_BLOCK ? (size_t)(s->len - *done) : Z_BLOCK;
+    ssize_t r = pread(g_local, raw + Z_HDR, n, (off_t)(s->off + *done));
+    if(r <= 0) break;
+    s->crc = crc32c(s->crc, raw + Z_HDR, (size_t)r);
+    uint32_t h[2] = { htonl((uint32_t)r), htonl((uint32_t)r) };
+    char* f = raw;
+    size_t flen = (size_t)r;
+    size_t z = lz_compress(raw + Z_HDR, (size_t)r, out + Z_HDR, (size_t)r - (size_t)r / 16);
+    if(z) {
+      h[1] = htonl((uint32_t)z);
+      f = out;
+      flen = z;
+    }
+    memcpy(f, h, Z_HDR);
+    flen += Z_HDR;
+    if(write_all(c->fd, f, flen) < 0) rc = -1;
+    else *done += (uint64_t)r;
+    s->wire += flen;
+  }
+  static const char end[Z_HDR];
+  if(!rc && write_all(c->fd, end, Z_HDR) < 0) rc = -1;
+  s->wire += Z_HDR;
+  free(raw);
+  free(out);
+  return rc;
+}
+
+static int seg_put(conn_t* c, seg_t* s) {
+  char cmd[1200];
+  snprintf(cmd, sizeof(cmd), "put -b -c%s -o %llu -t %llu %s %llu\n",
+           g_compress ? " -z" : "", (unsigned long long)s->off, (unsigned long long)g_total, g_remote,
+           (unsigned long long)s->len);
+  if(write_all(c->fd, cmd, strlen(cmd)) < 0) return -1;
+  char* line = conn_line(c);
+  if(!line || strcmp(line, ".")) {
+    snprintf(s->err, sizeof(s->err), "unexpected reply: %.80s", line ? line : "EOF");
+    return -1;
+  }
+  uint64_t done = 0;
+  if(g_compress) {
+    send_lz(c, s, &done);
+  } else {
+    char* buf = malloc(IO_CHUNK);
+    if(!buf) return -1;
+    while(done < s->len) {
+      size_t n = s->len - done < IO_CHUNK ? (size_t)(s->len - done) : IO_CHUNK;
+      ssize_t r = pread(g_local, buf, n, (off_t)(s->off + done));
+      if(r <= 0 || write_all(c->fd, buf, (size_t)r) < 0) break;
+      s->crc = crc32c(s->crc, buf, (size_t)r);
+      done += (uint64_t)r;
+    }
+    free(buf);
+  }
+  if(done < s->len) {
+    snprintf(s->err, sizeof(s->err), "short send at %llu", (unsigned long long)done);
+    return -1;
+  }
+  return seg_verify(c, s);
+}
+
+static void* worker(void* arg) {
+  seg_t* s = arg;
+  conn_t* c = malloc(sizeof(*c));
+  if(!c) return NULL;
+  if(conn_open(c) < 0) {
+    snprintf(s->err, sizeof(s->err), "connect failed");
+  } else {
+    s->ok = (g_put ? seg_put(c, s) : seg_get(c, s)) == 0;
+    if(!s->ok && !s->err[0]) snprintf(s->err, sizeof(s->err), "transfer failed");
+    close(c->fd);
+  }
+  free(c);
+  return NULL;
+}
+
+/* ---- driver ---- */
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+    "usage: %s [-h host] [-p port] [-j streams] [-z] get <remote> <local>\n"
+    "       %s [-h host] [-p port] [-j streams] [-z] put <local> <remote>\n",
+    prog, prog);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  int streams = 4, opt;
+  while((opt = getopt(argc, argv, "h:p:j:z")) != -1) {
+    switch(opt) {
+    case 'h': g_host = optarg; break;
+    case 'p': g_port = atoi(optarg); break;
+    case 'j': streams = atoi(optarg); break;
+    case 'z': g_compress = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if(argc - optind != 3 || streams < 1 || streams > MAX_STREAMS) usage(argv[0]);
+  const char* dir = argv[optind];
+  if(!strcmp(dir, "put")) g_put = 1;
+  else if(strcmp(dir, "get")) usage(argv[0]);
+  const char* local = g_put ? argv[optind + 1] : argv[optind + 2];
+  const char* remote = g_put ? argv[optind + 2] : argv[optind + 1];
+  quote(g_remote, sizeof(g_remote), remote);
+
+  conn_t* ctl = malloc(sizeof(*ctl));
+  if(!ctl || conn_open(ctl) < 0) {
+    fprintf(stderr, "pxfer: cannot connect to %s:%d\n", g_host, g_port);
+    return 1;
+  }
+  char rec[512], cmd[1200];
+  if(g_put) {
+    g_local = open(local, O_RDONLY);
+    struct stat sb;
+    if(g_local < 0 || fstat(g_local, &sb) < 0) { perror(local); return 1; }
+    g_total = (uint64_t)sb.st_size;
+  } else {
+    rec[0] = 0;
+    snprintf(cmd, sizeof(cmd), "get -b -n 0 %s\n", g_remote);
+    if(write_all(ctl->fd, cmd, strlen(cmd)) < 0 ||
+       conn_wait_end(ctl, "get", rec, sizeof(rec)) != 0 || json_num(rec, "total") < 0) {
+      fprintf(stderr, "pxfer: %s: not a readable file on the console\n", remote);
+      return 1;
+    }
+    g_total = (uint64_t)json_num(rec, "total");
+    g_local = open(local, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if(g_local < 0 || ftruncate(g_local, (off_t)g_total) < 0) { perror(local); return 1; }
+  }
+
+  // equal ranges on SEG_ALIGN boundaries; small files use fewer streams
+  uint64_t per = (g_total / streams + SEG_ALIGN - 1) / SEG_ALIGN * SEG_ALIGN;
+  if(!per) per = SEG_ALIGN;
+  seg_t segs[MAX_STREAMS];
+  pthread_t th[MAX_STREAMS];
+  int nseg = 0;
+  for(uint64_t off = 0; nseg == 0 || off < g_total; off += per, nseg++) {
+    segs[nseg] = (seg_t){ .id = nseg, .off = off,
+                          .len = g_total - off < per ? g_total - off : per };
+  }
+  double t0 = now_s();
+  for(int i=0;i<nseg;i++) pthread_create(&th[i], NULL, worker, &segs[i]);
+  int failed = 0;
+  uint64_t wire = 0;
+  for(int i=0;i<nseg;i++) {
+    pthread_join(th[i], NULL);
+    wire += segs[i].wire;
+    if(!segs[i].ok) {
+      fprintf(stderr, "pxfer: segment %d (%llu+%llu): %s\n", i,
+              (unsigned long long)segs[i].off, (unsigned long long)segs[i].len, segs[i].err);
+      failed = 1;
+    }
+  }
+  double secs = now_s() - t0;
+  if(failed) return 1;
+
+  // every range matched on both ends; join them into the whole file's CRC
+  uint32_t crc = 0;
+  for(int i=0;i<nseg;i++) crc = crc32c_combine(crc, segs[i].crc, segs[i].len);
+  printf("%s %llu bytes in %.3f s, %.1f MB/s over %d streams, crc32c %08x ok\n",
+         g_put ? "put" : "get", (unsigned long long)g_total, secs,
+         secs > 0 ? g_total / secs / 1e6 : 0.0, nseg, crc);
+  if(g_compress)
+    printf("wire %llu bytes (%.2fx)\n", (unsigned long long)wire,
+           wire ? (double)g_total / wire : 0.0);
+  close(ctl->fd);
+  free(ctl);
+  close(g_local);
+  return 0;
+}